@@ -0,0 +1,72 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Pool for memory blocks
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+#include <wx/wx.h>
+#include <map>
+#include <vector>
+#include <mutex>
+#include "ItemStatus.h"
+
+/**
+ * a pool of memory blocks with fixed sizes
+ * released blocks are kept for the next request of the same size
+ * (up to maxFree per size), so that the render path
+ * does not need to allocate in steady state
+ * blocks are allocated with malloc
+ */
+class BufferPool : public ItemStatus{
+public:
+    BufferPool(size_t maxFree);
+    virtual ~BufferPool();
+    /**
+     * get a block
+     * @param size
+     * @return the block, NULL if no memory
+     */
+    unsigned char *     Get(size_t size);
+    /**
+     * return a block to the pool
+     * @param buffer
+     * @param size must be the size used in Get
+     */
+    void                Release(unsigned char *buffer,size_t size);
+    virtual wxString    ToJson();
+private:
+    typedef std::vector<unsigned char*> BlockList;
+    typedef std::map<size_t,BlockList> FreeMap;
+    FreeMap             freeBlocks;
+    size_t              maxFree;
+    std::mutex          lock;
+    unsigned long       numAllocated;
+    unsigned long       numReused;
+    unsigned long       numInUse;
+};
+
+#endif /* BUFFERPOOL_H */
+
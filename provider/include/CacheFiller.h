@@ -42,6 +42,7 @@ public:
     virtual wxString        ToJson() override;
 
 private:
+    friend class            CacheFillerTest;
     typedef  std::map<int,long> ZoomTiles;
     typedef  std::map<wxString,ZoomTiles> PrefillTiles;
     std::mutex              statusLock;
@@ -53,6 +54,13 @@ private:
     void                    ProcessRenderHints();
     void                    ProcessNextTile(TileInfo tile);
     void                    RenderTile(TileInfo tile,bool processingRenderHint);
+    /**
+     * check if a tile is already in the memory or disk cache
+     * for metatiles all tiles of the metatile are checked
+     * @param metaSize
+     * @return true if all tiles are cached
+     */
+    static bool             IsCached(ChartSet *set,TileInfo tile,int metaSize);
     long                    maxPrefillZoom;
     unsigned long           maxPerSet;
     wxString                currentPrefillSet;
@@ -30,11 +30,14 @@
 #include "RefCount.h"
 #include "ChartSet.h"
 #include "MD5.h"
+#include "Tiles.h"
 #include "ItemStatus.h"
 #include <map>
 #include <deque>
+#include <set>
+#include <vector>
+#include <atomic>
 #include <wx/wx.h>
-#include <wx/mstream.h>
 
 //a define that has to be changed with a new version 
 //if the rendering was adapted - whenever it is changed,
@@ -47,14 +50,23 @@ public:
         MEMORY=0,
         DISK_AND_MEMORY        
     } CacheMode;
-    wxMemoryOutputStream   *data;
+    unsigned char          *data;   //malloc'ed, owned by the entry
+    size_t                  length;
+    CacheEntry             *shared; //if set: the entry that owns our data
     unsigned long           insertTime;
     wxFileOffset            offset;
     CacheMode               mode;
-    MD5Name                 name;
-    bool                    prefill;
-    CacheEntry(MD5Name name,wxMemoryOutputStream *data):RefCount(){
+    TileKey                 name;
+    std::atomic<bool>       prefill; //cleared by coalesced requests
+    //links for the MemoryCache, only to be touched with the cache lock held
+    CacheEntry             *hashNext=NULL;
+    CacheEntry             *lruPrev=NULL;
+    CacheEntry             *lruNext=NULL;
+    int                     segment=0;
+    CacheEntry(TileKey name,unsigned char *data,size_t length):RefCount(){
         this->data=data;
+        this->length=length;
+        shared=NULL;
         offset=0;
         mode=MEMORY;
         insertTime=0;
@@ -62,8 +74,10 @@ public:
         prefill=false;
     }
     
-    CacheEntry(MD5Name name,wxMemoryOutputStream *data,wxFileOffset offset):RefCount(){
+    CacheEntry(TileKey name,unsigned char *data,size_t length,wxFileOffset offset):RefCount(){
         this->data=data;
+        this->length=length;
+        shared=NULL;
         this->offset=offset;
         mode=DISK_AND_MEMORY;
         insertTime=0;
@@ -71,13 +85,32 @@ public:
         prefill=false;
     }
     
-    CacheEntry(MD5Name name):RefCount(){
+    CacheEntry(TileKey name):RefCount(){
         mode=MEMORY;
         data=NULL;
+        length=0;
+        shared=NULL;
         offset=0;
         this->name=name;
         prefill=false;
     }
+    /**
+     * an entry that uses the data of another entry
+     * (deduplicated tiles)
+     * @param name
+     * @param shared will be ref'ed
+     */
+    CacheEntry(TileKey name,CacheEntry *shared):RefCount(){
+        mode=MEMORY;
+        data=NULL;
+        length=0;
+        this->shared=shared;
+        shared->Ref();
+        offset=0;
+        insertTime=0;
+        this->name=name;
+        prefill=false;
+    }
     /**
      * we assume that we can safely do this without any lock
      * from the writer/cleaner thread
@@ -91,29 +124,46 @@ public:
         this->offset=offset;
         mode=DISK_AND_MEMORY;
     }
+    /**
+     * the disk data is gone, the entry has to be written again
+     * same restrictions as SetOffset
+     */
+    void ClearOffset(){
+        offset=0;
+        mode=MEMORY;
+    }
     bool HasMemoryData(){
-        return data != NULL;
+        return data != NULL || shared != NULL;
+    }
+    bool IsShared(){
+        return shared != NULL;
     }
     bool HasDiskData(){
         return mode == DISK_AND_MEMORY;
     }
     size_t GetLength(){
+        if (shared != NULL) return shared->GetLength();
         if (data == NULL) return 0;
-        return data->GetLength();
+        return length;
     }
     unsigned char * GetData(){
-        if (data == NULL) return NULL;
-        return (unsigned char *)(data->GetOutputStreamBuffer()->GetBufferStart());
+        if (shared != NULL) return shared->GetData();
+        return data;
     }
     size_t GetCompleteSize(){
         //approximate... name: for entry name, for key and for entry vector
         //most probably some overhead - so we add some fixed overhead
+        //shared data is not counted here
+        if (shared != NULL) return sizeof(CacheEntry)+20;
         return GetLength()+sizeof(CacheEntry)+20;
     }
  private:    
     virtual ~CacheEntry(){
         if (data != NULL){
-            delete data;
+            free(data);
+        }
+        if (shared != NULL){
+            shared->Unref();
         }
     }
 };
@@ -121,83 +171,570 @@ public:
 class CacheFileWrite{
 public:
     /**
-     * write out an entry to disk
-     * do not modify the entry!
-     * @param entry
-     * @return 0 if error, offset otherwise
+     * write out a batch of entries to disk
+     * do not modify the entries!
+     * @param entries
+     * @param offsets for each entry: 0 if error, offset otherwise
+     * @return the number of entries written
      */
-    virtual wxFileOffset WriteToDisk(CacheEntry *entry)=0;
+    virtual long WriteToDisk(const std::vector<CacheEntry *> &entries,
+                    /*out*/std::vector<wxFileOffset> &offsets)=0;
 };
 
 
 typedef std::pair<wxString,CacheEntry *> CacheValue;
+
+/**
+ * the in memory cache entries
+ * an intrusive hash table (chained via CacheEntry::hashNext)
+ * and a segmented LRU (chained via CacheEntry::lruPrev/lruNext):
+ * evictable entries start in the probation segment and are moved
+ * to the protected segment on their next hit
+ * the protected segment is limited, its oldest entries fall back
+ * to probation, eviction always starts at the cold end of probation
+ * prefill entries are admitted at the cold end of probation,
+ * so they will only stay if they are requested before being evicted
+ * the cache holds one ref for each entry
+ * not thread safe - must be protected by the caller
+ */
+class MemoryCache{
+public:
+    typedef enum{
+        SEG_NONE=0,     //not evictable (e.g. waiting for write out)
+        SEG_PROBATION,
+        SEG_PROTECTED,
+        SEG_NUM
+    } Segment;
+    MemoryCache(unsigned long maxEntries);
+    ~MemoryCache();
+    CacheEntry *    Find(const TileKey &name);
+    /**
+     * insert an entry (no ref)
+     * @param entry
+     * @return the replaced entry - to be unref'ed by the caller
+     */
+    CacheEntry *    Insert(CacheEntry *entry);
+    /**
+     * remove an entry
+     * @param entry
+     * @return false if not found - otherwise the caller has to unref
+     */
+    bool            Remove(CacheEntry *entry);
+    /**
+     * an entry has been requested
+     * @param entry
+     */
+    void            Touch(CacheEntry *entry);
+    /**
+     * allow an entry to be evicted
+     * @param entry
+     */
+    void            MakeEvictable(CacheEntry *entry);
+    /**
+     * get the entry to be evicted next
+     * @return NULL if none
+     */
+    CacheEntry *    EvictionCandidate();
+    /**
+     * unref and remove all entries
+     */
+    void            Clear();
+    /**
+     * get all evictable entries (no ref)
+     * @param out
+     */
+    void            GetEntries(std::vector<CacheEntry*> &out);
+    unsigned long   Size(){return numEntries;}
+    unsigned long   SegmentSize(Segment s){return segmentSize[s];}
+    unsigned long   NumShared(){return numShared;}
+private:
+    unsigned long   Bucket(const TileKey &name);
+    void            Link(CacheEntry *entry,Segment s,bool atHead);
+    void            Unlink(CacheEntry *entry);
+    CacheEntry      **buckets;
+    unsigned long   bucketMask;
+    unsigned long   numEntries;
+    unsigned long   numShared;      //entries using the data of another entry
+    unsigned long   maxProtected;
+    CacheEntry      *head[SEG_NUM];
+    CacheEntry      *tail[SEG_NUM];
+    unsigned long   segmentSize[SEG_NUM];
+};
+
+//number of independently locked parts of the in memory cache
+#define CACHE_SHARDS 16
+//disk hits per shard we remember to promote a tile on its next hit
+#define RECENT_DISK_HITS 256
+
 class DiskCache;
+class DiskCacheEntry;
+class CacheBudget;
+class UniformTiles;
+class CacheFileReader;
+class CacheWriterImpl;
+class CacheReaderWriter;
+
+/**
+ * the data of a tile in a cache file
+ * can be sent without reading it into memory
+ * keeps the file open (even if the segment is removed) until deleted
+ */
+class DiskRange{
+public:
+    DiskRange(CacheFileReader *reader,wxFileOffset offset,size_t length);
+    ~DiskRange();
+    int             GetFd();
+    wxFileOffset    GetOffset(){return offset;}
+    size_t          GetLength(){return length;}
+private:
+    CacheFileReader *reader;
+    wxFileOffset    offset;
+    size_t          length;
+};
+
+/**
+ * usage of a segment of the disk cache
+ */
+class DiskSegmentInfo{
+public:
+    unsigned int    segment=0;
+    long            records=0;      //records still referenced by the index
+    unsigned long   hits=0;
+    long            lastAccess=0;   //seconds, 0 if not used since start
+};
 class CacheHandler : public ItemStatus{
-    typedef std::map<MD5Name,CacheEntry*> CacheMap;
+    /**
+     * a part of the in memory cache with its own lock
+     * the shard is selected by the upper bits of the key hash
+     */
+    class Shard{
+    public:
+        std::mutex      lock;
+        MemoryCache     cache;
+        size_t          bytes=0;
+        unsigned long   numMemoryHits=0;
+        unsigned long   numDiskHits=0;
+        unsigned long   numMisses=0;
+        unsigned long   numEvicted=0;
+        unsigned long   numDiskSent=0;
+        //keys (TileKey values) of recent disk hits that have not been promoted
+        std::set<unsigned long long>    recentDiskHits;
+        std::deque<unsigned long long>  recentDiskOrder;
+        Shard(unsigned long maxEntries):cache(maxEntries){}
+    };
+    typedef std::deque<CacheEntry*> WriteOutQueue;
+public:
+    //key (TilePart) and position of the records in the cache file
+    typedef std::vector<std::pair<unsigned long long,wxFileOffset> > DiskEntryList;
+    typedef std::vector<DiskSegmentInfo> DiskSegmentList;
 private:
-    size_t                          currentBytes;
-    std::mutex                      lock;
-    std::mutex                      fileLock;
-    CacheMap                        inMemoryCache;
-    std::deque<MD5Name>             writeOutQueue;
-    std::deque<MD5Name>             cleanupQueue;
+    Shard                           *shards[CACHE_SHARDS];
+    typedef std::map<unsigned int,CacheFileReader*> SegmentFiles;
+    std::mutex                      fileLock;   //only for changing segmentFiles
+    std::mutex                      writeLock;
+    WriteOutQueue                   writeOutQueue; //entries with a ref
+    std::mutex                      statusLock;
     unsigned long                   maxEntries;
+    CacheBudget                     *budget;
+    std::atomic<long>               lastAccess; //seconds
     unsigned long                   maxFileEntries;
-    wxString                        cacheFileName;
     wxString                        chartSetKey;
-    wxFile                          *cacheFile;
+    SegmentFiles                    segmentFiles; //one ref held by us
     DiskCache                       *diskCache;
+    unsigned long                   numCoalesced;
+    unsigned long                   numCoalescedPrefill;
+    UniformTiles                    *uniformTiles;
+    std::atomic<int>                generation;     //of the current settings variant
+    wxString                        generationVariants[TileKey::NUM_GENERATIONS];
+    std::atomic<long>               numPurged;
+    std::atomic<long>               numWriteDropped; //not written as the write queue was full
+    Shard *         GetShard(const TileKey &name){
+                        return shards[(name.Hash() >> 56) % CACHE_SHARDS];
+                    }
+    /**
+     * evict entries from a shard until it is below the high water mark
+     * @return the number of evicted entries
+     */
+    long            EvictShard(Shard *shard,unsigned long highWater,bool canWriteToDisk);
+    CacheEntry *    FindInMemory(TileKey name,bool readData);
+    /**
+     * remove all in memory entries of a generation
+     * @return the number of removed entries
+     */
+    long            PurgeGeneration(int generation);
+    /**
+     * find the disk cache entry, counts hits and misses
+     */
+    bool            FindDiskEntry(TileKey name,DiskCacheEntry &diskEntry);
+    /**
+     * read a tile from disk and add it to the memory cache
+     * @return the entry (with a ref) or NULL
+     */
+    CacheEntry *    ReadDiskEntry(TileKey name,DiskCacheEntry &diskEntry);
+    /**
+     * get the reader for a segment
+     * @return the reader (with a ref) or NULL
+     */
+    CacheFileReader * GetReader(unsigned int segment);
+    /**
+     * should a disk hit be added to the memory cache?
+     * true if the tile has been hit recently
+     */
+    bool            AdmitDiskHit(TileKey name);
 public:
-    CacheHandler(wxString chartSetKey,unsigned long maxEntries,unsigned long maxFileEntries);
+    /**
+     * @param chartSetKey
+     * @param maxEntries max number of in memory entries
+     * @param maxFileEntries
+     * @param budget if set the in memory entries are limited by this
+     *               global byte budget instead of maxEntries
+     * @param uniformTiles if set tiles read from disk will share
+     *               the data of known uniform tiles
+     */
+    CacheHandler(wxString chartSetKey,unsigned long maxEntries,unsigned long maxFileEntries,
+            CacheBudget *budget=NULL,UniformTiles *uniformTiles=NULL);
     virtual ~CacheHandler();
     void            Reset();
+    /**
+     * forget the disk cache (and the entries waiting to be written)
+     * but keep the in memory entries
+     * must only be called if there is no writer
+     */
+    void            ResetDisk();
+    /**
+     * set the current settings variant
+     * the in memory entries of other variants are kept, so switching
+     * back is served from memory - unless the generation has been
+     * used for different settings meanwhile
+     * only entries of the current generation will be written to disk
+     * @param generation the generation in the tile keys
+     * @param variant the settings variant id
+     */
+    void            SetVariant(int generation,wxString variant);
+    /**
+     * remove the in memory entries of a generation that has been
+     * used for other settings before
+     * must be called before tile keys with the generation are handed out
+     * @param generation the generation in the tile keys
+     * @param variant the settings variant id
+     */
+    void            ReserveGeneration(int generation,wxString variant);
     /**
      * add (and consume) entry
      * @param entry
      * @return 
      */
     bool            AddEntry(CacheEntry *entry);
-    CacheEntry      *FindEntry(MD5Name name,bool readData=true);
-    bool            HasDiskEntry(MD5Name);
-    bool            AddDiskEntry(MD5Name name,wxFileOffset offset);
-    long            RunCleanup(CacheFileWrite *writer,bool canWriteToDisk,int percentLevel=90);
-    bool            OpenCacheFile(wxString fileName,wxString hash);
+    CacheEntry      *FindEntry(TileKey name,bool readData=true);
+    /**
+     * find a tile that should be sent to a client
+     * memory hits and tiles that are hit again on disk will be returned
+     * as an entry (with a ref), other disk hits only as the range
+     * of the data in the cache file
+     * @param name
+     * @param range the data on disk if the return is NULL, must be deleted
+     * @return the entry or NULL
+     */
+    CacheEntry      *FindForSend(TileKey name,/*out*/DiskRange *&range);
+    bool            HasDiskEntry(TileKey name);
+    bool            AddDiskEntry(TileKey name,wxFileOffset offset);
+    /**
+     * get all entries of the disk cache (for the index file)
+     * @param out
+     */
+    void            GetDiskEntries(DiskEntryList &out);
+    /**
+     * write queued entries and evict entries from memory
+     * @param writer
+     * @param canWriteToDisk
+     * @param percentLevel
+     * @param maxBytes stop writing after this number of bytes
+     *        (at least one entry if >0), 0: only cleanup memory, -1: no limit
+     * @return the number of entries removed from memory
+     */
+    long            RunCleanup(CacheFileWrite *writer,bool canWriteToDisk,int percentLevel=90,
+                        long long maxBytes=-1);
+    /**
+     * open a segment of the cache file for reading
+     * @param segment
+     * @param fileName
+     * @param hash
+     * @return 
+     */
+    bool            OpenSegment(unsigned int segment,wxString fileName,wxString hash);
+    /**
+     * remove a segment from the disk cache
+     * entries from this segment that are still in memory
+     * will be written again (copied forward)
+     * must be called from the writer thread
+     * @param segment
+     * @return the number of entries that will be copied forward
+     */
+    long            CloseSegment(unsigned int segment);
+    void            GetSegments(DiskSegmentList &out);
     unsigned long   GetWriteQueueSize();
         
     unsigned long   MaxEntries(){return maxEntries;}
-    unsigned long   CurrentEntries(){
-                        Synchronized locker(lock);
-                        return (unsigned long)inMemoryCache.size();
-                    }
-    size_t          CurrentBytes(){
-                        return currentBytes;
-                    }
+    unsigned long   CurrentEntries();
+    size_t          CurrentBytes();
+    /**
+     * evict the least recently used entries
+     * @param bytes the number of bytes to free
+     * @return the number of bytes freed
+     */
+    size_t          EvictBytes(size_t bytes);
+    /**
+     * the last time (seconds) the cache was used by a request
+     */
+    long            LastAccess(){return lastAccess;}
     unsigned long   GetCompleteSizeKb();
     unsigned long   GetMaxSizeKb();
     unsigned long   CurrentDiskEntries();
     unsigned long   MaxDiskEntries();
+    /**
+     * count a render request that has been attached
+     * to an already running render for the same tile
+     * @param prefill
+     */
+    void            CountCoalesced(bool prefill);
     wxString        ToJson();
                      
 private:
 
 };
 
+//max number of colors we keep shared uniform tiles for
+#define MAX_UNIFORM_TILES 256
+
+/**
+ * shared entries for tiles with only one color (open sea, land, no data)
+ * used by all cache handlers, the number of colors is limited
+ */
+class UniformTiles{
+public:
+    UniformTiles(size_t maxColors=MAX_UNIFORM_TILES);
+    ~UniformTiles();
+    /**
+     * @param color 0xrrggbb
+     * @return the entry (with a ref) or NULL
+     */
+    CacheEntry *    Find(unsigned long color);
+    /**
+     * store the entry for a color
+     * @param color
+     * @param entry will be ref'ed if stored
+     * @return the entry to be used for the color (with a ref),
+     *         NULL if there is no room for more colors
+     */
+    CacheEntry *    Add(unsigned long color,CacheEntry *entry);
+    /**
+     * find an entry with exactly this data
+     * @return the entry (with a ref) or NULL
+     */
+    CacheEntry *    FindData(const unsigned char *data,size_t len);
+    size_t          Size();
+private:
+    typedef std::map<unsigned long,CacheEntry*> ColorMap;
+    typedef std::multimap<size_t,CacheEntry*> LengthMap;
+    std::mutex      lock;
+    ColorMap        byColor;
+    LengthMap       byLength;
+    size_t          maxColors;
+};
+
+/**
+ * a memory budget (in bytes of tile data) shared by all cache handlers
+ * if the sum of the handlers exceeds the budget
+ * entries are evicted from the least recently used chart sets first
+ */
+class CacheBudget : public ItemStatus{
+public:
+    CacheBudget(size_t maxBytes);
+    void            Register(CacheHandler *handler);
+    size_t          MaxBytes(){return maxBytes;}
+    size_t          CurrentBytes();
+    /**
+     * evict entries until we are below percentLevel of the budget
+     * @param percentLevel
+     * @return number of bytes freed
+     */
+    size_t          Enforce(int percentLevel);
+    virtual wxString ToJson();
+private:
+    typedef std::vector<CacheHandler*> HandlerList;
+    std::mutex      lock;
+    std::mutex      enforceLock;
+    HandlerList     handlers;
+    size_t          maxBytes;
+    unsigned long   numRuns;
+    unsigned long long bytesEvicted;
+};
+
+/**
+ * one thread doing the disk writes (and the memory cleanup) of all cache files
+ * the cache writers are served in the order of their files and write positions,
+ * the bytes written per second can be limited
+ * writing is delayed while disk reads for requests are pending
+ */
+class DiskScheduler : public Thread{
+public:
+    /**
+     * @param maxKbPerSecond write limit for all cache files, 0: no limit
+     */
+    DiskScheduler(long maxKbPerSecond=0);
+    virtual void        run();
+    void                Register(CacheReaderWriter *writer);
+    /**
+     * remove a writer, waits until a running write cycle for it is finished
+     */
+    void                Unregister(CacheReaderWriter *writer);
+    virtual wxString    ToJson();
+    /**
+     * count disk reads for requests
+     */
+    static void         ReadStarted();
+    static void         ReadFinished();
+    class ReadGuard{
+    public:
+        ReadGuard(){ReadStarted();}
+        ~ReadGuard(){ReadFinished();}
+    };
+private:
+    typedef std::vector<CacheReaderWriter*> WriterList;
+    /**
+     * wait while reads are pending
+     * @param maxMillis
+     * @return the time we waited
+     */
+    long                BackOff(long maxMillis);
+    std::mutex          lock;
+    Condition           cycleDone;
+    WriterList          writers;
+    CacheReaderWriter   *active;        //the writer in a write cycle
+    long long           maxBytesPerSecond;
+    long long           budget;         //bytes we can write now
+    unsigned long       numCycles;
+    unsigned long       numBackoffs;
+    long long           backoffMillis;
+    unsigned long       numThrottled;
+    unsigned long long  bytesWritten;
+    static std::atomic<int> pendingReads;
+};
+
+/**
+ * reads a cache file in its own thread
+ * afterwards the write cycles are run by the DiskScheduler
+ */
 class CacheReaderWriter : public Thread{
 public:
+    /**
+     * content hash to file offset for records
+     * that can be referenced by later records with the same data
+     */
+    typedef std::map<MD5Name,wxFileOffset> DedupIndex;
     typedef enum{
         STATE_NONE,
         STATE_READING,
         STATE_WRITING,
         STATE_ERROR        
     } RwState;
-    CacheReaderWriter(wxString fileName,wxString hash,CacheHandler *handler,long maxFileEntries);
+    /**
+     * @param fileName
+     * @param hash
+     * @param handler
+     * @param maxFileEntries
+     * @param resolver if set, cache files with the old (MD5) names will be converted
+     * @param scheduler runs the write cycles, without one the file is only read
+     */
+    CacheReaderWriter(wxString fileName,wxString hash,CacheHandler *handler,long maxFileEntries,
+            LegacyKeyResolver *resolver=NULL,DiskScheduler *scheduler=NULL);
     virtual             ~CacheReaderWriter();
     virtual             void run();
+    /**
+     * write queued entries, sync, roll and evict segments
+     * called by the DiskScheduler
+     * @param maxBytes see CacheHandler::RunCleanup
+     * @return the number of bytes written
+     */
+    long long           WriteCycle(long long maxBytes);
+    /**
+     * must be called after stop and join
+     * writes the remaining entries and the index
+     */
+    void                Finish();
+    /**
+     * the current write position (file, offset) for ordering the writes
+     */
+    wxString            WriteFile();
+    wxFileOffset        WritePosition();
     RwState             GetState();
     virtual wxString    ToJson();
+    typedef std::vector<unsigned int> SegmentList;
+    /**
+     * the name of the index file that belongs to a cache file
+     */
+    static wxString     IndexFileName(wxString cacheFile);
+    /**
+     * the number of entries of a cache that is not open
+     * @return the entries from its index, -1 if there is no valid index
+     */
+    static long         CountEntries(wxString cacheFile);
+    /**
+     * the name of a segment file of a cache
+     */
+    static wxString     SegmentFileName(wxString cacheFile,unsigned int segment);
+    /**
+     * find the existing segments of a cache (sorted)
+     */
+    static bool         FindSegments(wxString cacheFile,SegmentList &out);
+    /**
+     * remove all segments and the index of a cache
+     */
+    static bool         RemoveFiles(wxString cacheFile);
+    /**
+     * seconds between syncs of written records to the disk
+     * 0: sync after each batch
+     */
+    static void         SetSyncInterval(long seconds);
     
 private:
     bool            ReadFile();
+    /**
+     * read the records of a segment starting at start
+     * (0: from the beginning) and open it for reading
+     * a torn tail will be truncated
+     */
+    bool            ReadSegment(unsigned int segment,wxFileOffset start);
+    /**
+     * read the index file and add its entries to the disk cache
+     * @param found the existing segments
+     * @param dataEnd the end of the records covered by the index
+     * @return false if the index is missing or does not match the segments
+     */
+    bool            ReadIndex(const SegmentList &found,/*out*/wxFileOffset &dataEnd);
+    /**
+     * write an index file for all records up to dataEnd
+     * must be called from the writer thread
+     */
+    bool            WriteIndex(wxFileOffset dataEnd);
+    /**
+     * start writing to a new segment and close the current one
+     * on errors the current segment is kept
+     */
+    bool            StartSegment(unsigned int segment);
+    /**
+     * remove the coldest segment (never the current one)
+     * live entries of it that are still in memory are written again
+     * @param onlyEmpty only remove segments without live records
+     * @return true if a segment has been removed
+     */
+    bool            EvictSegment(bool onlyEmpty);
+    /**
+     * convert a file with the old record format
+     * records for tiles that cannot be resolved are dropped
+     * @return true if the file has been converted
+     */
+    bool            MigrateFile();
     bool            DeleteFile();
     wxString        fileName;
     wxString        hash;
@@ -207,7 +744,33 @@ private:
     long            maxFileEntries;
     long            initiallyRead;
     long            numWritten;
+    long            numRefs;
+    long long       bytesSaved;
+    long            numMigrated;
+    long            fromIndex;
+    unsigned long long indexSequence;
+    wxFileOffset    lastRecordPos;  //start of the last record
+    LegacyKeyResolver *resolver;
+    DedupIndex      dedupIndex;
     wxFileOffset    endPos;
+    SegmentList     segments;       //only used in the writer thread
+    unsigned int    currentSegment;
+    long            segmentRecords;
+    long            segmentLimit;
+    long            numSegments;
+    long            numEvicted;
+    long            numCopied;
+    long            numBatches;
+    long            numSyncs;
+    long            numCrcErrors;
+    DiskScheduler   *scheduler;
+    CacheWriterImpl *writer;        //during the write phase
+    bool            registered;
+    long            lastIndexTime;
+    long            lastSyncTime;
+    long            nextSegmentTry; //seconds, after a failed segment start
+    long            indexWritten;
+    static long     syncInterval;
 };
 
 
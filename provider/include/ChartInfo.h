@@ -111,6 +111,73 @@ public:
     }
 };
 
+/**
+ * the part of a tile that is not yet covered by charts
+ * kept as disjoint lat/lon rectangles in a fixed array (no allocations)
+ * if there is no room to split a rectangle it stays uncovered,
+ * so we only err to the side of looking for more charts
+ */
+class TileCoverage{
+public:
+    TileCoverage(LatLon &northwest,LatLon &southeast);
+    /**
+     * remove a rectangle from the uncovered area
+     */
+    void            Subtract(double north,double west,double south,double east);
+    bool            IsCovered() const {return numRects == 0;}
+    wxString        ToString() const;
+    //the complete tile
+    double          north;
+    double          west;
+    double          south;
+    double          east;
+private:
+    class Rect{
+    public:
+        double north;
+        double west;
+        double south;
+        double east;
+    };
+    static const int MAX_RECTS=32;
+    Rect            rects[MAX_RECTS];
+    int             numRects;
+    //smaller uncovered parts are ignored
+    double          minLat;
+    double          minLon;
+};
+
+/**
+ * a coverage polygon of a chart (COVR or NoCOVR table)
+ */
+class CoverPolygon{
+public:
+    std::vector<LatLon> points;
+    double          north=-90;
+    double          west=180;
+    double          south=90;
+    double          east=-180;
+    void            Add(double lat,double lon);
+    bool            Contains(double lat,double lon) const;
+    /**
+     * the rectangle and the polygon have common points
+     */
+    bool            Intersects(double north,double west,double south,double east) const;
+    /**
+     * the rectangle is completely inside the polygon
+     */
+    bool            Contains(double north,double west,double south,double east) const;
+    wxString        ToString() const;
+    /**
+     * parse a polygon written by ToString
+     */
+    static bool     FromString(wxString str,CoverPolygon &out);
+private:
+    bool            EdgeIntersects(double north,double west,double south,double east) const;
+};
+
+typedef std::vector<CoverPolygon> CoverList;
+
 class ObjectDescription{
 public:
     ObjectDescription(PI_S57Obj *obj);
@@ -149,6 +216,15 @@ private:
     bool            isOverlay=false;
     bool            isIgnored=false;
     int             index=-1;
+    //the areas covered by the chart, if empty: the extent
+    CoverList       covr;
+    //areas within covr that are not covered
+    CoverList       noCovr;
+    long            openMillis=0;   //time for the last open
+    long            memoryKb=0;     //memory used when open (estimated)
+    void            ReadCoverage();
+    bool            IntersectsCoverage(double north,double west,double south,double east);
+    bool            CoversRect(double north,double west,double south,double east);
          
 public:
     typedef enum{
@@ -171,7 +247,11 @@ public:
      * @return 
      */
     int         HasTile(LatLon &northwest,LatLon &southeast);
-    wxRegion    Covered(LatLon &northwest,LatLon &southeast, int regionSize=1000);
+    /**
+     * remove the area covered by this chart from a tile coverage
+     * @param onlyCovr if set charts without COVR polygons do not cover anything
+     */
+    void        Cover(TileCoverage &coverage,bool onlyCovr=false);
     bool        UpdateBoundings(/*inout*/BoundingBox *box);
     RenderResult Render(wxDC &out,const PlugIn_ViewPort& VPoint, const wxRegion &Region, int zoom);
     ObjectList  FeatureInfo(PlugIn_ViewPort& VPoint, float lat, float lon, float tolerance);
@@ -179,12 +259,33 @@ public:
     TileBox     GetTileBounds();
     bool        IsOpen();
     long        GetLastRender();
+    /**
+     * the cost for reopening the chart
+     * first estimated in Init from the header open and the file size
+     */
+    long        GetOpenMillis(){return openMillis;}
+    long        GetMemoryKb(){return memoryKb;}
+    /**
+     * record the measured cost of a (full) open
+     * @param millis
+     * @param memoryKb <= 0 if it could not be measured
+     */
+    void        SetOpenCost(long millis,long memoryKb);
     bool        Reopen(bool fullInit=false,bool allowRetry=false);
     bool        Close();
     wxString    GetFileName(){return filename;}
     int         FillInfo(const ZoomLevelScales *);
     ExtentPI    GetExtent(){return extent;}
-    void        FromCache(int nativeScale,ExtentPI extent);
+    /**
+     * @param covr the COVR polygons (see GetCoverage), empty: use the extent
+     * @param noCovr the NoCOVR polygons
+     */
+    void        FromCache(int nativeScale,ExtentPI extent,wxString covr=wxEmptyString,wxString noCovr=wxEmptyString);
+    /**
+     * the coverage polygons as a string for the chart info cache
+     * @param noCovr true: the NoCOVR polygons
+     */
+    wxString    GetCoverage(bool noCovr=false);
     bool        IsValid(){return isValid;}
     bool        IsRaster();
     bool        IsOverlay();
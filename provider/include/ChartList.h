@@ -34,8 +34,19 @@
 #include "Tiles.h"
 #include "ChartInfo.h"
 #include "ItemStatus.h"
+#include "SimpleThread.h"
+#include <map>
+#include <list>
+#include <unordered_map>
+#include <vector>
 
 
+/**
+ * the list of charts of a set
+ * for finding the charts of a tile we keep a grid index per zoom level
+ * (built on the first lookup after charts or zoom levels have changed)
+ * and remember the results of the most recently used lookups
+ */
 class ChartList : public ItemStatus{
     BoundingBox boundings;
 public:
@@ -43,7 +54,13 @@ public:
     ChartList();
     ~ChartList();
     void                AddChart(ChartInfo *chart);
-    WeightedChartList   FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp=2);
+    /**
+     * find the charts for a tile
+     * @param goUp number of zoom levels to go up if the tile is not covered
+     * @param cull remove charts that are completely hidden by better ones
+     */
+    WeightedChartList   FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp=2,
+                            bool cull=false);
     int                 GetSize(){return chartList.size();}
     BoundingBox &       GetBoundings(){return boundings;}
     int                 GetMinZoom(){return minZoom;}
@@ -54,9 +71,72 @@ public:
     virtual wxString    ToJson();
     int                 NumValidCharts();
 private:
+    /**
+     * the charts of one zoom level
+     * each chart is entered in all grid cells (tiles at gridZoom) its extent touches,
+     * charts that would need too many cells are kept in a separate list
+     */
+    class ZoomIndex{
+    public:
+        int             gridZoom=0;
+        std::unordered_map<unsigned long long,std::vector<int> > cells; //chart positions in chartList
+        std::vector<int> large;
+        void            Clear(){cells.clear();large.clear();}
+    };
+    class LookupKey{
+    public:
+        int             minZoom;
+        int             maxZoom;
+        int             goUp;
+        bool            cull;
+        double          north;
+        double          west;
+        double          south;
+        double          east;
+        LookupKey(int minZoom,int maxZoom,int goUp,bool cull,LatLon &northwest,LatLon &southeast);
+        bool operator < (const LookupKey &other) const;
+    };
+    typedef std::list<LookupKey> LookupOrder;
+    class LookupEntry{
+    public:
+        WeightedChartList       charts;
+        LookupOrder::iterator   position;   //in lookupOrder
+    };
+    typedef std::map<LookupKey,LookupEntry> LookupCache;
+    WeightedChartList   DoFindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp);
+    /**
+     * remove base charts that would be completely painted over by better ones
+     * only COVR polygons are used for this, as the extent of a chart
+     * could contain parts that have no data
+     * @return the number of removed charts
+     */
+    int                 CullHidden(WeightedChartList &charts,LatLon &northwest,LatLon &southeast);
+    /**
+     * get the valid charts for the zoom levels whose extent intersects the area
+     * (in the order of chartList)
+     */
+    InfoList            FindCandidates(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast);
+    /**
+     * must be called with indexLock held
+     */
+    void                BuildIndex();
+    /**
+     * charts or zoom levels have changed
+     */
+    void                InvalidateIndex();
     InfoList            chartList;
     int                 minZoom;
     int                 maxZoom;
+    std::mutex          indexLock;
+    ZoomIndex           zoomIndex[MAX_ZOOM+1];
+    bool                indexValid;
+    unsigned long       indexSequence;
+    LookupCache         lookups;
+    LookupOrder         lookupOrder;    //most recently used first
+    unsigned long       lookupHits;
+    unsigned long       lookupEvictions;
+    unsigned long       lookupMisses;
+    unsigned long       numCulled;
     
 };
 
@@ -31,6 +31,7 @@
 #include <map>
 #include <vector>
 #include <deque>
+#include <unordered_map>
 #include "ChartInfo.h"
 #include "ChartSetInfo.h"
 #include "ChartList.h"
@@ -70,7 +71,10 @@ public:
             STATE_READY        
     } ManagerState;
     ChartManager(SettingsManager *settings,ExtensionList *extensions);
-    typedef std::deque<ChartInfo*> ChartInfoQueue;
+    /**
+     * open charts with their priority for staying open
+     */
+    typedef std::unordered_map<ChartInfo*,double> OpenChartMap;
     /**
      * read all dirs and files and initially prepare the sets
      * this includes reading the chart info files
@@ -104,8 +108,23 @@ public:
     ChartSetMap *       GetChartSets();
     int                 GetNumCandidates();
     int                 GetNumCharts();
-    bool                StartCaches(wxString dataDir,long maxCacheEntries,long maxFileEntries);
+    /**
+     * create the caches for all sets
+     * @param dataDir
+     * @param maxCacheEntries max in memory entries (per set if there is no budget)
+     * @param maxFileEntries
+     * @param budgetKb if > 0: global memory budget for all sets
+     * @param writeKbPerSecond if > 0: limit for the disk cache writes of all sets
+     * @return 
+     */
+    bool                StartCaches(wxString dataDir,long maxCacheEntries,long maxFileEntries,long budgetKb=0,
+                            long writeKbPerSecond=0);
     bool                StartFiller(long maxPerSet,long maxPrefillZoom,bool waitReady=true);
+    /**
+     * the shared uniform tiles for all sets
+     * @return 
+     */
+    UniformTiles *      GetUniformTiles(){return uniformTiles;}
     /**
      * must be called from the main thread after
      * the settings manager did some updates
@@ -143,6 +162,13 @@ public:
     
     bool                Stop();
     ChartSet *          GetChartSet(wxString key);
+    /**
+     * ensure a chart to be open
+     * if the max number of open charts is reached, the chart with the
+     * lowest priority will be closed (greedy dual size: priority is the
+     * priority of the last closed chart + reopen time/memory at the last use)
+     * must be called from the main thread
+     */
     bool                OpenChart(ChartInfo *chart,bool allowRetry=false);
     virtual wxString    LocalJson();
     SettingsManager     *GetSettings();
@@ -168,12 +194,33 @@ public:
     bool                ReadChartInfoCache(wxFileConfig *config, int memKb);
 private:
     std::mutex          statusLock;
-    ChartInfoQueue      openCharts;
+    OpenChartMap        openCharts;
     int                 maxOpenCharts;
+    double              openInflation;  //priority of the last closed chart
+    unsigned long       numChartOpens;
+    unsigned long       numChartCloses;
+    unsigned long       numChartEvictions;
+    unsigned long long  chartOpenMillis;
+    double              OpenPriority(ChartInfo *chart);
+    /**
+     * remove the chart with the lowest priority from the open charts
+     * statusLock must be held, the chart must be closed afterwards
+     * @return the chart, NULL if there are no open charts
+     */
+    ChartInfo *         PickLeastValuable();
+    /**
+     * close charts that have been removed from the open charts
+     * statusLock must not be held
+     * @return the number of closed charts
+     */
+    int                 CloseCharts(std::vector<ChartInfo*> &charts,bool evicted);
     SettingsManager     *settings;
     unsigned int        memKb;
     ChartSetMap         chartSets;
     std::mutex          lock;   
+    CacheBudget         *cacheBudget;
+    UniformTiles        *uniformTiles;
+    DiskScheduler       *diskScheduler;
     ChartSet           *findOrCreateChartSet(wxFileName chartFile,bool mustExist=false,bool canDelete=false);
     int                 HandleCharts(wxArrayString &dirsAndFiles,bool setsOnly, bool canDelete=false);
     bool                HandleChart(wxFileName chartFile,bool setsOnly,bool canDeleteSet, int number);
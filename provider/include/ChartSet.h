@@ -38,9 +38,11 @@
 #include <map>
 class CacheHandler;
 class CacheReaderWriter;
+class UniformTiles;
+class DiskScheduler;
 class ChartList;
 class UpdateReceiverImpl;
-class ChartSet : public StatusCollector{
+class ChartSet : public StatusCollector, public LegacyKeyResolver{
 public:
     const int MAX_ERRORS_RETRY=10; //stop retrying after that many errors
     typedef enum{
@@ -67,8 +69,14 @@ public:
     int                 numCandidates;
     SetState            state;
     ChartSet(ChartSetInfo info, SettingsManager *settings, bool canDelete=false);
-    void                CreateCache(wxString dataDir,long maxEntries,long maxFileEntries);
+    void                CreateCache(wxString dataDir,long maxEntries,long maxFileEntries,CacheBudget *budget=NULL,
+                            DiskScheduler *scheduler=NULL,UniformTiles *uniformTiles=NULL);
     void                UpdateSettings(bool removeCacheFile=false);
+    /**
+     * drop the memory tiles of a generation that will be
+     * used for a new settings variant
+     */
+    void                ReserveGeneration(int generation,wxString variant);
     virtual             ~ChartSet(){
                             //TODO: remove cache and charts
                         }
@@ -94,7 +102,14 @@ public:
     bool                CacheReady();
     bool                CanDelete(){return canDelete;}
     bool                IsReady(){ return CacheReady() && state==STATE_READY;}
-    bool                SetTileCacheKey(/*inout*/TileInfo &tile);
+    //metaSize > 1: key for a metatile starting at tile
+    bool                SetTileCacheKey(/*inout*/TileInfo &tile,int metaSize=1);
+    /**
+     * find the tile keys for cache files of version 3
+     * only possible after the charts have been read
+     */
+    virtual long        ResolveLegacyKeys(const LegacyKeyResolver::NameSet &names,
+                            /*out*/LegacyKeyResolver::KeyMap &keys,long maxTiles) override;
     //set a cache render hint
     void                LastRequest(wxString sessionId,TileInfo tile);
     //get the list of last requests (and empty the internal store)
@@ -107,7 +122,8 @@ public:
     void                AddChart(ChartInfo *info);
     int                 GetMinZoom(){return charts->GetMinZoom();}
     void                GetOverview(int &minZoom /*out*/, int &maxZoom/*out*/, BoundingBox &boundings/*out*/);
-    WeightedChartList   FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp=2);
+    WeightedChartList   FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp=2,
+                            bool cull=false);
     ChartList::InfoList GetAllCharts(){return charts->GetAllCharts();}
     ChartList::InfoList GetZoomCharts(int zoom){return charts->GetZoomCharts(zoom);}
     int                 GetNumValidCharts(){return numValidCharts;}
@@ -115,19 +131,48 @@ public:
     long                GetSequence(){return settings->GetCurrentSequence();}
     double              GetScaleForZoom(int zoom);
     bool                ShouldRetryReopen(){return reopenErrors < 2;}
+    /**
+     * count the charts rendered for a tile
+     * only called from the main thread
+     */
+    void                CountChartRenders(int rendered){
+                            numChartRenders+=rendered;
+                        }
     
 
     
     
 private:
     ChartList           *charts;
-    wxString            GetCacheFileName();
+    /**
+     * the cache file for a settings variant
+     * (without a variant: the name used by older versions)
+     */
+    wxString            GetCacheFileName(wxString variant);
+    /**
+     * rename a cache file of an older version to the current variant
+     * (if there is none yet) and remove other old files
+     */
+    void                AdoptLegacyCache(wxString cacheFile);
+    /**
+     * remove the cache files of the least recently used variants
+     * and of those that leave too little room for the current one
+     * @param current the file of the current variant (never removed)
+     * @param keep number of other variants to keep
+     * @param maxEntries disk entries for all variants together
+     * @return the disk entries left for the current variant
+     */
+    long                EvictCacheVariants(wxString current,size_t keep,long maxEntries);
+    void                StartCacheWriter();
+    //the MD5 name used for tiles in cache files of version 3
+    MD5Name             LegacyTileKey(int zoom,int x,int y);
     typedef std::map<wxString,TileInfo> RequestMap;
     std::mutex          lock;
     RequestMap          lastRequests;
     MD5                 setToken;
     long                maxCacheEntries;
     long                maxDiskCacheEntries;
+    DiskScheduler       *diskScheduler;
     wxString            dataDir;
     SettingsManager *   settings;
     UpdateReceiverImpl *updater;
@@ -142,6 +187,8 @@ private:
     CandidateList       candidates;
     int                 numValidCharts;
     int                 chartIndex=0;   
+    int                 setId;
+    unsigned long       numChartRenders=0;
 };
 
 
@@ -27,34 +27,145 @@
 #ifndef MAINQUEUE_H
 #define MAINQUEUE_H
 #include <wx/wx.h>
+#include <deque>
 #include "RefCount.h"
 #include "RequestQueue.h"
+#include "ItemStatus.h"
 #include <mutex>
+#include <atomic>
 class MainMessage: public RefCount{
 public:
-    MainMessage();
+    /**
+     * priority classes, lower values will be handled first
+     */
+    typedef enum{
+        PRIO_INTERACTIVE=0, //tile requests from clients
+        PRIO_FEATURE,       //feature info requests
+        PRIO_ADMIN,         //settings, uploads,...
+        PRIO_HINT,          //render hints (surrounding of requested tiles)
+        PRIO_PREFILL,       //cache prefill
+        PRIO_NUM
+    } Priority;
+    MainMessage(Priority priority=PRIO_ADMIN);
     virtual void    Process(bool discard=false)=0;
     virtual void    SetDone();
     bool            WaitForResult(long timeout=0);
+    Priority        GetPriority(){return priority;}
+    /**
+     * set a deadline - after this the message will be discarded
+     * instead of being processed
+     * @param timeout in ms from now, 0 for no deadline
+     */
+    void            SetDeadline(long timeout);
+    bool            IsExpired();
+    /**
+     * a caller starts waiting for the result
+     * this will clear a cancellation if the message has not been processed yet
+     */
+    void            AddWaiter();
+    /**
+     * a caller gave up waiting (timeout, client disconnected)
+     * if this was the last waiting caller the message is cancelled
+     * @return true if the message is now cancelled
+     */
+    bool            GiveUp();
+    bool            IsCancelled();
+    /**
+     * the message has been cancelled and was queued again
+     * with a lower priority (see MainQueue::Demote)
+     */
+    bool            IsDemoted(){return demoted;}
+    /**
+     * a key for the resources the message needs (e.g. the charts to render)
+     * non interactive messages with the same key will be processed
+     * back to back if possible
+     * @param affinity 0 for none
+     */
+    void            SetAffinity(unsigned long affinity){this->affinity=affinity;}
 protected:
     virtual         ~MainMessage();
     std::mutex      lock;
     Condition       *waiter;
-    bool            isDone;    
+    bool            isDone;
+    std::atomic<Priority> priority; //changed by MainQueue under its lock
+    wxLongLong      deadline;
+    int             numWaiters;
+    bool            cancelled;
+    std::atomic<bool> demoted;
+    unsigned long   affinity;
+    int             bypassed;   //number of times other messages have been preferred
+    friend class    MainQueue;
 };
 
 
-class MainQueue {
+class MainQueue : public ItemStatus{
 public:
     MainQueue();
     void        Loop(wxApp * app);
     void        Stop();
     virtual     ~MainQueue();
+    /**
+     * enqueue a message
+     * @param msg
+     * @param timeout max wait time if onlyIfEmpty is set, 0 for no timeout
+     * @param onlyIfEmpty only enqueue if there are no messages with the same
+     *                    or a higher priority waiting
+     * @return 
+     */
     bool        Enqueue(MainMessage *msg,long timeout,bool onlyIfEmpty=false);
+    /**
+     * move a queued message to a higher priority
+     * (e.g. a prefill that is now requested by a client)
+     * messages that are not waiting in this queue any more are left unchanged
+     * @param msg
+     * @param priority
+     * @param timeout new deadline if later than the current one
+     */
+    void        Promote(MainMessage *msg,MainMessage::Priority priority,long timeout=0);
+    /**
+     * queue a cancelled message again with a lower priority
+     * to be called while processing the message
+     * the message will be ref'ed
+     * @param msg
+     * @param priority
+     * @param timeout the new deadline
+     * @return false if not queued
+     */
+    bool        Demote(MainMessage *msg,MainMessage::Priority priority,long timeout);
+    /**
+     * count a cancelled message that has been skipped
+     * @param priority
+     */
+    void        CountCancelled(MainMessage::Priority priority);
+    /**
+     * number of waiting messages for a priority
+     * @param priority
+     * @return 
+     */
+    long        NumQueued(MainMessage::Priority priority);
+    virtual wxString ToJson();
 private:
-    typedef RequestQueue<MainMessage> Queue;
-    Queue   queue;
-    bool    shouldStop;
+    typedef std::deque<MainMessage*> Queue;
+    MainMessage *Dequeue(long timeout);
+    /**
+     * get the next message from a queue
+     * for non interactive messages prefer the ones with the same affinity
+     * as the last processed message (within a limited window)
+     * lock must be held
+     */
+    MainMessage *TakeNext(int priority);
+    bool        HasWaiting(MainMessage::Priority priority);
+    Queue       queues[MainMessage::PRIO_NUM];
+    long        numProcessed[MainMessage::PRIO_NUM];
+    long        numExpired[MainMessage::PRIO_NUM];
+    long        numCancelled[MainMessage::PRIO_NUM];
+    long        numDemoted[MainMessage::PRIO_NUM];
+    long        numReordered[MainMessage::PRIO_NUM];
+    unsigned long lastAffinity;
+    std::mutex  lock;
+    Condition   *readCondition;
+    Condition   *writeCondition;
+    std::atomic<bool> shouldStop;
 };
 
 #endif /* MAINQUEUE_H */
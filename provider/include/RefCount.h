@@ -26,12 +26,15 @@
  */
 #ifndef REFCOUNT_H
 #define REFCOUNT_H
-#include <wx/thread.h>
+#include <atomic>
 
+/**
+ * a lock free reference count
+ * the object is deleted when the last ref is gone
+ */
 class RefCount{
 private: 
-    int     count;
-    wxMutex lock;
+    std::atomic<int> count;
 protected:    
     virtual ~RefCount();
 public:
@@ -0,0 +1,164 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Render Worker processes
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#ifndef RENDERWORKER_H
+#define RENDERWORKER_H
+#include <wx/wx.h>
+#include <vector>
+#include <sys/types.h>
+#include <atomic>
+#include "SimpleThread.h"
+#include "RequestQueue.h"
+#include "StatusCollector.h"
+#include "MainQueue.h"
+
+class RenderMessage;
+class Renderer;
+class ChartManager;
+
+/**
+ * the parent side of a render worker process
+ * the process is started by re-executing our own binary in worker mode
+ * (forking the running wx application with loaded plugins is not safe)
+ * requests are send via a socket pair, the RGB result is returned
+ * in a shared memory area that is passed to the child
+ * if the child is not (yet) ready or fails, the message is handed over
+ * to the main queue
+ */
+class RenderWorker : public Thread{
+public:
+    typedef enum{
+        STATE_NONE,
+        STATE_STARTING,
+        STATE_READY,
+        STATE_ERROR
+    } WorkerState;
+    RenderWorker(int index,wxString exe,wxArrayString args,
+            ChartManager *manager,MainQueue *mainQueue,long timeout);
+    virtual             ~RenderWorker();
+    virtual void        run();
+    virtual wxString    ToJson();
+    /**
+     * add a message to the queue of this worker
+     * @param msg
+     * @return false if the worker is not ready
+     */
+    bool                Enqueue(RenderMessage *msg);
+    bool                IsReady(){return state == STATE_READY;}
+    /**
+     * number of messages queued or in progress
+     * @return
+     */
+    long                GetLoad();
+private:
+    typedef RequestQueue<RenderMessage> Queue;
+    bool                StartChild();
+    void                StopChild(bool kill=false);
+    bool                WaitForHello(long timeout);
+    void                HandleMessage(RenderMessage *msg);
+    void                FallBack(RenderMessage *msg);
+    void                DrainQueue(bool discard);
+    int                 index;
+    wxString            exe;
+    wxArrayString       args;
+    ChartManager        *manager;
+    MainQueue           *mainQueue;
+    long                timeout;
+    Queue               queue;
+    std::atomic<WorkerState> state;    //written by the worker thread only
+    pid_t               pid;
+    int                 socket;
+    int                 shmFd;
+    unsigned char       *shm;
+    long                startSequence;
+    unsigned long       requestSequence;
+    std::mutex          statusLock;
+    long                queueLen;
+    bool                busy;
+    long                numRendered;
+    long                numErrors;
+    long                numFallback;
+    long                numStarts;
+    long                busyTime;       //100us units since last status
+    long                lastStatusTime;
+    double              utilization;
+};
+
+class RenderWorkerPool : public StatusCollector{
+public:
+    /**
+     * @param numWorkers
+     * @param exe the executable to start
+     * @param args the command line args for the child (without worker specific ones)
+     * @param params the positional parameters
+     * @param logBase the base name for the child log files
+     */
+    RenderWorkerPool(int numWorkers,wxString exe,wxArrayString args,wxArrayString params,
+            wxString logBase,ChartManager *manager,MainQueue *mainQueue,long timeout);
+    virtual             ~RenderWorkerPool();
+    void                Start();
+    void                Stop();
+    /**
+     * hand over the message to an idle worker
+     * @param msg
+     * @return false if no worker is idle
+     */
+    bool                Enqueue(RenderMessage *msg);
+    virtual wxString    LocalJson();
+private:
+    typedef std::vector<RenderWorker*> WorkerList;
+    WorkerList          workers;
+    long                numDispatched;
+    long                numRejected;
+    std::mutex          lock;
+};
+
+/**
+ * the child side of the worker process
+ * reads requests from the socket and renders them via the main queue
+ * will stop the main queue on EOF
+ */
+class RenderWorkerChild : public Thread{
+public:
+    /**
+     * @param spec the worker spec from the command line: socketFd,shmFd,index
+     */
+    RenderWorkerChild(wxString spec,ChartManager *manager,MainQueue *queue);
+    virtual             ~RenderWorkerChild();
+    bool                IsOk();
+    virtual void        run();
+private:
+    int                 socket;
+    int                 shmFd;
+    int                 index;
+    unsigned char       *shm;
+    ChartManager        *manager;
+    MainQueue           *queue;
+};
+
+#endif /* RENDERWORKER_H */
+
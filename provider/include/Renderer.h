@@ -37,12 +37,14 @@
 #include "ChartList.h"
 #include "RequestQueue.h"
 #include "CacheHandler.h"
-#include "ChartList.h"
 #include "ChartManager.h"
 #include "MainQueue.h"
+#include "TileEncoder.h"
+#include "BufferPool.h"
 
 class CacheEntry;
 class Renderer;
+class RenderWorkerPool;
 class RenderMessageBase : public MainMessage{
 protected:
     bool            renderOk;
@@ -62,7 +64,7 @@ protected:
     virtual ~RenderMessageBase();
 public:
     RenderMessageBase(TileInfo &tile,ChartSet *set,Renderer *renderer,
-            long settingsSequence);
+            long settingsSequence,Priority priority=PRIO_INTERACTIVE);
     TileInfo            GetTile(){return tile;}
     wxString            GetTimings();
     void                SetDequeueTime();
@@ -79,31 +81,71 @@ public:
 
 class RenderMessage : public RenderMessageBase{
 public:
+    /**
+     * @param tile the tile (for metatiles: the upper left one)
+     * @param metaSize number of tiles in x and y direction (1,2,4)
+     */
     RenderMessage(TileInfo &tile,ChartSet *set,Renderer *renderer,
-            long settingsSequence);
+            long settingsSequence,Priority priority=PRIO_INTERACTIVE,int metaSize=1);
     void                StoreResult(CacheEntry *e,bool ok);
     void                StoreResult(wxImage &result,bool ok); 
+    /**
+     * store a raw RGB result (TILE_SIZE*TILE_SIZE*3 bytes)
+     * used when rendering in a worker process
+     * @param rgb
+     * @param ok
+     */
+    void                StoreResult(const unsigned char *rgb,bool ok);
+    /**
+     * get the raw RGB data (if any)
+     * only valid before CreateFinalResult
+     * @return 
+     */
+    const unsigned char *GetRenderResult(){return renderResult;}
+    int                 GetMetaSize(){return metaSize;}
+    int                 GetPixelSize(){return metaSize*TILE_SIZE;}
+    size_t              GetResultSize(){return GetPixelSize()*GetPixelSize()*3;}
     /**
      * create the final result (if not yet available)
      * the final result is the png encoded data in a CacheEntry
+     * (one for each tile of a metatile)
      * will do nothing if already there
-     * @return 
+     * can be called from multiple threads if requests have been coalesced
+     * @return true if the result has been created by this call
      */
     
     bool                CreateFinalResult(wxColor &back);
+    /**
+     * a real request has been attached to this message
+     * so the result will not be marked as prefill
+     */
+    void                ClearPrefill();
     /**
      * get the cached result (if any)
      * will ref the result
+     * @param tile for metatiles: the tile we need
      * @return 
      */
-    CacheEntry          *GetCacheResult();
+    CacheEntry          *GetCacheResult(TileInfo *tile=NULL);
+    size_t              NumResults();
+    /**
+     * get a result by index (will ref the result)
+     * @param index
+     * @return 
+     */
+    CacheEntry          *GetCacheResultAt(size_t index);
     virtual void        Process(bool discard=false);
     
     virtual ~RenderMessage();
     
 protected:
-    CacheEntry    * cacheResult;
-    unsigned char * renderResult;
+    typedef std::vector<CacheEntry*> ResultList;
+    ResultList      cacheResults;
+    unsigned char * renderResult;   //from the renderer pixel pool
+    void            ReleaseRenderResult();
+    int             metaSize;
+    bool            prefill;
+    std::mutex      resultLock;
    
 };
 class FeatureInfoMessage : public RenderMessageBase{
@@ -144,10 +186,47 @@ private:
      * @return true: message ok, false: message deleted (via unref)
      */
     bool            PrepareRenderMessage(ChartSet *set, TileInfo &tile
-                        ,RenderMessageBase* msg, bool allLower=false);
+                        ,RenderMessageBase* msg, bool allLower=false,int metaSize=1);
+    /**
+     * open a chart for rendering, set the message to done on errors
+     */
+    bool            OpenChartForRender(RenderMessage *msg,ChartInfo *chart);
     wxBitmap        *initialBitmap;
+    wxBitmap        *metaBitmap=NULL;
+    int             metaTileSize=1;
     wxColor         backColor;
     long            renderTimeout=8000; //ms    
+    RenderWorkerPool *workers=NULL;
+    TileEncoder     encoder;
+    BufferPool      pixelPool;
+    typedef std::map<TileKey,RenderMessage*> InFlightMap;
+    /**
+     * render messages currently queued or rendering
+     * further requests for the same tile will wait for them
+     */
+    InFlightMap     inFlight;
+    std::mutex      inFlightLock;
+    /**
+     * find an in flight message for the tile
+     * @return the message (with a ref) or NULL
+     */
+    RenderMessage * FindInFlight(ChartSet *set,TileKey key,long sequence);
+    bool            AddInFlight(RenderMessage *msg);
+    /**
+     * wait for a render result
+     * if a client socket is given, give up early if the client disconnects
+     * @return true if the message is done
+     */
+    bool            WaitForRender(RenderMessage *msg,int clientSocket);
+    /**
+     * should a cancelled message still be rendered for the cache?
+     */
+    bool            KeepCancelled(RenderMessage *msg);
+    /**
+     * add all results of a message to the cache of its set
+     */
+    void            StoreInCache(RenderMessage *msg);
+    void            RemoveInFlight(RenderMessage *msg);
     
 public:
     MainQueue           *queue;
@@ -155,13 +234,95 @@ public:
     static Renderer*    Instance();
     static void         CreateInstance(ChartManager *manager,MainQueue *queue, long timeout=8000);
     
-    RenderResult        renderTile(ChartSet *set,TileInfo &tile, /*out*/CacheEntry *&result,long timeout=0,bool forCache=false);
+    /**
+     * render a tile (or get it from the cache)
+     * @param set
+     * @param tile
+     * @param result
+     * @param timeout queue timeout for cache requests
+     * @param forCache prefill/render hint request
+     * @param isHint render hint request (higher priority then prefill)
+     * @param clientSocket if set: stop waiting if the client disconnects
+     * @param diskRange if set: tiles only found on disk can be returned here
+     *                  (instead of result) to be sent directly from the cache file
+     * @return 
+     */
+    RenderResult        renderTile(ChartSet *set,TileInfo &tile, /*out*/CacheEntry *&result,long timeout=0,bool forCache=false,bool isHint=false,int clientSocket=-1,
+                            /*out*/DiskRange **diskRange=NULL);
     /**
      * must be called in the main thread
      * @param msg
      * @param manager
      */
     void                DoRenderTile(RenderMessage *msg);
+    /**
+     * check if a message still needs to be rendered
+     * (settings sequence, active set, late cache hit)
+     * if not, the message will be set to done
+     * @param msg
+     * @return true if the message must be rendered
+     */
+    bool                CheckRenderMessage(RenderMessage *msg);
+    /**
+     * queue a cancelled or expired message again as prefill
+     * to get the result into the cache
+     * to be called while processing the message
+     * @param msg
+     * @return true if the message has been queued again
+     */
+    bool                TryDemote(RenderMessage *msg);
+    /**
+     * called after processing a demoted (cancelled) message
+     * stores the result in the cache if nobody waits for it
+     * @param msg
+     */
+    void                FinishDemoted(RenderMessage *msg);
+    /**
+     * render a tile and copy the raw RGB data into out
+     * used in render worker processes, must not be called from the main thread
+     * @param set
+     * @param tile
+     * @param out buffer with TILE_SIZE*TILE_SIZE*3 bytes
+     * @return 
+     */
+    RenderResult        RenderRaw(ChartSet *set,TileInfo &tile,unsigned char *out);
+    /**
+     * set a pool of render worker processes
+     * if set, tile requests are handed over to the workers
+     * @param workers
+     */
+    void                SetWorkers(RenderWorkerPool *workers){this->workers=workers;}
+    /**
+     * the PNG encoder for tiles
+     * can be used from any thread
+     * @return 
+     */
+    TileEncoder *       GetEncoder(){return &encoder;}
+    /**
+     * the pool for the RGB render results
+     * @return 
+     */
+    BufferPool *        GetPixelPool(){return &pixelPool;}
+    /**
+     * get the shared entry for tiles with only one color
+     * it will be encoded on first use
+     * @param color 0xrrggbb
+     * @param transparent
+     * @return the entry (with a ref) or NULL if there are too many colors
+     */
+    CacheEntry *        GetUniformTile(unsigned long color,const wxColor &transparent);
+    /**
+     * set the metatile size (1,2,4) used for prefill and render hints
+     * must be called before the first render
+     * @param size
+     */
+    void                SetMetaTileSize(int size);
+    /**
+     * the metatile size to be used for a zoom level
+     * @param zoom
+     * @return 
+     */
+    int                 GetMetaTileSize(int zoom);
     wxString            FeatureRequest(ChartSet *set,TileInfo &tile,double lat, double lon, double tolerance);
 };
 
@@ -29,6 +29,9 @@
 #include "UserSettingsBase.h"
 #include "MD5.h"
 #include "Types.h"
+#include "Tiles.h"
+#include <mutex>
+#include <atomic>
 #include <wx/fileconf.h>
 
 
@@ -42,6 +45,31 @@ public:
     const UserSettingsEntry *GetConfigDescription(wxString name);
     bool                    AddSettingsToMD5(MD5 *md5);
     long                    GetCurrentSequence();
+    /**
+     * an id for the values of all settings that change tiles
+     * (MD5 hex), switching back to earlier settings gives the same id
+     * this is the variant set by the last PublishVariant
+     */
+    wxString                GetVariant();
+    /**
+     * the generation used in tile keys for the current variant
+     * the last TileKey::NUM_GENERATIONS variants keep their generation,
+     * the least recently used one gives it up for a new variant
+     * lock free, called for every tile
+     */
+    int                     GetVariantSlot();
+    /**
+     * compute the variant for the current settings and reserve its generation
+     * tile keys will only use it after PublishVariant, so entries of the
+     * generation can be removed before
+     * @param slot the generation for the variant
+     * @return the variant
+     */
+    wxString                PrepareVariant(/*out*/int &slot);
+    /**
+     * make the last prepared variant the current one
+     */
+    void                    PublishVariant();
     bool                    StoreBaseSettings(bool sendJson=false);
     typedef enum{
         SET_CHANGE,
@@ -88,6 +116,16 @@ private:
     wxString        configFile;
     wxFileConfig *  config;
     long            configSequence;
+    std::mutex      variantLock;
+    long            variantSequence;
+    wxString        variant;
+    int             preparedSlot;
+    wxString        preparedVariant;
+    std::atomic<int> variantSlot;
+    wxString        slotVariants[TileKey::NUM_GENERATIONS];
+    long            slotUsed[TileKey::NUM_GENERATIONS];
+    long            variantUse;
+    void            UpdateVariant();
     double          baseScale;
     int             overZoom;
     int             underZoom;
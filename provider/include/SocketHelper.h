@@ -34,6 +34,11 @@
 #include <ifaddrs.h>
 #include <errno.h>
 #include <sys/select.h>
+#ifdef __APPLE__
+#include <sys/uio.h>
+#else
+#include <sys/sendfile.h>
+#endif
 #include "Logger.h"
 
 typedef struct sockaddr_storage SocketAddress; //will allow us to hide OS stuff
@@ -275,6 +280,26 @@ public:
         fcntl(rt,F_SETFD,FD_CLOEXEC);
         return rt;
     }
+    /**
+     * check (without waiting) if the peer has closed the connection
+     * pending request data (e.g. a pipelined request) is not consumed
+     * @param socket
+     * @return true if closed or in error
+     */
+    static bool IsClosed(int socket){
+        if (socket < 0) return false;
+        fd_set fds;
+        struct timeval tv={0,0};
+        FD_ZERO(&fds);
+        FD_SET(socket,&fds);
+        int rt=select(socket+1,&fds,NULL,NULL,&tv);
+        if (rt <= 0) return false;
+        char ch;
+        rt=recv(socket,&ch,1,MSG_PEEK|MSG_DONTWAIT);
+        if (rt == 0) return true;
+        if (rt < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return true;
+        return false;
+    }
     static int Read(int socket,char *buffer, int len,long timeout=0){
         
         if (! WaitFor(socket,timeout)) return -1;
@@ -308,6 +333,46 @@ public:
         }
         return len;
     }
+    /**
+     * send a part of a file without copying it through user space
+     * @return the number of bytes sent, -1 on errors
+     */
+    static long SendFile(int socket,int fd,off_t offset,long len,long timeout=0){
+        long remain=len;
+        wxLongLong start = wxGetLocalTimeMillis();
+        wxLongLong end=start+timeout;
+        wxLongLong current=start;
+        while (remain > 0 &&(timeout == 0 || (current >= start && current <=end))){
+#ifdef __APPLE__
+            off_t sent=remain;
+            int rt=sendfile(fd,socket,offset,&sent,NULL,0);
+            if (rt < 0 && sent <= 0 && errno != EAGAIN && errno != EINTR){
+                LogSysError(rt,"sendfile",socket);
+                return -1;
+            }
+            if (rt == 0 && sent == 0) break; //end of file
+            if (sent < 0) sent=0;
+            offset+=sent;
+#else
+            ssize_t sent=sendfile(socket,fd,&offset,remain);
+            if (sent < 0 && errno != EAGAIN && errno != EINTR){
+                LogSysError(sent,"sendfile",socket);
+                return -1;
+            }
+            if (sent == 0) break; //end of file
+            if (sent < 0) sent=0;
+#endif
+            remain-=sent;
+            current=wxGetLocalTimeMillis();
+            if (remain > 0 && sent == 0){
+                //the socket is non blocking
+                long wait=(timeout == 0)?0:(end-current).ToLong();
+                if (timeout != 0 && wait <= 0) break;
+                if (! WaitFor(socket,wait,false)) return -1;
+            }
+        }
+        return len-remain;
+    }
 };
 
 
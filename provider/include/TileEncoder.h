@@ -0,0 +1,111 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  PNG encoder for tiles
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#ifndef TILEENCODER_H
+#define TILEENCODER_H
+#include <wx/wx.h>
+#include <set>
+#include <vector>
+#include <mutex>
+#include "ColorTable.h"
+#include "ItemStatus.h"
+
+/**
+ * a PNG encoder for rendered tiles
+ * vector charts only use a small number of colors from the S-52 color table,
+ * so we write palette images (1,2,4 or 8 bit) whenever a tile has at most
+ * 256 colors and fall back to RGB otherwise (raster charts, anti aliased text)
+ * the transparent color is always written via a tRNS chunk
+ * Encode can be called from multiple threads, the working buffers
+ * (and the zlib state) are kept in a pool of contexts
+ */
+class TileEncoder : public ItemStatus{
+public:
+    TileEncoder();
+    virtual ~TileEncoder();
+    /**
+     * set the colors we expect in tiles
+     * must be called before the first Encode
+     * @param table
+     */
+    void                SetColorTable(ColorTable &table);
+    /**
+     * encode a part of an RGB buffer as PNG
+     * @param rgb the first pixel to encode
+     * @param width
+     * @param height
+     * @param stride bytes per row in rgb
+     * @param transparent the color to be written as transparent
+     * @param result the PNG data, allocated with malloc in exactly the needed size
+     * @param len the length of result
+     * @return false on errors
+     */
+    bool                Encode(const unsigned char *rgb,int width,int height,int stride,
+                            const wxColor &transparent,
+                            /*out*/unsigned char *&result,/*out*/size_t &len);
+    /**
+     * check if all pixels of an RGB area have the same color
+     * uses SSE2/NEON if available
+     * @param rgb
+     * @param width
+     * @param height
+     * @param stride
+     * @param color the color (0xrrggbb) if uniform
+     * @return 
+     */
+    static bool         IsUniform(const unsigned char *rgb,int width,int height,int stride,
+                            /*out*/unsigned long &color);
+    virtual wxString    ToJson();
+private:
+    typedef std::vector<unsigned char> Buffer;
+    class Context;
+    typedef std::vector<Context*> ContextList;
+    Context *           GetContext();
+    void                ReleaseContext(Context *context);
+    bool                BuildPalette(Context *context,const unsigned char *rgb,int width,int height,int stride,
+                            unsigned long transparent);
+    bool                EncodePalette(Context *context,int width,int height);
+    bool                EncodeRgb(Context *context,const unsigned char *rgb,int width,int height,int stride,
+                            unsigned long transparent);
+    bool                WriteImageData(Context *context);
+    void                WriteChunk(Buffer &out,const char *type,
+                            const unsigned char *data,size_t len);
+    void                WriteHeader(Buffer &out,int width,int height,
+                            int bitDepth,int colorType);
+    std::set<unsigned long> knownColors;
+    ContextList         freeContexts;
+    std::mutex          statusLock;
+    unsigned long       numContexts;
+    unsigned long       numPalette;
+    unsigned long       numRgb;
+    unsigned long       numForeign;     //palette tiles with colors not in the table
+    unsigned long long  bytesPalette;
+    unsigned long long  bytesRgb;
+};
+
+#endif /* TILEENCODER_H */
+
@@ -28,11 +28,130 @@
 #define _TILES_H
 
 #include <sys/time.h>
+#include <map>
+#include <set>
 #include "georef.h"
 #include "MD5.h"
 
 #define TILE_SIZE 256
 
+/**
+ * the key for a tile in the caches
+ * packed into 64 bits (high to low):
+ * set id (7), settings generation (2), metatile size (2, log2), zoom (5), x (24), y (24)
+ * the generation is the slot of the settings variant (see SettingsManager)
+ * the set id and the generation only matter in memory,
+ * on disk we use the TilePart as each set and variant has its own files
+ */
+class TileKey{
+private:
+    unsigned long long value;
+    static const int Y_SHIFT=0;
+    static const int X_SHIFT=24;
+    static const int ZOOM_SHIFT=48;
+    static const int META_SHIFT=53;
+    static const int GEN_SHIFT=55;
+    static const int SET_SHIFT=57;
+    static const unsigned long long XY_MASK=0xffffffULL;
+    static const unsigned long long TILE_MASK=(1ULL << GEN_SHIFT)-1;
+public:
+    static const int MAX_SET_ID=0x7f;
+    static const int NUM_GENERATIONS=4;
+    TileKey(){
+        value=0;
+    }
+    TileKey(int setId,long generation,int zoom,int x,int y,int metaSize=1){
+        unsigned long long meta=0;
+        while ((1 << meta) < metaSize && meta < 3) meta++;
+        value=((unsigned long long)(setId & MAX_SET_ID) << SET_SHIFT)
+                | ((unsigned long long)(generation & 3) << GEN_SHIFT)
+                | (meta << META_SHIFT)
+                | ((unsigned long long)(zoom & 0x1f) << ZOOM_SHIFT)
+                | (((unsigned long long)x & XY_MASK) << X_SHIFT)
+                | (((unsigned long long)y & XY_MASK) << Y_SHIFT);
+    }
+    static TileKey FromValue(unsigned long long value){
+        TileKey rt;
+        rt.value=value;
+        return rt;
+    }
+    /**
+     * check if a tile can be represented by a key
+     */
+    static bool IsValidTile(int zoom,int x,int y){
+        if (zoom < 0 || zoom > 0x1f) return false;
+        if (x < 0 || y < 0) return false;
+        return ((unsigned long long)x <= XY_MASK && (unsigned long long)y <= XY_MASK);
+    }
+    unsigned long long GetValue() const{
+        return value;
+    }
+    /**
+     * the key without set id and generation
+     * (as stored in the cache file)
+     */
+    TileKey TilePart() const{
+        return FromValue(value & TILE_MASK);
+    }
+    /**
+     * a key for another tile with the same set id and generation
+     */
+    TileKey WithTile(int zoom,int x,int y,int metaSize=1) const{
+        return TileKey(GetSetId(),value >> GEN_SHIFT,zoom,x,y,metaSize);
+    }
+    int GetSetId() const{ return (int)(value >> SET_SHIFT);}
+    int GetGeneration() const{ return (int)((value >> GEN_SHIFT) & 3);}
+    int GetZoom() const{ return (int)((value >> ZOOM_SHIFT) & 0x1f);}
+    int GetX() const{ return (int)((value >> X_SHIFT) & XY_MASK);}
+    int GetY() const{ return (int)((value >> Y_SHIFT) & XY_MASK);}
+    int GetMetaSize() const{ return 1 << ((value >> META_SHIFT) & 3);}
+    /**
+     * a well mixed hash of the key
+     * (x and y alone would only use a few low bits)
+     */
+    unsigned long long Hash() const{
+        unsigned long long h=value;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+    bool operator==(const TileKey &other) const{
+        return value == other.value;
+    }
+    bool operator!=(const TileKey &other) const{
+        return value != other.value;
+    }
+    bool operator<(const TileKey &other) const{
+        return value < other.value;
+    }
+    wxString ToString() const{
+        return wxString::Format(_T("%d/%d:%d/%d/%d"),GetSetId(),(int)((value >> GEN_SHIFT) & 3),
+                GetZoom(),GetX(),GetY());
+    }
+};
+
+/**
+ * find the tile keys for the names used in cache files
+ * of version 3 (MD5 over the set and the tile)
+ * used once to migrate old cache files
+ */
+class LegacyKeyResolver{
+public:
+    typedef std::set<MD5Name> NameSet;
+    typedef std::map<MD5Name,TileKey> KeyMap;
+    /**
+     * @param names the names to look for
+     * @param keys the found keys (only TilePart)
+     * @param maxTiles max number of tiles to check
+     * @return number of found keys, -1 if we need to try again later
+     */
+    virtual long ResolveLegacyKeys(const NameSet &names,/*out*/KeyMap &keys,long maxTiles)=0;
+    virtual ~LegacyKeyResolver(){}
+};
+
 
 //taken from http://wiki.openstreetmap.org/wiki/Slippy_map_tilenames
 
@@ -57,7 +176,7 @@ public:
     int zoom=0;
     bool valid=false;
     wxString chartSetKey;
-    MD5Name  cacheKey;
+    TileKey  cacheKey;
     TileInfo(){}
     TileInfo(wxString url,wxString chartSetKey){
         if (sscanf(url.c_str(), "%d/%d/%d", &zoom, &x, &y) != 3) {
@@ -98,7 +217,7 @@ public:
             return wxString::Format(_T("tile z=%d,x=%d,y=%d"),zoom,x,y);
         }
     }
-    MD5Name GetCacheKey(){
+    TileKey GetCacheKey(){
         return cacheKey;
     }
 };
@@ -130,6 +249,17 @@ public:
         float diff=(base-floor(base))*TILE_SIZE;
         return diff;
     }
+    /**
+     * absolute pixel positions at zoom level z
+     * (used to compute offsets within a view port that can be larger then a tile)
+     */
+    static double lat2pixely(double lat, int z){
+        double latrad = lat * PI / 180.0;
+        return (1.0 - asinh(tan(latrad)) / PI) / 2.0 * (1 << z) * (double)TILE_SIZE;
+    }
+    static double lon2pixelx(double lon, int z){
+        return (lon + 180.0) / 360.0 * (1 << z) * (double)TILE_SIZE;
+    }
 
     static double tilex2long(int x, int z) {
         return x / (double) (1 << z) * 360.0 - 180;
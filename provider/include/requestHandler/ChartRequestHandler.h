@@ -209,11 +209,19 @@ public:
         it = query->find("featureInfo");
         if (it == query->end()) {
             CacheEntry *ce = NULL;
-            Renderer::RenderResult rt = Renderer::Instance()->renderTile(set, tile, ce);
+            DiskRange *range = NULL;
+            Renderer::RenderResult rt = Renderer::Instance()->renderTile(set, tile, ce,0,false,false,request->socket,&range);
             if (rt != Renderer::RENDER_OK) return new HTTPResponse();
-            //the Cache entry is now owned by the response
-            //and will be unrefed there
-            HTTPResponse *response = new HTTPBufferResponse("image/png", ce);
+            HTTPResponse *response = NULL;
+            if (range != NULL){
+                //sent directly from the cache file
+                response = new HTTPDiskResponse("image/png", range);
+            }
+            else{
+                //the Cache entry is now owned by the response
+                //and will be unrefed there
+                response = new HTTPBufferResponse("image/png", ce);
+            }
             long timeSave = Logger::MicroSeconds100();
             LOG_DEBUG(_T("http render: all=%ld"),
                     (timeSave - start)*100
@@ -57,6 +57,12 @@ public:
     virtual bool SupportsChunked(){return false;}
     virtual unsigned long GetLength(){return 0;}
     virtual const unsigned char * GetData(/*inout*/unsigned long &maxLen){return NULL;}
+    /**
+     * responses that can be sent directly from a file (sendfile)
+     * @param offset the start of the data in the file
+     * @return the file descriptor or -1
+     */
+    virtual int GetFile(/*out*/wxFileOffset &offset){return -1;}
 };
 
 
@@ -75,6 +81,27 @@ public:
     virtual const unsigned char * GetData(unsigned long &maxLen){ return entry->GetData();}
 };
 
+/**
+ * a tile from the disk cache that is sent directly from the cache file
+ */
+class HTTPDiskResponse : public HTTPResponse{
+private:
+    DiskRange *range;
+public:
+    HTTPDiskResponse(wxString mimeType,DiskRange *range):
+        HTTPResponse(mimeType){
+        this->range=range;
+    }
+    virtual ~HTTPDiskResponse(){
+        delete range;
+    }
+    virtual unsigned long GetLength(){return range->GetLength();}
+    virtual int GetFile(wxFileOffset &offset){
+        offset=range->GetOffset();
+        return range->GetFd();
+    }
+};
+
 class HTTPStringResponse : public HTTPResponse{
 protected:
     wxString data;
@@ -0,0 +1,102 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Pool for memory blocks
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#include "BufferPool.h"
+#include "SimpleThread.h"
+#include "StringHelper.h"
+#include <stdlib.h>
+
+BufferPool::BufferPool(size_t maxFree) {
+    this->maxFree=maxFree;
+    numAllocated=0;
+    numReused=0;
+    numInUse=0;
+}
+
+BufferPool::~BufferPool() {
+    FreeMap::iterator it;
+    for (it=freeBlocks.begin();it != freeBlocks.end();it++){
+        for (size_t i=0;i<it->second.size();i++){
+            free(it->second[i]);
+        }
+    }
+}
+
+unsigned char * BufferPool::Get(size_t size){
+    {
+        Synchronized locker(lock);
+        numInUse++;
+        FreeMap::iterator it=freeBlocks.find(size);
+        if (it != freeBlocks.end() && it->second.size() > 0){
+            unsigned char *rt=it->second.back();
+            it->second.pop_back();
+            numReused++;
+            return rt;
+        }
+        numAllocated++;
+    }
+    unsigned char *rt=(unsigned char *)malloc(size);
+    if (rt == NULL){
+        Synchronized locker(lock);
+        numInUse--;
+    }
+    return rt;
+}
+
+void BufferPool::Release(unsigned char* buffer, size_t size){
+    if (buffer == NULL) return;
+    {
+        Synchronized locker(lock);
+        numInUse--;
+        BlockList &list=freeBlocks[size];
+        if (list.size() < maxFree){
+            list.push_back(buffer);
+            return;
+        }
+    }
+    free(buffer);
+}
+
+wxString BufferPool::ToJson(){
+    Synchronized locker(lock);
+    unsigned long numFree=0;
+    FreeMap::iterator it;
+    for (it=freeBlocks.begin();it != freeBlocks.end();it++){
+        numFree+=it->second.size();
+    }
+    return wxString::Format(wxT("{"
+        JSON_IV(allocated,%lu) ",\n"
+        JSON_IV(reused,%lu) ",\n"
+        JSON_IV(inUse,%lu) ",\n"
+        JSON_IV(free,%lu) "\n"
+        "}"),
+        numAllocated,
+        numReused,
+        numInUse,
+        numFree
+    );
+}
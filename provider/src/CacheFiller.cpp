@@ -185,8 +185,13 @@ void CacheFiller::RenderPrefill(ChartSet *currentSet) {
             for (it=boxes.begin();it != boxes.end();it++){
                 TileBox bounds=(*it);
                 if (renderZoom <= maxPrefillZoom) {
-                    for (int x = bounds.xmin; x <= bounds.xmax; x++) {
-                        for (int y = bounds.ymin; y <= bounds.ymax; y++) {
+                    //with metatiles the renderer will fill the complete
+                    //metatile, so we only need to request the first one
+                    int metaSize=Renderer::Instance()->GetMetaTileSize(renderZoom);
+                    int xstart=bounds.xmin-(bounds.xmin % metaSize);
+                    int ystart=bounds.ymin-(bounds.ymin % metaSize);
+                    for (int x = xstart; x <= bounds.xmax; x+=metaSize) {
+                        for (int y = ystart; y <= bounds.ymax; y+=metaSize) {
                             SleepPaused();
                             if (shouldStop()) return;
                             TileInfo info(
@@ -254,12 +259,27 @@ void CacheFiller::CheckRenderHints() {
                     current.x=current.x*2;
                     current.y=current.y*2;
                 }
+                int metaSize=Renderer::Instance()->GetMetaTileSize(current.zoom);
                 for (int x = current.x - SURROUND; x <= current.x + SURROUND; x++) {
                     if (x < 0) continue;
                     if (x >= (1 << current.zoom)) continue;
                     for (int y = current.y - SURROUND; y <= current.y + SURROUND; y++) {
                         if (y < 0) continue;
                         if (y >= (1 << current.zoom)) continue;
+                        if (metaSize > 1){
+                            //request each metatile only once
+                            TileInfo metaTile(current.zoom, x-(x % metaSize), y-(y % metaSize), current.chartSetKey);
+                            bool found=false;
+                            for (auto it=renderHints.begin();it != renderHints.end();it++){
+                                if (it->zoom == metaTile.zoom && it->x == metaTile.x && 
+                                        it->y == metaTile.y && it->chartSetKey == metaTile.chartSetKey){
+                                    found=true;
+                                    break;
+                                }
+                            }
+                            if (! found) renderHints.push_back(metaTile);
+                            continue;
+                        }
                         renderHints.push_back(TileInfo(current.zoom, x, y, current.chartSetKey));
                     }
                 }
@@ -289,6 +309,28 @@ void CacheFiller::ProcessNextTile(TileInfo tile){
     RenderTile(tile,false);
 }
 
+bool CacheFiller::IsCached(ChartSet *set,TileInfo tile,int metaSize){
+    CacheHandler *handler=set->cache;
+    if (metaSize < 1) metaSize=1;
+    int xstart=tile.x-(tile.x % metaSize);
+    int ystart=tile.y-(tile.y % metaSize);
+    int maxTile=1 << tile.zoom;
+    for (int x=xstart;x < xstart+metaSize && x < maxTile;x++){
+        for (int y=ystart;y < ystart+metaSize && y < maxTile;y++){
+            TileInfo current(tile.zoom,x,y,tile.chartSetKey);
+            set->SetTileCacheKey(current);
+            CacheEntry *entry=handler->FindEntry(current.GetCacheKey(), false);
+            if (entry != NULL){
+                entry->Unref();
+                continue;
+            }
+            if (handler->HasDiskEntry(current.GetCacheKey())) continue;
+            return false;
+        }
+    }
+    return true;
+}
+
 void CacheFiller::RenderTile(TileInfo tile,bool processingRenderHint) {
     CacheEntry *entry = NULL;
     ChartSet *set = manager->GetChartSet(tile.chartSetKey);
@@ -329,22 +371,19 @@ void CacheFiller::RenderTile(TileInfo tile,bool processingRenderHint) {
         prefillTiles[set->GetKey()][tile.zoom]++;    
     }
     set->SetTileCacheKey(tile);
+    //the renderer will render the complete metatile for prefills
+    int metaSize=Renderer::Instance()->GetMetaTileSize(tile.zoom);
     Renderer::RenderResult rendered = Renderer::RENDER_QUEUE;
     LOG_DEBUG(wxT("Cache filler - render tile %s"), tile.ToString());
     while (!shouldStop() && rendered == Renderer::RENDER_QUEUE) {
-        if ((entry = handler->FindEntry(tile.GetCacheKey(), false)) != NULL) {
+        if (IsCached(set,tile,metaSize)) {
             LOG_DEBUG(wxT("CacheFiller %s cache hit for %s"), tile.chartSetKey, tile.ToString(true));
-            entry->Unref();
-            break;
-        }
-        if (handler->HasDiskEntry(tile.GetCacheKey())) {
-            LOG_DEBUG(wxT("CacheFiller %s disk cache hit for %s"), tile.chartSetKey, tile.ToString(true));
             break;
         }
 
         rendered = Renderer::Instance()->renderTile(
                 set,
-                tile, entry, 100, true);
+                tile, entry, 100, true, processingRenderHint);
         if (rendered == Renderer::RENDER_OK) {
             entry->Unref();
             LOG_DEBUG(wxT("Cache filler - finished render tile %s"), tile.ToString(true));
@@ -26,12 +26,21 @@
  */
 
 #include <wx/time.h>
+#include <wx/dir.h>
+#include <wx/filename.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <algorithm>
 #include "CacheHandler.h"
 #include "Logger.h"
 #include "Renderer.h"
 #include "HTTPd/HTTPServer.h"
 #include "MD5.h"
 #include "SystemHelper.h"
+#include <zlib.h>
 
 //max len must be 256x256x4 plus png overhead
 #define MAX_DATALEN 300000
@@ -45,23 +54,215 @@ typedef struct{
 typedef struct{
     char            magic[4];
     unsigned char   headerLen;
+    unsigned char   flags;
     unsigned int    version;
     unsigned int    dataLen;
-    MD5Name         name;
+    unsigned long long key;      //TileKey::TilePart
+    MD5Name         contentHash; //only valid with RECORD_HASHED
+    long long       refOffset;   //only valid with RECORD_REF
+    unsigned int    crc;         //CRC32C of the header (with crc 0) and the data
 } RecordHeader;
 
-#define CURRENT_VERSION 3
+//index file, written from time to time and on stop
+//allows to skip reading all records that are covered by it
+typedef struct{
+    char            magic[8];
+    unsigned int    version;
+    char            token[MD5_LEN*2];
+    unsigned long long sequence;    //incremented with each index written
+    long long       dataEnd;        //the index covers all records before
+    long long       lastRecord;     //offset of the last record before dataEnd
+    unsigned long long lastKey;     //key of this record
+    unsigned int    numEntries;
+    unsigned int    numDedup;
+    unsigned int    numSegments;    //segment numbers follow the dedup entries
+    unsigned int    checksum;       //crc32 of the header (checksum 0) and all entries
+} IndexHeader;
+
+typedef struct{
+    unsigned long long key;
+    long long       offset;
+} IndexEntry;
+
+typedef struct{
+    MD5Name         contentHash;
+    long long       offset;
+} IndexDedupEntry;
+
+#define INDEX_MAGIC "AVOINDEX"
+//seconds between index writes (if something has been written)
+#define INDEX_INTERVAL 300
+
+//record header of version 3 (single file caches)
+//the name was an MD5 over set and tile
+typedef struct{
+    char            magic[4];
+    unsigned char   headerLen;
+    unsigned int    version;
+    unsigned int    dataLen;
+    MD5Name         name;
+} LegacyRecordHeader;
+
+//the record has a content hash and can be referenced
+#define RECORD_HASHED 1
+//the record has no data but refers to a RECORD_HASHED record at refOffset
+#define RECORD_REF 2
+//only small tiles are considered for deduplication on disk
+//(uniform and nearly empty tiles), this limits the size of the index
+#define DEDUP_MAX_LEN 4096
+#define DEDUP_MAX_INDEX 50000
+
+//version 6: records with a CRC
+#define CURRENT_VERSION 6
+#define LEGACY_VERSION 3
+//max number of tiles we check when converting a legacy file
+#define MIGRATE_MAX_TILES 4000000
+//records written at once when converting
+#define MIGRATE_BATCH 200
 #define FILE_MAGIC "AVOCACHE"
+//the cache is split into segment files (<name>.avcache.<n>)
+//positions in the cache are segment << SEGMENT_SHIFT | offset in the segment
+#define SEGMENT_SHIFT 40
+#define SEGMENT_POS(segment,offset) ((((wxFileOffset)(segment)) << SEGMENT_SHIFT) | (offset))
+#define SEGMENT_OF(pos) ((unsigned int)((pos) >> SEGMENT_SHIFT))
+#define SEGMENT_OFFSET(pos) ((pos) & ((((wxFileOffset)1) << SEGMENT_SHIFT)-1))
+//number of segments we split the allowed disk entries into
+#define NUM_SEGMENTS 16
+//start a new segment after this size even if the record limit is not reached
+#define MAX_SEGMENT_SIZE (256LL*1024*1024)
+#define SEGMENT_DIGITS 8
+//seconds to wait before retrying to start a new segment
+#define SEGMENT_RETRY 60
 #define RECORDMAGIC "AVOR"
 
+//CRC32C (Castagnoli) for the cache records
+//uses the SSE4.2/ARMv8 crc instructions if available
+//and a slicing-by-8 table otherwise
+#define CRC32C_POLY 0x82F63B78
+
+class Crc32cTable{
+public:
+    uint32_t table[8][256];
+    Crc32cTable(){
+        for (uint32_t i=0;i<256;i++){
+            uint32_t crc=i;
+            for (int k=0;k<8;k++){
+                crc=(crc & 1)?((crc >> 1) ^ CRC32C_POLY):(crc >> 1);
+            }
+            table[0][i]=crc;
+        }
+        for (uint32_t i=0;i<256;i++){
+            for (int t=1;t<8;t++){
+                table[t][i]=(table[t-1][i] >> 8) ^ table[0][table[t-1][i] & 0xff];
+            }
+        }
+    }
+};
+
+static uint32_t crc32cSoft(uint32_t crc,const unsigned char *data,size_t len){
+    static Crc32cTable tables;
+    const uint32_t (*t)[256]=tables.table;
+    crc=~crc;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (len >= 8){
+        uint32_t low,high;
+        memcpy(&low,data,4);
+        memcpy(&high,data+4,4);
+        low^=crc;
+        crc=t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^
+            t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+            t[3][high & 0xff] ^ t[2][(high >> 8) & 0xff] ^
+            t[1][(high >> 16) & 0xff] ^ t[0][high >> 24];
+        data+=8;
+        len-=8;
+    }
+#endif
+    while (len > 0){
+        crc=t[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+        data++;
+        len--;
+    }
+    return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHw(uint32_t crc,const unsigned char *data,size_t len){
+    uint64_t c=~crc & 0xffffffffU;
+    while (len >= 8){
+        uint64_t v;
+        memcpy(&v,data,8);
+        c=_mm_crc32_u64(c,v);
+        data+=8;
+        len-=8;
+    }
+    while (len > 0){
+        c=_mm_crc32_u8((uint32_t)c,*data);
+        data++;
+        len--;
+    }
+    return ~(uint32_t)c;
+}
+static bool crc32cHasHw(){
+    static bool hasHw=__builtin_cpu_supports("sse4.2");
+    return hasHw;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+static uint32_t crc32cHw(uint32_t crc,const unsigned char *data,size_t len){
+    crc=~crc;
+    while (len >= 4){
+        uint32_t v;
+        memcpy(&v,data,4);
+        crc=__crc32cw(crc,v);
+        data+=4;
+        len-=4;
+    }
+    while (len > 0){
+        crc=__crc32cb(crc,*data);
+        data++;
+        len--;
+    }
+    return ~crc;
+}
+static bool crc32cHasHw(){
+    return true;
+}
+#else
+static uint32_t crc32cHw(uint32_t crc,const unsigned char *data,size_t len){
+    return crc32cSoft(crc,data,len);
+}
+static bool crc32cHasHw(){
+    return false;
+}
+#endif
+
+/**
+ * update a CRC32C (start with 0)
+ */
+static uint32_t crc32c(uint32_t crc,const void *data,size_t len){
+    if (crc32cHasHw()) return crc32cHw(crc,(const unsigned char *)data,len);
+    return crc32cSoft(crc,(const unsigned char *)data,len);
+}
+
+static uint32_t recordCrc(const RecordHeader *rheader,const unsigned char *data){
+    RecordHeader copy=*rheader;
+    copy.crc=0;
+    uint32_t crc=crc32c(0,&copy,sizeof(copy));
+    if (rheader->dataLen > 0 && data != NULL) crc=crc32c(crc,data,rheader->dataLen);
+    return crc;
+}
+
 
 /**
  * open a cache file for reading
  * @param fileName
  * @param hash
+ * @param version the expected file version
  * @return NULL on any error
  */
-static wxFile * openCacheFile(wxString fileName, wxString hash) {
+static wxFile * openCacheFile(wxString fileName, wxString hash,unsigned int version=CURRENT_VERSION) {
     if (!wxFileExists(fileName)) return NULL;
     FileHeader fheader;
     wxFile *file = new wxFile(fileName, wxFile::read);
@@ -85,7 +286,7 @@ static wxFile * openCacheFile(wxString fileName, wxString hash) {
         delete file;
         return NULL;
     }
-    if (fheader.version != CURRENT_VERSION) {
+    if (fheader.version != version) {
         LOG_INFO(wxT("unknown file version %d detected in %s"), fheader.version, fileName);
         file->Close();
         delete file;
@@ -108,21 +309,24 @@ static wxFile * openCacheFile(wxString fileName, wxString hash) {
     return file;
 }
 
-bool readAndCheckHeader(wxString fileName, wxFile *file, RecordHeader *rheader) {
-    wxFileOffset pos=file->Tell();
-    int rt = file->Read(rheader, sizeof (RecordHeader));
-    if (rt != sizeof (RecordHeader)) {
-        LOG_INFO(wxT("unable to read record header in %s at %lld"),
-                fileName,(long long)pos);
-        return false;
-    }
+static bool writeFileHeader(wxFile *file, wxString hash) {
+    FileHeader fheader;
+    memcpy(fheader.magic, FILE_MAGIC, sizeof (fheader.magic));
+    fheader.version = CURRENT_VERSION;
+    fheader.headerLen = sizeof (fheader);
+    memcpy(fheader.token, hash.ToAscii().data(), sizeof (fheader.token));
+    int wr = file->Write(&fheader, sizeof (fheader));
+    return wr == sizeof (fheader);
+}
+
+static bool checkRecordHeader(wxString fileName, RecordHeader *rheader, wxFileOffset pos) {
     if (memcmp(rheader->magic, RECORDMAGIC, sizeof (RecordHeader::magic)) != 0) {
         LOG_INFO(wxT("invalid record magic in %s at %lld"),
                 fileName,(long long)pos);
         return false;
     }
     if (rheader->version != CURRENT_VERSION) {
-        LOG_INFO(wxT("invalid record version in %s at %lld"),
+        LOG_INFO(wxT("invalid record version %d in %s at %lld"),
                 rheader->version,
                 fileName,(long long)pos);
         return false;
@@ -136,10 +340,65 @@ bool readAndCheckHeader(wxString fileName, wxFile *file, RecordHeader *rheader)
     return true;
 }
 
+bool readAndCheckHeader(wxString fileName, wxFile *file, RecordHeader *rheader) {
+    wxFileOffset pos=file->Tell();
+    int rt = file->Read(rheader, sizeof (RecordHeader));
+    if (rt != sizeof (RecordHeader)) {
+        LOG_INFO(wxT("unable to read record header in %s at %lld"),
+                fileName,(long long)pos);
+        return false;
+    }
+    return checkRecordHeader(fileName, rheader, pos);
+}
+
+/**
+ * read access to the cache file for disk hits
+ * uses positional reads (pread), so any number of threads
+ * can read concurrently without sharing a file position
+ * the writer appends via its own file handle
+ * the file is closed when the last reader has finished
+ */
+class CacheFileReader : public RefCount{
+private:
+    wxFile      *file;
+    wxString    fileName;
+protected:
+    virtual ~CacheFileReader(){
+        file->Close();
+        delete file;
+    }
+public:
+    CacheFileReader(wxString fileName,wxFile *file):RefCount(){
+        this->fileName=fileName;
+        this->file=file;
+    }
+    bool ReadAt(wxFileOffset pos,void *buffer,size_t len){
+        size_t done=0;
+        while (done < len){
+            ssize_t rd=pread(file->fd(),(char *)buffer+done,len-done,pos+done);
+            if (rd < 0 && errno == EINTR) continue;
+            if (rd <= 0) return false;
+            done+=rd;
+        }
+        return true;
+    }
+    bool ReadHeader(wxFileOffset pos,RecordHeader *rheader){
+        if (! ReadAt(pos,rheader,sizeof(RecordHeader))){
+            LOG_INFO(wxT("unable to read record header in %s at %lld"),
+                fileName,(long long)pos);
+            return false;
+        }
+        return checkRecordHeader(fileName,rheader,pos);
+    }
+    int GetFd(){
+        return file->fd();
+    }
+};
+
 class DiskCacheEntry{
 public:
     wxFileOffset    offset; //offset 0 - empty
-    MD5Name         name;
+    TileKey         name;   //only TilePart
     DiskCacheEntry  *next;
     DiskCacheEntry(){
         offset=0;
@@ -171,10 +430,13 @@ public:
 class DiskCache{
     const int MAXBUCKETS=2<<16;
 private:
+    typedef std::map<unsigned int,DiskSegmentInfo> SegmentMap;
     wxString        name;
     std::mutex      lock;
     DiskCacheChunk  *freeList;
+    DiskCacheEntry  *freeEntries;   //removed entries for reuse
     DiskCacheEntry  **buckets;
+    SegmentMap      segments;
     int             bucketSize=1;
     int             bucketMask=0;
     int             numChunks;
@@ -182,17 +444,27 @@ private:
     unsigned long   maxSize;
     /**
      * get the bucket
-     * @param name - MD5_LEN
+     * @param name - TilePart
      * @return 
      */
-    int             getBucket(MD5Name name){
-        int *n=(int *)(name.GetValue()+name.len-sizeof(int));
-        int rt= (*n) & bucketMask;
+    int             getBucket(const TileKey &name){
+        int rt= (int)(name.Hash() & bucketMask);
         rt = rt % bucketSize; //to be sure...
         return rt;
     }
+    void            countRecord(wxFileOffset offset,int diff){
+        DiskSegmentInfo &info=segments[SEGMENT_OF(offset)];
+        info.segment=SEGMENT_OF(offset);
+        info.records+=diff;
+    }
     DiskCacheEntry  *getNextEntry(){
         DiskCacheEntry *rt=NULL;
+        if (freeEntries != NULL){
+            rt=freeEntries;
+            freeEntries=rt->next;
+            rt->next=NULL;
+            return rt;
+        }
         if (freeList != NULL) rt=freeList->getNext();
         if (! rt){
             DiskCacheChunk *newChunk=new DiskCacheChunk();
@@ -209,6 +481,7 @@ public:
         this->maxSize=maxSize;
         this->numentries=0;
         this->freeList=NULL;
+        this->freeEntries=NULL;
         this->numChunks=0;
         while (bucketMask < maxSize/10 && bucketMask <= MAXBUCKETS){
             bucketMask = (bucketMask << 1) | 1;
@@ -235,8 +508,10 @@ public:
             freeChunk=next;
         }
         freeList=NULL;
+        freeEntries=NULL;
         numChunks=0;
         numentries=0;
+        segments.clear();
         if (doLock) lock.unlock();
     }
     ~DiskCache(){
@@ -244,7 +519,15 @@ public:
         delete buckets;
     }
     
-    bool Find(MD5Name name,/*out*/DiskCacheEntry &out){
+    /**
+     * find an entry
+     * @param key
+     * @param out
+     * @param countHit count an access to the segment of the entry
+     * @return 
+     */
+    bool Find(TileKey key,/*out*/DiskCacheEntry &out,bool countHit=false){
+        TileKey name=key.TilePart();
         Synchronized locker(lock);
         int bucket=getBucket(name);
         DiskCacheEntry *rt=NULL;
@@ -252,6 +535,11 @@ public:
         while (rt != NULL){
             if (rt->name == name){
                 out=*rt;
+                if (countHit){
+                    DiskSegmentInfo &info=segments[SEGMENT_OF(rt->offset)];
+                    info.hits++;
+                    info.lastAccess=wxGetLocalTime();
+                }
                 return true;
             }
             rt=rt->next;
@@ -259,9 +547,12 @@ public:
         return false;
         
     }
-    bool Add(MD5Name ename, wxFileOffset offset){
+    /**
+     * add an entry, a later record for the same tile replaces the earlier one
+     */
+    bool Add(TileKey key, wxFileOffset offset){
+        TileKey ename=key.TilePart();
         Synchronized locker(lock);
-        if (numentries >= maxSize) return false;
         int bucket=getBucket(ename);
         DiskCacheEntry *entry=buckets[bucket];
         DiskCacheEntry *last=NULL;
@@ -275,10 +566,13 @@ public:
             entry=entry->next;
         }
         if (exists){
-            entry->offset=offset;
             LOG_DEBUG(wxT("DiskCache %s: entry %s already exists, update"),name,ename.ToString());
+            countRecord(entry->offset,-1);
+            entry->offset=offset;
+            countRecord(offset,1);
             return true;
         }
+        if (numentries >= maxSize) return false;
         entry=getNextEntry();
         if (entry == NULL){
             return false;
@@ -286,6 +580,7 @@ public:
         entry->name=ename;
         entry->offset=offset;
         numentries++;
+        countRecord(offset,1);
         if (last){
             last->next=entry;
         }
@@ -299,6 +594,62 @@ public:
         Synchronized locker(lock);
         return numentries;
     }
+    /**
+     * number of entries that can still be added
+     */
+    unsigned long GetFree(){
+        Synchronized locker(lock);
+        if (numentries >= maxSize) return 0;
+        return maxSize-numentries;
+    }
+    void AddSegment(unsigned int segment){
+        Synchronized locker(lock);
+        segments[segment].segment=segment;
+    }
+    /**
+     * remove all entries that point to a segment
+     * @return the number of removed entries
+     */
+    unsigned long RemoveSegment(unsigned int segment){
+        Synchronized locker(lock);
+        unsigned long removed=0;
+        for (int i=0;i<bucketSize;i++){
+            DiskCacheEntry **prev=&buckets[i];
+            while (*prev != NULL){
+                DiskCacheEntry *entry=*prev;
+                if (SEGMENT_OF(entry->offset) == segment){
+                    *prev=entry->next;
+                    entry->offset=0;
+                    entry->next=freeEntries;
+                    freeEntries=entry;
+                    numentries--;
+                    removed++;
+                    continue;
+                }
+                prev=&(entry->next);
+            }
+        }
+        segments.erase(segment);
+        return removed;
+    }
+    void GetSegments(CacheHandler::DiskSegmentList &out){
+        Synchronized locker(lock);
+        SegmentMap::iterator it;
+        for (it=segments.begin();it != segments.end();it++){
+            out.push_back(it->second);
+        }
+    }
+    void GetEntries(CacheHandler::DiskEntryList &out){
+        Synchronized locker(lock);
+        out.reserve(numentries);
+        for (int i=0;i<bucketSize;i++){
+            DiskCacheEntry *entry=buckets[i];
+            while (entry != NULL){
+                out.push_back(std::make_pair(entry->name.GetValue(),entry->offset));
+                entry=entry->next;
+            }
+        }
+    }
     unsigned long GetByteSizeKb(){
         Synchronized locker(lock);
         return (numChunks * sizeof(DiskCacheChunk)+sizeof(DiskCache)+bucketSize*sizeof(DiskCacheEntry *))/1000;
@@ -315,68 +666,403 @@ public:
     
 };
 
-CacheHandler::CacheHandler(wxString chartSetKey,unsigned long numEntries,unsigned long maxFileEntries) {
-    currentBytes=0;
+//percentage of the memory entries that can be in the protected segment
+#define PROTECTED_PERCENT 80
+
+MemoryCache::MemoryCache(unsigned long maxEntries){
+    bucketMask=15;
+    while (bucketMask < maxEntries && bucketMask < (1UL << 24)){
+        bucketMask = (bucketMask << 1) | 1;
+    }
+    buckets=new CacheEntry*[bucketMask+1];
+    for (unsigned long i=0;i<=bucketMask;i++){
+        buckets[i]=NULL;
+    }
+    numEntries=0;
+    numShared=0;
+    maxProtected=maxEntries*PROTECTED_PERCENT/100;
+    for (int i=0;i<SEG_NUM;i++){
+        head[i]=NULL;
+        tail[i]=NULL;
+        segmentSize[i]=0;
+    }
+}
+
+MemoryCache::~MemoryCache(){
+    Clear();
+    delete [] buckets;
+}
+
+unsigned long MemoryCache::Bucket(const TileKey &name){
+    return (unsigned long)(name.Hash() & bucketMask);
+}
+
+void MemoryCache::Link(CacheEntry *entry,Segment s,bool atHead){
+    entry->segment=s;
+    entry->lruPrev=NULL;
+    entry->lruNext=NULL;
+    if (s == SEG_NONE) return;
+    if (head[s] == NULL){
+        head[s]=entry;
+        tail[s]=entry;
+    }
+    else if (atHead){
+        entry->lruNext=head[s];
+        head[s]->lruPrev=entry;
+        head[s]=entry;
+    }
+    else{
+        entry->lruPrev=tail[s];
+        tail[s]->lruNext=entry;
+        tail[s]=entry;
+    }
+    segmentSize[s]++;
+}
+
+void MemoryCache::Unlink(CacheEntry *entry){
+    int s=entry->segment;
+    entry->segment=SEG_NONE;
+    if (s == SEG_NONE) return;
+    if (entry->lruPrev != NULL) entry->lruPrev->lruNext=entry->lruNext;
+    else head[s]=entry->lruNext;
+    if (entry->lruNext != NULL) entry->lruNext->lruPrev=entry->lruPrev;
+    else tail[s]=entry->lruPrev;
+    entry->lruPrev=NULL;
+    entry->lruNext=NULL;
+    segmentSize[s]--;
+}
+
+CacheEntry * MemoryCache::Find(const TileKey &name){
+    CacheEntry *e=buckets[Bucket(name)];
+    while (e != NULL){
+        if (e->name == name) return e;
+        e=e->hashNext;
+    }
+    return NULL;
+}
+
+CacheEntry * MemoryCache::Insert(CacheEntry *entry){
+    CacheEntry **prev=&buckets[Bucket(entry->name)];
+    CacheEntry *replaced=NULL;
+    while (*prev != NULL){
+        if ((*prev)->name == entry->name){
+            replaced=*prev;
+            *prev=replaced->hashNext;
+            replaced->hashNext=NULL;
+            Unlink(replaced);
+            numEntries--;
+            if (replaced->IsShared()) numShared--;
+            break;
+        }
+        prev=&((*prev)->hashNext);
+    }
+    CacheEntry **bucket=&buckets[Bucket(entry->name)];
+    entry->hashNext=*bucket;
+    *bucket=entry;
+    Link(entry,SEG_NONE,true);
+    numEntries++;
+    if (entry->IsShared()) numShared++;
+    return replaced;
+}
+
+bool MemoryCache::Remove(CacheEntry *entry){
+    CacheEntry **prev=&buckets[Bucket(entry->name)];
+    while (*prev != NULL){
+        if (*prev == entry){
+            *prev=entry->hashNext;
+            entry->hashNext=NULL;
+            Unlink(entry);
+            numEntries--;
+            if (entry->IsShared()) numShared--;
+            return true;
+        }
+        prev=&((*prev)->hashNext);
+    }
+    return false;
+}
+
+void MemoryCache::Touch(CacheEntry *entry){
+    if (entry->segment == SEG_NONE) return;
+    if (entry->segment == SEG_PROTECTED && head[SEG_PROTECTED] == entry) return;
+    Unlink(entry);
+    Link(entry,SEG_PROTECTED,true);
+    while (segmentSize[SEG_PROTECTED] > maxProtected && tail[SEG_PROTECTED] != NULL){
+        CacheEntry *old=tail[SEG_PROTECTED];
+        Unlink(old);
+        Link(old,SEG_PROBATION,true);
+    }
+}
+
+void MemoryCache::MakeEvictable(CacheEntry *entry){
+    if (entry->segment != SEG_NONE) return;
+    Link(entry,SEG_PROBATION,! entry->prefill);
+}
+
+void MemoryCache::GetEntries(std::vector<CacheEntry*> &out){
+    for (int s=SEG_PROBATION;s<SEG_NUM;s++){
+        CacheEntry *e=head[s];
+        while (e != NULL){
+            out.push_back(e);
+            e=e->lruNext;
+        }
+    }
+}
+
+CacheEntry * MemoryCache::EvictionCandidate(){
+    if (tail[SEG_PROBATION] != NULL) return tail[SEG_PROBATION];
+    return tail[SEG_PROTECTED];
+}
+
+void MemoryCache::Clear(){
+    for (unsigned long i=0;i<=bucketMask;i++){
+        CacheEntry *e=buckets[i];
+        buckets[i]=NULL;
+        while (e != NULL){
+            CacheEntry *next=e->hashNext;
+            e->hashNext=NULL;
+            e->segment=SEG_NONE;
+            e->lruPrev=NULL;
+            e->lruNext=NULL;
+            e->Unref();
+            e=next;
+        }
+    }
+    for (int i=0;i<SEG_NUM;i++){
+        head[i]=NULL;
+        tail[i]=NULL;
+        segmentSize[i]=0;
+    }
+    numEntries=0;
+    numShared=0;
+}
+
+CacheHandler::CacheHandler(wxString chartSetKey,unsigned long numEntries,unsigned long maxFileEntries,
+        CacheBudget *budget,UniformTiles *uniformTiles){
     maxEntries=numEntries;
-    cacheFileName=wxEmptyString;
-    cacheFile=NULL;
+    this->budget=budget;
+    lastAccess=0;
     this->chartSetKey=chartSetKey;
     this->maxFileEntries=maxFileEntries;
     this->diskCache= new DiskCache(chartSetKey,maxFileEntries);
+    for (int i=0;i<CACHE_SHARDS;i++){
+        shards[i]=new Shard(numEntries/CACHE_SHARDS+1);
+    }
+    numCoalesced=0;
+    numCoalescedPrefill=0;
+    this->uniformTiles=uniformTiles;
+    generation=0;
+    numPurged=0;
+    numWriteDropped=0;
+    if (budget != NULL) budget->Register(this);
 }
 
 void CacheHandler::Reset() {
+    for (int i=0;i<CACHE_SHARDS;i++){
+        Synchronized locker(shards[i]->lock);
+        shards[i]->cache.Clear();
+        shards[i]->bytes=0;
+    }
+    ResetDisk();
+}
+
+void CacheHandler::ResetDisk() {
+    WriteOutQueue pending;
     {
-        Synchronized locker(lock);
-        CacheMap::iterator it;
-        for (it = inMemoryCache.begin(); it != inMemoryCache.end(); it++) {
-            it->second->Unref();
-        }
-        if (cacheFile != NULL) {
-            cacheFile->Close();
-            delete cacheFile;
-            cacheFile=NULL;
+        Synchronized locker(writeLock);
+        pending.swap(writeOutQueue);
+    }
+    //entries that have not been written can be evicted now
+    WriteOutQueue::iterator wit;
+    for (wit=pending.begin();wit != pending.end();wit++){
+        CacheEntry *e=*wit;
+        {
+            Shard *shard=GetShard(e->name);
+            Synchronized locker(shard->lock);
+            if (shard->cache.Find(e->name) == e){
+                shard->cache.MakeEvictable(e);
+            }
         }
-        inMemoryCache.clear();
+        e->Unref();
+    }
+    SegmentFiles oldFiles;
+    {
+        Synchronized locker(fileLock);
+        oldFiles.swap(segmentFiles);
+    }
+    //will be closed when the last reader is done
+    SegmentFiles::iterator it;
+    for (it=oldFiles.begin();it != oldFiles.end();it++){
+        it->second->Unref();
     }
     diskCache->Clear(true);
 }
 
+void CacheHandler::ReserveGeneration(int generation, wxString variant) {
+    if (generation < 0 || generation >= TileKey::NUM_GENERATIONS) return;
+    if (generationVariants[generation] != variant){
+        //the generation has been used for other settings before
+        long purged=PurgeGeneration(generation);
+        LOG_INFO(wxT("CacheHandler %s: generation %d now used for variant %s, removed %ld entries"),
+                chartSetKey,generation,variant,purged);
+        generationVariants[generation]=variant;
+    }
+}
+
+void CacheHandler::SetVariant(int generation, wxString variant) {
+    if (generation < 0 || generation >= TileKey::NUM_GENERATIONS) return;
+    ReserveGeneration(generation,variant);
+    this->generation=generation;
+}
+
+long CacheHandler::PurgeGeneration(int generation) {
+    long rt=0;
+    for (int i=0;i<CACHE_SHARDS;i++){
+        std::vector<CacheEntry*> removed;
+        {
+            Shard *shard=shards[i];
+            Synchronized locker(shard->lock);
+            std::vector<CacheEntry*> entries;
+            shard->cache.GetEntries(entries);
+            std::vector<CacheEntry*>::iterator it;
+            for (it=entries.begin();it != entries.end();it++){
+                CacheEntry *e=*it;
+                if (e->name.GetGeneration() != generation) continue;
+                shard->cache.Remove(e);
+                shard->bytes-=e->GetCompleteSize();
+                removed.push_back(e);
+            }
+        }
+        std::vector<CacheEntry*>::iterator it;
+        for (it=removed.begin();it != removed.end();it++){
+            (*it)->Unref(); //map
+        }
+        rt+=removed.size();
+    }
+    numPurged+=rt;
+    return rt;
+}
+
 
 CacheHandler::~CacheHandler() {
-    CacheMap::iterator it;
-    for (it=inMemoryCache.begin();it != inMemoryCache.end();it++){
-        it->second->Unref();
+    for (int i=0;i<CACHE_SHARDS;i++){
+        delete shards[i];
+    }
+    WriteOutQueue::iterator it;
+    for (it=writeOutQueue.begin();it != writeOutQueue.end();it++){
+        (*it)->Unref();
     }
-    if (cacheFile != NULL){
-        cacheFile->Close();
-        delete cacheFile;
+    SegmentFiles::iterator sit;
+    for (sit=segmentFiles.begin();sit != segmentFiles.end();sit++){
+        sit->second->Unref();
     }
 }
 
+void CacheHandler::CountCoalesced(bool prefill){
+    Synchronized locker(statusLock);
+    if (prefill) numCoalescedPrefill++;
+    else numCoalesced++;
+}
+
+static double HitRatio(unsigned long hits,unsigned long misses){
+    if ((hits+misses) == 0) return 0;
+    return (double)hits/(double)(hits+misses);
+}
+
 wxString CacheHandler::ToJson(){
+    unsigned long entries=0;
+    size_t bytes=0;
+    unsigned long numShared=0;
+    unsigned long numProtected=0;
+    unsigned long numEvicted=0;
+    unsigned long numMemoryHits=0;
+    unsigned long numDiskHits=0;
+    unsigned long numMisses=0;
+    unsigned long numDiskSent=0;
+    for (int i=0;i<CACHE_SHARDS;i++){
+        Shard *shard=shards[i];
+        Synchronized locker(shard->lock);
+        entries+=shard->cache.Size();
+        bytes+=shard->bytes;
+        numShared+=shard->cache.NumShared();
+        numProtected+=shard->cache.SegmentSize(MemoryCache::SEG_PROTECTED);
+        numEvicted+=shard->numEvicted;
+        numMemoryHits+=shard->numMemoryHits;
+        numDiskHits+=shard->numDiskHits;
+        numMisses+=shard->numMisses;
+        numDiskSent+=shard->numDiskSent;
+    }
     wxString rt;
     {
-        Synchronized locker(lock);
+        Synchronized locker(statusLock);
         rt=wxString::Format("{"
                 JSON_IV(memoryEntries,%ld) ",\n"
                 JSON_IV(maxMemoryEntries,%ld) ",\n"
-                JSON_IV(memoryBytes,%ld) ",\n",
-                inMemoryCache.size(),
+                JSON_IV(memoryBytes,%ld) ",\n"
+                JSON_IV(coalesced,%ld) ",\n"
+                JSON_IV(coalescedPrefill,%ld) ",\n"
+                JSON_IV(sharedEntries,%ld) ",\n"
+                JSON_IV(protectedEntries,%ld) ",\n"
+                JSON_IV(evicted,%ld) ",\n"
+                JSON_IV(generation,%d) ",\n"
+                JSON_IV(purged,%ld) ",\n"
+                JSON_IV(memoryHits,%ld) ",\n"
+                JSON_IV(diskHits,%ld) ",\n"
+                JSON_IV(diskSent,%ld) ",\n"
+                JSON_IV(misses,%ld) ",\n"
+                JSON_IV(hitRatio,%.3f) ",\n"
+                JSON_IV(writeQueue,%ld) ",\n"
+                JSON_IV(writeDropped,%ld) ",\n",
+                entries,
                 maxEntries,
-                currentBytes);
+                bytes,
+                numCoalesced,
+                numCoalescedPrefill,
+                numShared,
+                numProtected,
+                numEvicted,
+                (int)generation,
+                (long)numPurged,
+                numMemoryHits,
+                numDiskHits,
+                numDiskSent,
+                numMisses,
+                HitRatio(numMemoryHits+numDiskHits,numMisses),
+                GetWriteQueueSize(),
+                (long)numWriteDropped);
     }
+    DiskSegmentList segments;
+    diskCache->GetSegments(segments);
     rt.Append(wxString::Format(
+        JSON_IV(diskSegments,%ld) ",\n"
         JSON_IV(diskEntries,%ld) ",\n"
         JSON_IV(maxDiskEntries,%ld) ",\n"
         JSON_IV(diskMemorySizeKb,%ld) "\n"
         "}\n",
+        (long)segments.size(),
         diskCache->GetSize(),
         MaxDiskEntries(),
         diskCache->GetByteSizeKb()));
     return rt;
 }
 
+unsigned long CacheHandler::CurrentEntries(){
+    unsigned long rt=0;
+    for (int i=0;i<CACHE_SHARDS;i++){
+        Synchronized locker(shards[i]->lock);
+        rt+=shards[i]->cache.Size();
+    }
+    return rt;
+}
+
+size_t CacheHandler::CurrentBytes(){
+    size_t rt=0;
+    for (int i=0;i<CACHE_SHARDS;i++){
+        Synchronized locker(shards[i]->lock);
+        rt+=shards[i]->bytes;
+    }
+    return rt;
+}
+
 unsigned long CacheHandler::CurrentDiskEntries(){
     return diskCache->GetSize();
 }
@@ -387,263 +1073,789 @@ unsigned long CacheHandler::MaxDiskEntries(){
 unsigned long CacheHandler::GetCompleteSizeKb(){
     unsigned long rt=0;
     rt+=diskCache->GetByteSizeKb();
-    {
-        Synchronized locker(lock);
-        rt+=currentBytes/1024;
-    }
+    rt+=CurrentBytes()/1024;
     return rt;
 }
 unsigned long CacheHandler::GetMaxSizeKb(){
-    unsigned long rt=maxEntries*3; //average size of png
+    unsigned long rt=0;
+    //with a budget the memory entries are accounted there
+    if (budget == NULL) rt+=maxEntries*3; //average size of png
     rt+=diskCache->GetMaxSizeKb();
     return rt;
 }
 
 
 
+//max number of entries waiting to be written
+//prefill entries may only use half of it
+#define MAX_WRITE_QUEUE 10000
+
 bool CacheHandler::AddEntry(CacheEntry* entry){
     if (maxEntries < 1) {
         return false;
     }
-    CacheMap::iterator it;
-    Synchronized locker(lock);
-    it=inMemoryCache.find(entry->name);
-    if (it != inMemoryCache.end()) {
-        currentBytes-=it->second->GetCompleteSize();
-        it->second->Unref();
-    }
-    entry->Ref();
-    entry->insertTime=wxGetLocalTime();
-    if (! entry->HasDiskData()){
-        writeOutQueue.push_back(entry->name);
+    CacheEntry *replaced=NULL;
+    Shard *shard=GetShard(entry->name);
+    bool needsWrite=! entry->HasDiskData();
+    if (needsWrite){
+        //if the disk writes fall behind we drop prefill entries
+        //and keep other entries only in memory (evictable)
+        Synchronized locker(writeLock);
+        size_t limit=entry->prefill?MAX_WRITE_QUEUE/2:MAX_WRITE_QUEUE;
+        if (writeOutQueue.size() >= limit){
+            numWriteDropped++;
+            if (entry->prefill) return false;
+            needsWrite=false;
+        }
     }
-    else{
-        if (entry-> HasMemoryData()){
-            cleanupQueue.push_back(entry->name);
+    if (! entry->prefill) lastAccess=wxGetLocalTime();
+    {
+        Synchronized locker(shard->lock);
+        entry->Ref();
+        entry->insertTime=wxGetLocalTime();
+        replaced=shard->cache.Insert(entry);
+        if (replaced != NULL) {
+            shard->bytes-=replaced->GetCompleteSize();
+        }
+        if (! needsWrite){
+            shard->cache.MakeEvictable(entry);
         }
+        shard->bytes+=entry->GetCompleteSize();
+    }
+    if (replaced != NULL) replaced->Unref();
+    if (needsWrite){
+        Synchronized locker(writeLock);
+        entry->Ref();
+        writeOutQueue.push_back(entry);
     }
-    inMemoryCache[entry->name]=entry;
-    size_t entrySize=entry->GetCompleteSize();
-    currentBytes+=entrySize;
     return true;
 }
 
 
-bool CacheHandler::HasDiskEntry(MD5Name ename) {
+bool CacheHandler::HasDiskEntry(TileKey ename) {
     DiskCacheEntry de;
     return diskCache->Find(ename,de);
 }
 
 
-bool CacheHandler::AddDiskEntry(MD5Name name, wxFileOffset offset) {
+bool CacheHandler::AddDiskEntry(TileKey name, wxFileOffset offset) {
     return diskCache->Add(name,offset);
 }
 
+void CacheHandler::GetDiskEntries(DiskEntryList &out){
+    diskCache->GetEntries(out);
+}
+
 
-CacheEntry * CacheHandler::FindEntry(MD5Name name, bool readData) {
-    CacheMap::iterator it;
+CacheEntry * CacheHandler::FindInMemory(TileKey name, bool readData) {
     CacheEntry *e = NULL;
+    Shard *shard=GetShard(name);
     {
-        Synchronized locker(lock);
-        it = inMemoryCache.find(name);
-        if (it != inMemoryCache.end()) {
-            e = it->second;
+        Synchronized locker(shard->lock);
+        e = shard->cache.Find(name);
+        if (e != NULL) {
             e->Ref();
+            //only real requests count for the statistics and the LRU
+            if (readData){
+                shard->cache.Touch(e);
+                shard->numMemoryHits++;
+            }
         }
     }
-    if (e != NULL) {
-        return e;
+    if (readData) lastAccess=wxGetLocalTime();
+    return e;
+}
+
+bool CacheHandler::FindDiskEntry(TileKey name, DiskCacheEntry &diskEntry) {
+    Shard *shard=GetShard(name);
+    if (!diskCache->Find(name, diskEntry, true)) {
+        Synchronized locker(shard->lock);
+        shard->numMisses++;
+        return false;
     }
-    if (!readData) {
-        return NULL;
+    Synchronized locker(shard->lock);
+    shard->numDiskHits++;
+    return true;
+}
+
+CacheFileReader * CacheHandler::GetReader(unsigned int segment) {
+    //only protects the map, the reads are done without any lock
+    Synchronized locker(fileLock);
+    SegmentFiles::iterator it=segmentFiles.find(segment);
+    if (it == segmentFiles.end()) return NULL;
+    it->second->Ref();
+    return it->second;
+}
+
+/**
+ * read and check the header of a record
+ * references are followed, so rheader and dataPos
+ * will describe the record that contains the data
+ */
+static bool readRecordHeader(CacheFileReader *reader,TileKey name,wxFileOffset offset,
+        RecordHeader *rheader,/*out*/wxFileOffset &dataPos){
+    if (!reader->ReadHeader(offset, rheader)) {
+        LOG_ERROR(wxT("cannot load cache entry from disk , invalid header %s"), name.ToString());
+        return false;
     }
-    DiskCacheEntry diskEntry;
-    if (!diskCache->Find(name, diskEntry)) {
-        return NULL;
+    if (name.TilePart().GetValue() != rheader->key) {
+        LOG_ERROR(wxT("cannot load cache entry from disk , invalid name in header %s"), name.ToString());
+        return false;
     }
+    dataPos=offset+sizeof(RecordHeader);
+    if (rheader->flags & RECORD_REF) {
+        if (recordCrc(rheader,NULL) != rheader->crc){
+            LOG_ERROR(wxT("cannot load cache entry from disk , invalid crc %s"), name.ToString());
+            return false;
+        }
+        //deduplicated - read the data from the referenced record
+        MD5Name contentHash = rheader->contentHash;
+        //references are always within the same segment
+        wxFileOffset refOffset = SEGMENT_OFFSET(rheader->refOffset);
+        if (!reader->ReadHeader(refOffset, rheader) ||
+                (rheader->flags & RECORD_REF) ||
+                contentHash != rheader->contentHash) {
+            LOG_ERROR(wxT("cannot load cache entry from disk , invalid reference %s"), name.ToString());
+            return false;
+        }
+        dataPos=refOffset+sizeof(RecordHeader);
+    }
+    return true;
+}
+
+CacheEntry * CacheHandler::FindEntry(TileKey name, bool readData) {
+    CacheEntry *e = FindInMemory(name,readData);
+    if (e != NULL) {
+        return e;
+    }
+    if (!readData) {
+        return NULL;
+    }
+    DiskCacheEntry diskEntry;
+    if (!FindDiskEntry(name, diskEntry)) {
+        return NULL;
+    }
+    return ReadDiskEntry(name, diskEntry);
+}
+
+CacheEntry * CacheHandler::ReadDiskEntry(TileKey name, DiskCacheEntry &diskEntry) {
     LOG_DEBUG(wxT("read cache entry from disk %s"), name.ToString());
-    if (cacheFile == NULL) {
+    DiskScheduler::ReadGuard guard;
+    CacheFileReader *reader=GetReader(SEGMENT_OF(diskEntry.offset));
+    if (reader == NULL) {
         LOG_ERROR(wxT("cannot load cache entry from disk as there is no file open %s"), name.ToString());
         return NULL;
     }
     RecordHeader rheader;
-    wxMemoryOutputStream *os = NULL;
-    {
-        Synchronized locker(fileLock);
-        wxFileOffset s = cacheFile->Seek(diskEntry.offset);
-        if (s != diskEntry.offset) {
-            LOG_ERROR(wxT("cannot load cache entry from disk , invalid seek %s"), name.ToString());
-            return NULL;
-        }
-        if (!readAndCheckHeader(cacheFileName, cacheFile, &rheader)) {
-            LOG_ERROR(wxT("cannot load cache entry from disk , invalid header %s"), name.ToString());
-            return NULL;
-        }
-        if (name != rheader.name) {
-            LOG_ERROR(wxT("cannot load cache entry from disk , invalid name in header %s"), name.ToString());
-            return NULL;
-        }
-        os = new wxMemoryOutputStream();
-        os->GetOutputStreamBuffer()->SetBufferIO(rheader.dataLen);
-        int rd = cacheFile->Read(os->GetOutputStreamBuffer()->GetBufferStart(), rheader.dataLen);
-        if (rd != (int) rheader.dataLen) {
+    wxFileOffset dataPos=0;
+    unsigned char *data = NULL;
+    bool readOk=false;
+    do {
+        if (!readRecordHeader(reader, name, SEGMENT_OFFSET(diskEntry.offset), &rheader, dataPos)) {
+            break;
+        }
+        data = (unsigned char *)malloc(rheader.dataLen > 0?rheader.dataLen:1);
+        if (data == NULL) {
+            LOG_ERROR(wxT("cannot load cache entry from disk , no memory for %d bytes: %s"), rheader.dataLen, name.ToString());
+            break;
+        }
+        if (!reader->ReadAt(dataPos, data, rheader.dataLen)) {
             LOG_ERROR(wxT("cannot load cache entry from disk , unable to read %d bytes: %s"), rheader.dataLen, name.ToString());
-            delete os;
-            return NULL;
+            free(data);
+            data=NULL;
+            break;
         }
+        if (recordCrc(&rheader,data) != rheader.crc){
+            LOG_ERROR(wxT("cannot load cache entry from disk , invalid crc %s"), name.ToString());
+            free(data);
+            data=NULL;
+            break;
+        }
+        readOk=true;
+    } while (false);
+    reader->Unref();
+    if (! readOk) return NULL;
+    CacheEntry *e = NULL;
+    CacheEntry *uniform = NULL;
+    if (uniformTiles != NULL) {
+        uniform = uniformTiles->FindData(data, rheader.dataLen);
+    }
+    if (uniform != NULL) {
+        free(data);
+        e = new CacheEntry(name, uniform);
+        uniform->Unref();
+        e->SetOffset(diskEntry.offset);
+    }
+    else {
+        e = new CacheEntry(name, data, rheader.dataLen, diskEntry.offset);
     }
-    e = new CacheEntry(name, os, diskEntry.offset);
     AddEntry(e);
     return e;
 }
 
+bool CacheHandler::AdmitDiskHit(TileKey name) {
+    if (maxEntries < 1) return false;
+    Shard *shard=GetShard(name);
+    Synchronized locker(shard->lock);
+    unsigned long long key=name.GetValue();
+    if (shard->recentDiskHits.erase(key) > 0) return true;
+    shard->recentDiskHits.insert(key);
+    shard->recentDiskOrder.push_back(key);
+    while (shard->recentDiskOrder.size() > RECENT_DISK_HITS) {
+        shard->recentDiskHits.erase(shard->recentDiskOrder.front());
+        shard->recentDiskOrder.pop_front();
+    }
+    return false;
+}
+
+CacheEntry * CacheHandler::FindForSend(TileKey name, DiskRange *&range) {
+    range=NULL;
+    CacheEntry *e = FindInMemory(name,true);
+    if (e != NULL) {
+        return e;
+    }
+    DiskCacheEntry diskEntry;
+    if (!FindDiskEntry(name, diskEntry)) {
+        return NULL;
+    }
+    //tiles hit again while still remembered are worth a place in memory
+    if (AdmitDiskHit(name)) {
+        return ReadDiskEntry(name, diskEntry);
+    }
+    DiskScheduler::ReadGuard guard;
+    CacheFileReader *reader=GetReader(SEGMENT_OF(diskEntry.offset));
+    if (reader == NULL) {
+        LOG_ERROR(wxT("cannot send cache entry from disk as there is no file open %s"), name.ToString());
+        return NULL;
+    }
+    RecordHeader rheader;
+    wxFileOffset dataPos=0;
+    if (!readRecordHeader(reader, name, SEGMENT_OFFSET(diskEntry.offset), &rheader, dataPos)) {
+        reader->Unref();
+        return NULL;
+    }
+    //the crc is not checked here as this would need to read the data
+    //torn records are removed when reading the segments at startup
+    range=new DiskRange(reader, dataPos, rheader.dataLen); //takes over the ref
+    Shard *shard=GetShard(name);
+    Synchronized locker(shard->lock);
+    shard->numDiskSent++;
+    return NULL;
+}
+
+DiskRange::DiskRange(CacheFileReader *reader, wxFileOffset offset, size_t length) {
+    this->reader=reader;
+    this->offset=offset;
+    this->length=length;
+    //the data will be read by the kernel when sending
+    //this is not counted for the scheduler as a slow client
+    //would hold off the writes for a long time
+}
+
+DiskRange::~DiskRange() {
+    reader->Unref();
+}
+
+int DiskRange::GetFd() {
+    return reader->GetFd();
+}
+
+size_t CacheHandler::EvictBytes(size_t bytes){
+    size_t freed=0;
+    bool found=true;
+    //evict round robin from the shards to keep them balanced
+    while (freed < bytes && found){
+        found=false;
+        for (int i=0;i<CACHE_SHARDS && freed < bytes;i++){
+            Shard *shard=shards[i];
+            CacheEntry *e=NULL;
+            {
+                Synchronized locker(shard->lock);
+                e=shard->cache.EvictionCandidate();
+                if (e == NULL) continue;
+                shard->cache.Remove(e);
+                size_t sz=e->GetCompleteSize();
+                shard->bytes-=sz;
+                shard->numEvicted++;
+                freed+=sz;
+            }
+            found=true;
+            e->Unref(); //map
+        }
+    }
+    return freed;
+}
+
+CacheBudget::CacheBudget(size_t maxBytes){
+    this->maxBytes=maxBytes;
+    numRuns=0;
+    bytesEvicted=0;
+}
+
+void CacheBudget::Register(CacheHandler *handler){
+    Synchronized locker(lock);
+    handlers.push_back(handler);
+}
+
+size_t CacheBudget::CurrentBytes(){
+    HandlerList current;
+    {
+        Synchronized locker(lock);
+        current=handlers;
+    }
+    size_t rt=0;
+    for (size_t i=0;i<current.size();i++){
+        rt+=current[i]->CurrentBytes();
+    }
+    return rt;
+}
+
+static bool lessRecentlyUsed(CacheHandler *first,CacheHandler *second){
+    return first->LastAccess() < second->LastAccess();
+}
+
+size_t CacheBudget::Enforce(int percentLevel){
+    //only one writer thread needs to do the job
+    Synchronized runLocker(enforceLock,std::try_to_lock);
+    if (! runLocker.owns_lock()) return 0;
+    size_t highWater=maxBytes/100*percentLevel;
+    size_t current=CurrentBytes();
+    if (current <= highWater) return 0;
+    HandlerList sorted;
+    {
+        Synchronized locker(lock);
+        sorted=handlers;
+    }
+    std::sort(sorted.begin(),sorted.end(),lessRecentlyUsed);
+    size_t needed=current-highWater;
+    size_t freed=0;
+    for (size_t i=0;i<sorted.size() && freed < needed;i++){
+        freed+=sorted[i]->EvictBytes(needed-freed);
+    }
+    LOG_INFO(wxT("CacheBudget: freed %lld bytes, current %lld, max %lld"),
+            (long long)freed,(long long)(current-freed),(long long)maxBytes);
+    Synchronized locker(lock);
+    numRuns++;
+    bytesEvicted+=freed;
+    return freed;
+}
+
+wxString CacheBudget::ToJson(){
+    size_t current=CurrentBytes();
+    Synchronized locker(lock);
+    return wxString::Format("{"
+            JSON_IV(maxBytes,%lld) ",\n"
+            JSON_IV(currentBytes,%lld) ",\n"
+            JSON_IV(numSets,%ld) ",\n"
+            JSON_IV(evictionRuns,%ld) ",\n"
+            JSON_IV(bytesEvicted,%lld) "\n"
+            "}",
+            (long long)maxBytes,
+            (long long)current,
+            (long)handlers.size(),
+            numRuns,
+            (long long)bytesEvicted);
+}
+
+//ms between write rounds, entries queued meanwhile are written as one batch
+#define SCHEDULER_INTERVAL 1000
+//max ms per round we wait for pending reads
+#define MAX_BACKOFF 500
+#define BACKOFF_STEP 10
+
+std::atomic<int> DiskScheduler::pendingReads(0);
+
+DiskScheduler::DiskScheduler(long maxKbPerSecond): Thread(), cycleDone(lock){
+    active=NULL;
+    maxBytesPerSecond=(long long)maxKbPerSecond*1024;
+    budget=maxBytesPerSecond;
+    numCycles=0;
+    numBackoffs=0;
+    backoffMillis=0;
+    numThrottled=0;
+    bytesWritten=0;
+}
+
+void DiskScheduler::ReadStarted(){
+    pendingReads++;
+}
+
+void DiskScheduler::ReadFinished(){
+    pendingReads--;
+}
+
+void DiskScheduler::Register(CacheReaderWriter *writer){
+    Synchronized locker(lock);
+    if (std::find(writers.begin(),writers.end(),writer) != writers.end()) return;
+    writers.push_back(writer);
+}
+
+void DiskScheduler::Unregister(CacheReaderWriter *writer){
+    Synchronized locker(lock);
+    WriterList::iterator it=std::find(writers.begin(),writers.end(),writer);
+    if (it != writers.end()) writers.erase(it);
+    while (active == writer){
+        cycleDone.wait(locker);
+    }
+}
+
+long DiskScheduler::BackOff(long maxMillis){
+    if (pendingReads <= 0 || maxMillis <= 0) return 0;
+    numBackoffs++;
+    long waited=0;
+    while (pendingReads > 0 && waited < maxMillis){
+        if (waitMillis(BACKOFF_STEP)) break;
+        waited+=BACKOFF_STEP;
+    }
+    backoffMillis+=waited;
+    return waited;
+}
+
+class ScheduledWrite{
+public:
+    wxString            file;
+    wxFileOffset        position;
+    CacheReaderWriter   *writer;
+    ScheduledWrite(wxString file,wxFileOffset position,CacheReaderWriter *writer){
+        this->file=file;
+        this->position=position;
+        this->writer=writer;
+    }
+    bool operator < (const ScheduledWrite &other) const{
+        int cmp=file.Cmp(other.file);
+        if (cmp != 0) return cmp < 0;
+        return position < other.position;
+    }
+};
+
+void DiskScheduler::run(){
+    LOG_INFO(wxT("DiskScheduler: started, write limit %lld kb/s"),maxBytesPerSecond/1024);
+    wxLongLong lastRefill=wxGetLocalTimeMillis();
+    while (! shouldStop()){
+        if (waitMillis(SCHEDULER_INTERVAL)) break;
+        wxLongLong now=wxGetLocalTimeMillis();
+        if (maxBytesPerSecond > 0){
+            //allow bursts of one second
+            budget+=maxBytesPerSecond*(now-lastRefill).GetValue()/1000;
+            if (budget > maxBytesPerSecond) budget=maxBytesPerSecond;
+        }
+        lastRefill=now;
+        std::vector<ScheduledWrite> order;
+        {
+            Synchronized locker(lock);
+            WriterList::iterator it;
+            for (it=writers.begin();it != writers.end();it++){
+                order.push_back(ScheduledWrite((*it)->WriteFile(),(*it)->WritePosition(),*it));
+            }
+        }
+        std::sort(order.begin(),order.end());
+        long waited=0;
+        std::vector<ScheduledWrite>::iterator it;
+        for (it=order.begin();it != order.end() && ! shouldStop();it++){
+            waited+=BackOff(MAX_BACKOFF-waited);
+            long long maxBytes=-1;
+            if (maxBytesPerSecond > 0){
+                maxBytes=(budget > 0)?budget:0;
+            }
+            {
+                Synchronized locker(lock);
+                if (std::find(writers.begin(),writers.end(),it->writer) == writers.end()) continue;
+                active=it->writer;
+            }
+            long long written=it->writer->WriteCycle(maxBytes);
+            {
+                Synchronized locker(lock);
+                active=NULL;
+                cycleDone.notifyAll(locker);
+                bytesWritten+=written;
+                if (maxBytesPerSecond > 0){
+                    budget-=written;
+                    if (maxBytes == 0) numThrottled++;
+                }
+            }
+        }
+        numCycles++;
+    }
+    LOG_INFO(wxT("DiskScheduler: stopped"));
+}
+
+wxString DiskScheduler::ToJson(){
+    Synchronized locker(lock);
+    return wxString::Format("{"
+            JSON_IV(writers,%ld) ",\n"
+            JSON_IV(maxKbPerSecond,%lld) ",\n"
+            JSON_IV(cycles,%lu) ",\n"
+            JSON_IV(bytesWritten,%llu) ",\n"
+            JSON_IV(throttled,%lu) ",\n"
+            JSON_IV(backoffs,%lu) ",\n"
+            JSON_IV(backoffMs,%lld) ",\n"
+            JSON_IV(pendingReads,%d) "\n"
+            "}",
+            (long)writers.size(),
+            maxBytesPerSecond/1024,
+            numCycles,
+            bytesWritten,
+            numThrottled,
+            numBackoffs,
+            backoffMillis,
+            (int)pendingReads);
+}
+
 //max number of writes before we run memory cleanup
 #define MAX_WRITES 1000
 
-long CacheHandler::RunCleanup(CacheFileWrite *writer,bool canWriteToDisk,int percentLevel){
+long CacheHandler::EvictShard(Shard *shard,unsigned long highWater,bool canWriteToDisk){
+    std::vector<CacheEntry *> evicted;
+    {
+        Synchronized locker(shard->lock);
+        if (shard->cache.Size() <= highWater) return 0;
+        while (shard->cache.Size() >= highWater){
+            CacheEntry *e=shard->cache.EvictionCandidate();
+            if (e == NULL) break;
+            //can happen if the write queue was full
+            if (canWriteToDisk && ! e->HasDiskData() && e->name.GetGeneration() == generation){
+                LOG_DEBUG(wxT("Cache cleanup %s removing cache entry %s that is not on disk"),
+                        chartSetKey, e->name.ToString());
+            }
+            shard->cache.Remove(e);
+            shard->bytes -= e->GetCompleteSize();
+            shard->numEvicted++;
+            evicted.push_back(e);
+        }
+    }
+    std::vector<CacheEntry *>::iterator it;
+    for (it = evicted.begin(); it != evicted.end(); it++){
+        (*it)->Unref(); //map
+    }
+    return evicted.size();
+}
+
+long CacheHandler::RunCleanup(CacheFileWrite *writer,bool canWriteToDisk,int percentLevel,long long maxBytes){
     unsigned long highWater=percentLevel * maxEntries / 100;
-    CacheMap::iterator it;
+    unsigned long shardHighWater=(highWater+CACHE_SHARDS-1)/CACHE_SHARDS;
     //step 1 get all entries we have to write out
     //as the entries are not protected  we never modify an entry
     //but create new ones
     std::vector<CacheEntry *> writeOutList;
     bool finished=false;
     long overallRemoved=0;
+    long long taken=0;
     while (!finished) {
         long removeCount=0;
         long writeOutCount=0;
-        long inMemory=0;
-        int numWrites=0;
-        while (!finished && numWrites < MAX_WRITES) {
-            {
-                Synchronized locker(lock);
-                if (writeOutQueue.size() < 1){
+        {
+            Synchronized locker(writeLock);
+            while (writeOutList.size() < MAX_WRITES && writeOutQueue.size() > 0){
+                //the remaining entries wait for the next call
+                if (canWriteToDisk && maxBytes >= 0 && taken >= maxBytes){
                     finished=true;
                     break;
                 }
-                numWrites++;
-                MD5Name key = writeOutQueue.front();
-                writeOutQueue.pop_front();
-                it = inMemoryCache.find(key);
-                if (it != inMemoryCache.end()) {
-                    if (canWriteToDisk) {
-                        writeOutList.push_back(it->second);
-                        it->second->Ref();
-                    } else {
-                        cleanupQueue.push_back(it->second->name);
-                    }
-                } else {
-                    LOG_DEBUG(wxT("unable to find cache entry for %s"), key.ToString());
+                CacheEntry *e=writeOutQueue.front();
+                if (!e->HasDiskData() && e->name.GetGeneration() == generation){
+                    taken+=e->GetLength();
                 }
+                writeOutList.push_back(e); //takes over the ref
+                writeOutQueue.pop_front();
             }
+            if (writeOutQueue.size() < 1) finished=true;
         }
-        //step 2 now write out entries to disk
+        //step 2 now write out entries to disk as one batch
+        std::vector<CacheEntry *> batch;
         std::vector<CacheEntry *>::iterator rit;
+        //records that do not fit into the index would never be found
+        unsigned long room=canWriteToDisk?diskCache->GetFree():0;
+        long skipped=0;
         for (rit = writeOutList.begin(); rit != writeOutList.end(); rit++) {
-            CacheEntry *e = *rit;
             //the next check should never fail
             //as entries are only enqueued here if they do not have 
             //disk data
-            if (!e->HasDiskData()) {
-                wxFileOffset offset = writer->WriteToDisk(e);
+            //late entries of other settings variants must not go to our file
+            if (canWriteToDisk && !(*rit)->HasDiskData() &&
+                    (*rit)->name.GetGeneration() == generation) {
+                if (batch.size() >= room) {
+                    skipped++;
+                    continue;
+                }
+                batch.push_back(*rit);
+            }
+        }
+        if (skipped > 0){
+            LOG_DEBUG(wxT("Cache cleanup %s: disk cache is full, not writing %ld entries"),chartSetKey,skipped);
+        }
+        if (batch.size() > 0){
+            std::vector<wxFileOffset> offsets;
+            writer->WriteToDisk(batch,offsets);
+            for (size_t i=0;i<batch.size();i++){
+                CacheEntry *e=batch[i];
+                wxFileOffset offset=(i < offsets.size())?offsets[i]:0;
                 if (offset == 0) {
-                    LOG_DEBUG(wxT("Cache cleanup %s unable to write cache entry %s to disk"), chartSetKey, (*rit)->name.ToString());
+                    LOG_DEBUG(wxT("Cache cleanup %s unable to write cache entry %s to disk"), chartSetKey, e->name.ToString());
                 } else {
                     writeOutCount++;
-                    LOG_DEBUG(wxT("Cache cleanup %s writing entry %s to disk"), chartSetKey, (*rit)->name.ToString());
+                    LOG_DEBUG(wxT("Cache cleanup %s writing entry %s to disk"), chartSetKey, e->name.ToString());
                     e->SetOffset(offset);
                     if (!diskCache->Add(e->name,offset)){
                         LOG_DEBUG(wxT("Cache cleanup %s: disk cache is full"),chartSetKey);
                     }
                 }
             }
-            if (e->prefill){
-                //do not go through the cleanup queue but remove directly
-                Synchronized locker(lock);
-                if (inMemoryCache.erase(e->name)){
-                    currentBytes -= e->GetCompleteSize();
-                    e->Unref();
+        }
+        for (rit = writeOutList.begin(); rit != writeOutList.end(); rit++) {
+            CacheEntry *e = *rit;
+            {
+                //prefill entries will be admitted at the cold end
+                Shard *shard=GetShard(e->name);
+                Synchronized locker(shard->lock);
+                if (shard->cache.Find(e->name) == e){
+                    shard->cache.MakeEvictable(e);
                 }
             }
-            else{
-                Synchronized locker(lock);
-                cleanupQueue.push_back(e->name);
-            }
             e->Unref();
         }
         writeOutList.clear();
         //step 3
-        //cleanup entries from the cleanup queue
-        unsigned long cleanupSize=0;
-        {
-            Synchronized locker(lock);
-            cleanupSize=cleanupQueue.size();
-        }
-        inMemory+=cleanupSize;
-        bool cleanupDone=false;
-        if (cleanupSize > highWater) {
-            LOG_INFO(wxT("Cache cleanup %s starting from %ld to %ld"), chartSetKey, cleanupQueue.size(), highWater);
-            while (!cleanupDone) {
-                MD5Name name;
-                {
-                    Synchronized locker(lock);
-                    if (cleanupQueue.size() < highWater){
-                        cleanupDone=true;
-                        break;
-                    }
-                    name = cleanupQueue.front();
-                    cleanupQueue.pop_front();
-                }
-                CacheEntry *e = FindEntry(name, false);
-                if (e == NULL) {
-                    continue;
-                }
-                if (canWriteToDisk && ! e->HasDiskData()){
-                    LOG_ERROR(wxT("Cache cleanup %s unable to clean cache entry %s (not on disk), removing"),
-                            chartSetKey, name.ToString());
-                }
-                {
-                    Synchronized locker(lock);
-                    if (inMemoryCache.erase(name)) {
-                        e->Unref(); //map
-                        currentBytes -= e->GetCompleteSize();
-                    }
-                }
-                removeCount++;
-                e->Unref();
+        //evict entries starting with the least recently used ones
+        unsigned long inMemory=CurrentEntries();
+        if (budget != NULL){
+            //the global budget decides which set has to give up memory
+            budget->Enforce(percentLevel);
+        }
+        else if (inMemory > highWater) {
+            LOG_INFO(wxT("Cache cleanup %s starting from %ld to %ld"), chartSetKey, inMemory, highWater);
+            for (int i=0;i<CACHE_SHARDS;i++){
+                removeCount+=EvictShard(shards[i],shardHighWater,canWriteToDisk);
             }
         }
         int ourKb;
         SystemHelper::GetMemInfo(NULL, &ourKb);
         LOG_DEBUG(wxT("Cache cleanup %s: wrote %ld entries, removed %ld from %ld in memory entries, current size =%lld bytes, %ld entries, %s,memory=%dkb"),
-                chartSetKey, writeOutCount, removeCount, inMemory, (long long) currentBytes, (long) inMemoryCache.size(), diskCache->ToString(),ourKb);
+                chartSetKey, writeOutCount, removeCount, inMemory, (long long) CurrentBytes(), (long) CurrentEntries(), diskCache->ToString(),ourKb);
         overallRemoved+=removeCount;
     }
     return overallRemoved;
 }
 
-bool CacheHandler::OpenCacheFile(wxString fileName,wxString hash){
+UniformTiles::UniformTiles(size_t maxColors){
+    this->maxColors=maxColors;
+}
+
+UniformTiles::~UniformTiles(){
+    ColorMap::iterator it;
+    for (it=byColor.begin();it != byColor.end();it++){
+        it->second->Unref();
+    }
+}
+
+CacheEntry * UniformTiles::Find(unsigned long color){
     Synchronized locker(lock);
-    if (this->cacheFile != NULL){
-        this->cacheFile->Close();
-        delete this->cacheFile;
-        this->cacheFile=NULL;
-    }
-    this->cacheFileName=fileName;
-    LOG_INFO(wxT("CacheHandler %s open cache file %s"),chartSetKey,fileName);
-    cacheFile=openCacheFile(fileName,hash);
-    if (cacheFile == NULL){
-        LOG_ERROR(wxT("CacheHandler %s: unable to open cache file %s"),chartSetKey,cacheFileName);
+    ColorMap::iterator it=byColor.find(color);
+    if (it == byColor.end()) return NULL;
+    it->second->Ref();
+    return it->second;
+}
+
+CacheEntry * UniformTiles::Add(unsigned long color, CacheEntry* entry){
+    Synchronized locker(lock);
+    ColorMap::iterator it=byColor.find(color);
+    if (it != byColor.end()){
+        //somebody else was faster
+        it->second->Ref();
+        return it->second;
+    }
+    if (byColor.size() >= maxColors) return NULL;
+    entry->Ref(); //map
+    byColor[color]=entry;
+    byLength.insert(std::make_pair(entry->GetLength(),entry));
+    entry->Ref();
+    return entry;
+}
+
+CacheEntry * UniformTiles::FindData(const unsigned char* data, size_t len){
+    Synchronized locker(lock);
+    std::pair<LengthMap::iterator,LengthMap::iterator> range=byLength.equal_range(len);
+    LengthMap::iterator it;
+    for (it=range.first;it != range.second;it++){
+        if (memcmp(it->second->GetData(),data,len) != 0) continue;
+        it->second->Ref();
+        return it->second;
+    }
+    return NULL;
+}
+
+size_t UniformTiles::Size(){
+    Synchronized locker(lock);
+    return byColor.size();
+}
+
+bool CacheHandler::OpenSegment(unsigned int segment,wxString fileName,wxString hash){
+    LOG_INFO(wxT("CacheHandler %s open cache segment %s"),chartSetKey,fileName);
+    wxFile *file=openCacheFile(fileName,hash);
+    if (file == NULL){
+        LOG_ERROR(wxT("CacheHandler %s: unable to open cache segment %s"),chartSetKey,fileName);
         return false;
     }
+    CacheFileReader *oldFile=NULL;
+    {
+        Synchronized locker(fileLock);
+        SegmentFiles::iterator it=segmentFiles.find(segment);
+        if (it != segmentFiles.end()) oldFile=it->second;
+        segmentFiles[segment]=new CacheFileReader(fileName,file);
+    }
+    if (oldFile != NULL) oldFile->Unref();
+    diskCache->AddSegment(segment);
     return true;
 }
+
+long CacheHandler::CloseSegment(unsigned int segment){
+    unsigned long removed=diskCache->RemoveSegment(segment);
+    CacheFileReader *oldFile=NULL;
+    {
+        Synchronized locker(fileLock);
+        SegmentFiles::iterator it=segmentFiles.find(segment);
+        if (it != segmentFiles.end()){
+            oldFile=it->second;
+            segmentFiles.erase(it);
+        }
+    }
+    if (oldFile != NULL) oldFile->Unref();
+    //entries that are in memory are hot - write them again
+    std::vector<CacheEntry*> copy;
+    for (int i=0;i<CACHE_SHARDS;i++){
+        Synchronized locker(shards[i]->lock);
+        std::vector<CacheEntry*> entries;
+        shards[i]->cache.GetEntries(entries);
+        std::vector<CacheEntry*>::iterator it;
+        for (it=entries.begin();it != entries.end();it++){
+            CacheEntry *e=*it;
+            //entries of other settings variants are not in our files
+            if (e->name.GetGeneration() != generation) continue;
+            if (! e->HasDiskData() || SEGMENT_OF(e->offset) != segment) continue;
+            e->ClearOffset();
+            e->Ref();
+            copy.push_back(e);
+        }
+    }
+    if (copy.size() > 0){
+        Synchronized locker(writeLock);
+        writeOutQueue.insert(writeOutQueue.end(),copy.begin(),copy.end());
+    }
+    LOG_INFO(wxT("CacheHandler %s: closed segment %u with %ld entries, copy forward %ld"),
+            chartSetKey,segment,(long)removed,(long)copy.size());
+    return copy.size();
+}
+
+void CacheHandler::GetSegments(DiskSegmentList &out){
+    diskCache->GetSegments(out);
+}
+
 unsigned long CacheHandler::GetWriteQueueSize(){
-    Synchronized locker(lock);
+    Synchronized locker(writeLock);
     return writeOutQueue.size();
 }
 
-CacheReaderWriter::CacheReaderWriter(wxString fileName, wxString hash, CacheHandler* handler,long maxFileEntries): Thread() {
+CacheReaderWriter::CacheReaderWriter(wxString fileName, wxString hash, CacheHandler* handler,long maxFileEntries,
+        LegacyKeyResolver *resolver,DiskScheduler *scheduler): Thread() {
     this->fileName=fileName;
     this->hash=hash;
     this->handler=handler;
@@ -652,9 +1864,39 @@ CacheReaderWriter::CacheReaderWriter(wxString fileName, wxString hash, CacheHand
     this->maxFileEntries=maxFileEntries;
     this->initiallyRead=0;
     this->numWritten=0;
+    this->numRefs=0;
+    this->bytesSaved=0;
     this->endPos=0;
+    this->numMigrated=0;
+    this->fromIndex=0;
+    this->indexSequence=0;
+    this->lastRecordPos=0;
+    this->resolver=resolver;
+    this->currentSegment=0;
+    this->segmentRecords=0;
+    this->segmentLimit=1;
+    this->numSegments=0;
+    this->numEvicted=0;
+    this->numCopied=0;
+    this->numBatches=0;
+    this->numSyncs=0;
+    this->numCrcErrors=0;
+    this->scheduler=scheduler;
+    this->writer=NULL;
+    this->registered=false;
+    this->lastIndexTime=0;
+    this->lastSyncTime=0;
+    this->nextSegmentTry=0;
+    this->indexWritten=0;
+}
+
+long CacheReaderWriter::syncInterval=30;
+
+void CacheReaderWriter::SetSyncInterval(long seconds){
+    syncInterval=seconds;
 }
 CacheReaderWriter::~CacheReaderWriter(){
+    Finish();
     if (file != NULL){
         file->Close();
         delete file;
@@ -685,142 +1927,780 @@ wxString CacheReaderWriter::ToJson(){
             JSON_SV(status,%s) ",\n"
             JSON_SV(fileName,%s) ",\n"
             JSON_IV(written,%ld) ",\n"
+            JSON_IV(dedupRefs,%ld) ",\n"
+            JSON_IV(dedupBytesSaved,%lld) ",\n"
             JSON_IV(maxAllowed,%ld) ",\n"
             JSON_IV(initiallyRead,%ld) ",\n"
+            JSON_IV(migrated,%ld) ",\n"
+            JSON_IV(fromIndex,%ld) ",\n"
+            JSON_IV(indexSequence,%llu) ",\n"
+            JSON_IV(segments,%ld) ",\n"
+            JSON_IV(currentSegment,%u) ",\n"
+            JSON_IV(evictedSegments,%ld) ",\n"
+            JSON_IV(copiedForward,%ld) ",\n"
+            JSON_IV(writeBatches,%ld) ",\n"
+            JSON_IV(syncs,%ld) ",\n"
+            JSON_IV(crcErrors,%ld) ",\n"
             JSON_IV(fileSize,%lld) "\n"
             "}",
             status,
             fileName,
             numWritten,
+            numRefs,
+            bytesSaved,
             maxFileEntries,
             initiallyRead,
-            (long long)endPos);
+            numMigrated,
+            fromIndex,
+            indexSequence,
+            numSegments,
+            currentSegment,
+            numEvicted,
+            numCopied,
+            numBatches,
+            numSyncs,
+            numCrcErrors,
+            (long long)SEGMENT_OFFSET(endPos));
     return rt;
 }
 
 bool CacheReaderWriter::DeleteFile(){
     LOG_INFO(wxT("CacheReaderWriter removing cache file %s"),fileName);
-    return wxRemoveFile(fileName);
+    segments.clear();
+    numSegments=0;
+    return RemoveFiles(fileName);
+}
+
+wxString CacheReaderWriter::IndexFileName(wxString cacheFile){
+    return cacheFile+wxT(".idx");
+}
+
+long CacheReaderWriter::CountEntries(wxString cacheFile){
+    wxString indexFile=IndexFileName(cacheFile);
+    if (!wxFileExists(indexFile)) return -1;
+    wxFile index(indexFile, wxFile::read);
+    if (!index.IsOpened()) return -1;
+    IndexHeader header;
+    if (index.Read(&header, sizeof (header)) != sizeof (header)) return -1;
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof (header.magic)) != 0 ||
+            header.version != CURRENT_VERSION) return -1;
+    return header.numEntries;
+}
+
+wxString CacheReaderWriter::SegmentFileName(wxString cacheFile, unsigned int segment){
+    return cacheFile+wxString::Format(wxT(".%0*u"),SEGMENT_DIGITS,segment);
+}
+
+bool CacheReaderWriter::FindSegments(wxString cacheFile, SegmentList &out){
+    out.clear();
+    wxFileName base(cacheFile);
+    if (!wxDirExists(base.GetPath())) return false;
+    wxDir dir(base.GetPath());
+    if (!dir.IsOpened()) return false;
+    wxString prefix=base.GetFullName()+wxT(".");
+    wxString name;
+    bool found=dir.GetFirst(&name,prefix+wxT("*"),wxDIR_FILES);
+    while (found){
+        wxString suffix=name.Mid(prefix.Length());
+        unsigned long segment=0;
+        if (suffix.Length() == SEGMENT_DIGITS && suffix.ToULong(&segment)){
+            out.push_back(segment);
+        }
+        found=dir.GetNext(&name);
+    }
+    std::sort(out.begin(),out.end());
+    return true;
+}
+
+bool CacheReaderWriter::RemoveFiles(wxString cacheFile){
+    bool rt=true;
+    SegmentList existing;
+    FindSegments(cacheFile,existing);
+    SegmentList::iterator it;
+    for (it=existing.begin();it != existing.end();it++){
+        if (!wxRemoveFile(SegmentFileName(cacheFile,*it))) rt=false;
+    }
+    wxString indexFile=IndexFileName(cacheFile);
+    if (wxFileExists(indexFile) && !wxRemoveFile(indexFile)) rt=false;
+    //older versions used a single file
+    if (wxFileExists(cacheFile) && !wxRemoveFile(cacheFile)) rt=false;
+    return rt;
+}
+
+bool CacheReaderWriter::ReadIndex(const SegmentList &found, wxFileOffset &dataEnd){
+    wxString indexFile=IndexFileName(fileName);
+    if (!wxFileExists(indexFile)) return false;
+    wxFile index(indexFile, wxFile::read);
+    if (!index.IsOpened()) return false;
+    IndexHeader header;
+    if (index.Read(&header, sizeof (header)) != sizeof (header)) return false;
+    if (memcmp(header.magic, INDEX_MAGIC, sizeof (header.magic)) != 0 ||
+            header.version != CURRENT_VERSION ||
+            memcmp(header.token, hash.ToAscii().data(), sizeof (header.token)) != 0) {
+        LOG_INFO(wxT("CacheReaderWriter: index %s does not match"), indexFile);
+        return false;
+    }
+    if (header.lastRecord >= header.dataEnd || header.numSegments > found.size() ||
+            header.numEntries > (unsigned long) maxFileEntries || header.numDedup > DEDUP_MAX_INDEX) {
+        LOG_INFO(wxT("CacheReaderWriter: index %s is stale"), indexFile);
+        return false;
+    }
+    std::vector<IndexEntry> entries(header.numEntries);
+    std::vector<IndexDedupEntry> dedup(header.numDedup);
+    SegmentList indexSegments(header.numSegments);
+    size_t entriesLen = header.numEntries * sizeof (IndexEntry);
+    size_t dedupLen = header.numDedup * sizeof (IndexDedupEntry);
+    size_t segmentsLen = header.numSegments * sizeof (unsigned int);
+    if ((entriesLen > 0 && index.Read(entries.data(), entriesLen) != (ssize_t) entriesLen) ||
+            (dedupLen > 0 && index.Read(dedup.data(), dedupLen) != (ssize_t) dedupLen) ||
+            (segmentsLen > 0 && index.Read(indexSegments.data(), segmentsLen) != (ssize_t) segmentsLen)) {
+        LOG_INFO(wxT("CacheReaderWriter: index %s is incomplete"), indexFile);
+        return false;
+    }
+    unsigned int checksum = header.checksum;
+    header.checksum = 0;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) &header, sizeof (header));
+    if (entriesLen > 0) crc = crc32(crc, (const Bytef *) entries.data(), entriesLen);
+    if (dedupLen > 0) crc = crc32(crc, (const Bytef *) dedup.data(), dedupLen);
+    if (segmentsLen > 0) crc = crc32(crc, (const Bytef *) indexSegments.data(), segmentsLen);
+    if ((unsigned int) crc != checksum) {
+        LOG_INFO(wxT("CacheReaderWriter: invalid checksum in index %s"), indexFile);
+        return false;
+    }
+    //the segments up to the one with dataEnd must not have changed
+    unsigned int endSegment = SEGMENT_OF(header.dataEnd);
+    SegmentList expected;
+    SegmentList::const_iterator sit;
+    for (sit = found.begin(); sit != found.end(); sit++) {
+        if (*sit <= endSegment) expected.push_back(*sit);
+    }
+    if (expected.size() < 1 || expected != indexSegments || expected.back() != endSegment) {
+        LOG_INFO(wxT("CacheReaderWriter: segments have changed since index %s"), indexFile);
+        return false;
+    }
+    //check that the last segment still contains the last record we have seen
+    wxString endFile = SegmentFileName(fileName, endSegment);
+    wxFile last(endFile, wxFile::read);
+    if (!last.IsOpened() || last.Length() < SEGMENT_OFFSET(header.dataEnd)) {
+        LOG_INFO(wxT("CacheReaderWriter: segment %s is shorter then index %s"), endFile, indexFile);
+        return false;
+    }
+    if (header.lastRecord > 0) {
+        RecordHeader rheader;
+        wxFileOffset lastOffset = SEGMENT_OFFSET(header.lastRecord);
+        if (SEGMENT_OF(header.lastRecord) != endSegment ||
+                last.Seek(lastOffset) != lastOffset ||
+                !readAndCheckHeader(endFile, &last, &rheader) ||
+                rheader.key != header.lastKey ||
+                (lastOffset + (long long) sizeof (rheader) + rheader.dataLen) != SEGMENT_OFFSET(header.dataEnd)) {
+            LOG_INFO(wxT("CacheReaderWriter: index %s does not match the last record"), indexFile);
+            return false;
+        }
+    }
+    std::vector<IndexEntry>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++) {
+        if (handler->AddDiskEntry(TileKey::FromValue(it->key), it->offset)) {
+            initiallyRead++;
+        }
+    }
+    //dedup entries are always from the last segment
+    std::vector<IndexDedupEntry>::iterator dit;
+    for (dit = dedup.begin(); dit != dedup.end(); dit++) {
+        dedupIndex[dit->contentHash] = dit->offset;
+    }
+    fromIndex = initiallyRead;
+    indexSequence = header.sequence;
+    lastRecordPos = header.lastRecord;
+    dataEnd = header.dataEnd;
+    LOG_INFO(wxT("CacheReaderWriter: read %ld entries in %ld segments from index %s, sequence %llu"),
+            fromIndex, (long) indexSegments.size(), indexFile, indexSequence);
+    return true;
+}
+
+bool CacheReaderWriter::WriteIndex(wxFileOffset dataEnd){
+    wxString indexFile = IndexFileName(fileName);
+    CacheHandler::DiskEntryList diskEntries;
+    handler->GetDiskEntries(diskEntries);
+    std::vector<IndexEntry> entries;
+    entries.reserve(diskEntries.size());
+    CacheHandler::DiskEntryList::iterator it;
+    for (it = diskEntries.begin(); it != diskEntries.end(); it++) {
+        IndexEntry entry;
+        entry.key = it->first;
+        entry.offset = it->second;
+        entries.push_back(entry);
+    }
+    diskEntries.clear();
+    std::vector<IndexDedupEntry> dedup;
+    dedup.reserve(dedupIndex.size());
+    DedupIndex::iterator dit;
+    for (dit = dedupIndex.begin(); dit != dedupIndex.end(); dit++) {
+        IndexDedupEntry entry;
+        entry.contentHash = dit->first;
+        entry.offset = dit->second;
+        dedup.push_back(entry);
+    }
+    IndexHeader header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof (header.magic));
+    header.version = CURRENT_VERSION;
+    memcpy(header.token, hash.ToAscii().data(), sizeof (header.token));
+    header.sequence = indexSequence + 1;
+    header.dataEnd = dataEnd;
+    header.lastRecord = lastRecordPos;
+    header.numEntries = entries.size();
+    header.numDedup = dedup.size();
+    header.numSegments = segments.size();
+    if (lastRecordPos > 0) {
+        RecordHeader rheader;
+        wxString lastName = SegmentFileName(fileName, SEGMENT_OF(lastRecordPos));
+        wxFile lastFile(lastName, wxFile::read);
+        wxFileOffset lastOffset = SEGMENT_OFFSET(lastRecordPos);
+        if (!lastFile.IsOpened() || lastFile.Seek(lastOffset) != lastOffset ||
+                !readAndCheckHeader(lastName, &lastFile, &rheader)) {
+            LOG_ERROR(wxT("CacheReaderWriter: unable to read last record for index %s"), indexFile);
+            return false;
+        }
+        header.lastKey = rheader.key;
+    }
+    size_t entriesLen = entries.size() * sizeof (IndexEntry);
+    size_t dedupLen = dedup.size() * sizeof (IndexDedupEntry);
+    size_t segmentsLen = segments.size() * sizeof (unsigned int);
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, (const Bytef *) &header, sizeof (header));
+    if (entriesLen > 0) crc = crc32(crc, (const Bytef *) entries.data(), entriesLen);
+    if (dedupLen > 0) crc = crc32(crc, (const Bytef *) dedup.data(), dedupLen);
+    if (segmentsLen > 0) crc = crc32(crc, (const Bytef *) segments.data(), segmentsLen);
+    header.checksum = crc;
+    //write to a temp file and rename, so we always have a complete index
+    wxString tmpName = indexFile + wxT(".tmp");
+    wxFile out(tmpName, wxFile::write);
+    bool ok = out.IsOpened();
+    if (ok) ok = out.Write(&header, sizeof (header)) == sizeof (header);
+    if (ok && entriesLen > 0) ok = out.Write(entries.data(), entriesLen) == entriesLen;
+    if (ok && dedupLen > 0) ok = out.Write(dedup.data(), dedupLen) == dedupLen;
+    if (ok && segmentsLen > 0) ok = out.Write(segments.data(), segmentsLen) == segmentsLen;
+    if (ok) ok = out.Flush();
+    if (out.IsOpened()) out.Close();
+    if (!ok || !wxRenameFile(tmpName, indexFile, true)) {
+        LOG_ERROR(wxT("CacheReaderWriter: unable to write index %s"), indexFile);
+        wxRemoveFile(tmpName);
+        return false;
+    }
+    indexSequence = header.sequence;
+    LOG_INFO(wxT("CacheReaderWriter: written index %s with %ld entries up to %u/%lld, sequence %llu"),
+            indexFile, (long) entries.size(), SEGMENT_OF(dataEnd), (long long) SEGMENT_OFFSET(dataEnd), indexSequence);
+    return true;
+}
+
+/**
+ * write all buffers, continue after partial writes
+ */
+static bool writeAll(int fd,struct iovec *iov,int count){
+    while (count > 0){
+        int chunk=count < IOV_MAX?count:IOV_MAX;
+        ssize_t wr=::writev(fd,iov,chunk);
+        if (wr < 0){
+            if (errno == EINTR) continue;
+            return false;
+        }
+        bool progress=(wr > 0);
+        //skip the buffers that are completely written
+        while (count > 0 && (size_t)wr >= iov->iov_len){
+            if (iov->iov_len > 0) progress=true;
+            wr-=iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0 && wr > 0){
+            iov->iov_base=(char *)iov->iov_base+wr;
+            iov->iov_len-=wr;
+        }
+        if (!progress) return false;
+    }
+    return true;
+}
+
+static bool syncData(int fd){
+#ifdef __APPLE__
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
 }
 
 class CacheWriterImpl: public CacheFileWrite{
 private:
     wxFile *file;
     wxString fileName;
+    unsigned int segment;
+    CacheReaderWriter::DedupIndex *index;
+    bool unsynced;
 public:
     long numWritten;
-    long maxRecords;
+    long numRefs;
+    long long bytesSaved;
+    long long bytesWritten;
+    long numBatches;
+    long numSyncs;
+    long maxRecords;    //-1: no limit
     wxFileOffset currentPos;
-    CacheWriterImpl(wxString fileName,wxFile *file,long maxRecords){
-        this->file=file;
+    CacheWriterImpl(wxString fileName,wxFile *file,long maxRecords,CacheReaderWriter::DedupIndex *index,
+            unsigned int segment=0){
         this->fileName=fileName;
         this->maxRecords=maxRecords;
+        this->index=index;
+        this->file=NULL;
+        unsynced=false;
         numWritten=0;
-        currentPos=file->Tell();
+        numRefs=0;
+        bytesSaved=0;
+        bytesWritten=0;
+        numBatches=0;
+        numSyncs=0;
+        SetFile(file,segment);
     }
-    virtual wxFileOffset WriteToDisk(CacheEntry *entry){
-        if (this->file == NULL) {
-            LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s cache file %s not open(1)"),entry->name.ToString(),fileName);
-            return 0;
-        }
-        if (!this->file->IsOpened()) {
-            LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s cache file %s not open(2)"),entry->name.ToString(),fileName);
-            return 0;
-        }
-        if (entry->mode != CacheEntry::MEMORY){
-            LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s invalid mode %d"),entry->name.ToString(),entry->mode);
-            return 0;
+    /**
+     * continue writing to a new segment
+     * the old one must have been synced before
+     */
+    void SetFile(wxFile *file,unsigned int segment){
+        unsynced=false;
+        this->file=file;
+        this->segment=segment;
+        currentPos=file?SEGMENT_POS(segment,file->Tell()):0;
+    }
+    /**
+     * make the written records durable
+     * readers do not need this, they see the data in the page cache
+     */
+    bool Sync(){
+        if (! unsynced || file == NULL || ! file->IsOpened()) return true;
+        unsynced=false;
+        numSyncs++;
+        if (!syncData(file->fd())){
+            LOG_ERROR(wxT("CacheReaderWriter: unable to sync cache file %s"),fileName);
+            return false;
         }
-        if (numWritten >= maxRecords){
-            LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s limit of %ld records reached"),entry->name.ToString(),maxRecords);
+        return true;
+    }
+    virtual long WriteToDisk(const std::vector<CacheEntry *> &entries,std::vector<wxFileOffset> &offsets){
+        offsets.assign(entries.size(),0);
+        if (this->file == NULL || !this->file->IsOpened()) {
+            LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: cache file %s not open"),fileName);
             return 0;
         }
-        wxFileOffset pos=file->Tell();
-        RecordHeader rheader;
-        memcpy(rheader.magic,RECORDMAGIC,sizeof(rheader.magic));
-        rheader.version=CURRENT_VERSION;
-        rheader.name=entry->name;
-        rheader.dataLen=entry->GetLength();
-        rheader.headerLen=sizeof(rheader);
-        unsigned int wr=file->Write(&rheader,sizeof(rheader));
-        if (wr != sizeof(rheader)){
-            LOG_ERROR(wxT("CacheReaderWriter: unable to write header to cache file %s"),fileName);
-            return 0;
+        wxFileOffset start=file->Tell();
+        wxFileOffset pos=start;
+        wxFileOffset lastPos=0;
+        std::vector<RecordHeader> headers(entries.size()); //must not grow, iov points into it
+        std::vector<struct iovec> iov;
+        iov.reserve(2*entries.size());
+        std::vector<MD5Name> hashed;
+        long records=0;
+        long refs=0;
+        long long saved=0;
+        for (size_t i=0;i<entries.size();i++){
+            CacheEntry *entry=entries[i];
+            if (entry->mode != CacheEntry::MEMORY){
+                LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s invalid mode %d"),entry->name.ToString(),entry->mode);
+                continue;
+            }
+            if (maxRecords >= 0 && (numWritten+records) >= maxRecords){
+                LOG_ERROR(wxT("CacheReaderWriter::WriteToDisk: %s limit of %ld records reached"),entry->name.ToString(),maxRecords);
+                break;
+            }
+            wxFileOffset recordPos=SEGMENT_POS(segment,pos);
+            RecordHeader &rheader=headers[i];
+            memset(&rheader,0,sizeof(rheader));
+            memcpy(rheader.magic,RECORDMAGIC,sizeof(rheader.magic));
+            rheader.version=CURRENT_VERSION;
+            rheader.key=entry->name.TilePart().GetValue();
+            rheader.dataLen=entry->GetLength();
+            rheader.headerLen=sizeof(rheader);
+            if (entry->GetLength() <= DEDUP_MAX_LEN){
+                MD5 contentHash;
+                contentHash.AddBuffer(entry->GetData(),entry->GetLength());
+                rheader.contentHash=contentHash.GetValueCopy();
+                CacheReaderWriter::DedupIndex::iterator it=index->find(rheader.contentHash);
+                if (it != index->end()){
+                    rheader.flags=RECORD_REF;
+                    rheader.refOffset=it->second;
+                    rheader.dataLen=0;
+                }
+                else if (index->size() < DEDUP_MAX_INDEX){
+                    rheader.flags=RECORD_HASHED;
+                    (*index)[rheader.contentHash]=recordPos;
+                    hashed.push_back(rheader.contentHash);
+                }
+            }
+            rheader.crc=recordCrc(&rheader,entry->GetData());
+            struct iovec part;
+            part.iov_base=&rheader;
+            part.iov_len=sizeof(rheader);
+            iov.push_back(part);
+            if (rheader.flags & RECORD_REF){
+                refs++;
+                saved+=entry->GetLength();
+            }
+            else if (rheader.dataLen > 0){
+                part.iov_base=(void *)entry->GetData();
+                part.iov_len=rheader.dataLen;
+                iov.push_back(part);
+            }
+            offsets[i]=recordPos;
+            lastPos=recordPos;
+            pos+=sizeof(rheader)+rheader.dataLen;
+            records++;
         }
-        if (entry->GetLength() != 0) {
-            wr=file->Write(entry->GetData(),entry->GetLength());
-            if (wr != entry->GetLength()){
-                LOG_ERROR(wxT("CacheReaderWriter: unable to write data to cache file %s"),fileName);
-                return 0;
+        if (records < 1) return 0;
+        if (!writeAll(file->fd(),iov.data(),iov.size())){
+            LOG_ERROR(wxT("CacheReaderWriter: unable to write %ld records to cache file %s: %d"),records,fileName,errno);
+            //remove a partial batch, so the file ends with a complete record
+            if (ftruncate(file->fd(),start) != 0 || file->Seek(start) != start){
+                LOG_ERROR(wxT("CacheReaderWriter: unable to truncate cache file %s"),fileName);
             }
+            std::vector<MD5Name>::iterator it;
+            for (it=hashed.begin();it != hashed.end();it++){
+                index->erase(*it);
+            }
+            offsets.assign(entries.size(),0);
+            return 0;
         }
-        numWritten++;
-        file->Flush(); //need to write to disk as the cache could try to read afterwards
-        currentPos=pos;
-        return pos;
-        
+        numWritten+=records;
+        numRefs+=refs;
+        bytesSaved+=saved;
+        bytesWritten+=pos-start;
+        numBatches++;
+        unsynced=true;
+        currentPos=lastPos;
+        return records;
     }
 };
 
-bool CacheReaderWriter::ReadFile() {
-    FileHeader fheader;
-    bool append = false;
-    initiallyRead=0;
-    if (!wxFileExists(fileName)) {
-        return false;
+bool CacheReaderWriter::ReadSegment(unsigned int segment, wxFileOffset start) {
+    wxString segmentFile = SegmentFileName(fileName, segment);
+    wxFile *in = openCacheFile(segmentFile, hash);
+    if (in == NULL) return false;
+    wxFileOffset fileSize = in->Length();
+    wxFileOffset lastPos = in->Tell();
+    if (start > lastPos) {
+        //the part before start is already known from the index
+        if (start > fileSize || in->Seek(start) != start) {
+            in->Close();
+            delete in;
+            return false;
+        }
+        lastPos = start;
     }
-    wxULongLong fileSize=wxFileName::GetSize(fileName);
-    state = STATE_READING;
-    file = openCacheFile(fileName, hash);
-    if (file == NULL) {
-        DeleteFile();
-        return false;
+    else {
+        //records can only refer to records in the same segment
+        dedupIndex.clear();
     }
     bool needsTruncate = false;
-    append = true;
-    wxFileOffset lastPos = file->Tell();
-    endPos=lastPos;
-    char nameBuffer[2 * MD5_LEN + 1];
-    LOG_INFO(wxT("start reading cache entries from %s"), fileName);
-    while (!file->Eof() && !shouldStop()) {
-        if (initiallyRead >= maxFileEntries){
-            LOG_INFO(wxT("CacheReaderWriter: current cache file is bigger then allowed %ld records, truncate"),maxFileEntries);
-            needsTruncate=true;
-            break;
-        }
+    long numRead = 0;
+    std::vector<unsigned char> data;
+    while (lastPos < fileSize && !shouldStop()) {
         RecordHeader rheader;
-        if (!readAndCheckHeader(fileName, file, &rheader)) {
+        if (!readAndCheckHeader(segmentFile, in, &rheader)) {
             needsTruncate = true;
             break;
         }
-        LOG_DEBUG(wxT("CacheReaderWriter: adding cache entry %s from %s"), rheader.name.ToString(), fileName);
-        if (handler->AddDiskEntry(rheader.name,lastPos)){
-            initiallyRead++;
+        wxFileOffset pos = SEGMENT_POS(segment, lastPos);
+        if ((rheader.flags & RECORD_REF) && (rheader.refOffset >= pos ||
+                SEGMENT_OF(rheader.refOffset) != segment || rheader.dataLen != 0)){
+            LOG_ERROR(wxT("CacheReaderWriter: invalid reference after %ld records in %s"), numRead, segmentFile);
+            needsTruncate = true;
+            break;
         }
-        else{
-            LOG_DEBUG(wxT("CacheReaderWriter: disk cache is full in read from %s"),fileName);
+        wxFileOffset next = lastPos + (wxFileOffset) sizeof (RecordHeader) + rheader.dataLen;
+        if (next > fileSize) {
+            LOG_ERROR(wxT("CacheReaderWriter: incomplete record after %ld records in %s"), numRead, segmentFile);
+            needsTruncate = true;
+            break;
         }
-        wxFileOffset next = file->Seek(rheader.dataLen, wxFromCurrent);
-        if (next == wxInvalidOffset || (next != (lastPos+(int)sizeof(RecordHeader)+rheader.dataLen)) || next > fileSize) {
-            LOG_ERROR(wxT("CacheReaderWriter: unable to seek after %ld records in %s"), initiallyRead, fileName);
+        //read the data to verify the crc, a torn write will be cut off here
+        if (data.size() < rheader.dataLen) data.resize(rheader.dataLen);
+        if ((rheader.dataLen > 0 && in->Read(data.data(), rheader.dataLen) != (ssize_t) rheader.dataLen) ||
+                recordCrc(&rheader, data.data()) != rheader.crc) {
+            LOG_ERROR(wxT("CacheReaderWriter: invalid crc after %ld records in %s"), numRead, segmentFile);
+            numCrcErrors++;
             needsTruncate = true;
             break;
         }
+        if ((rheader.flags & RECORD_HASHED) && dedupIndex.size() < DEDUP_MAX_INDEX){
+            dedupIndex[rheader.contentHash]=pos;
+        }
+        TileKey key=TileKey::FromValue(rheader.key);
+        lastRecordPos=pos;
+        LOG_DEBUG(wxT("CacheReaderWriter: adding cache entry %s from %s"), key.ToString(), segmentFile);
+        if (handler->AddDiskEntry(key,pos)){
+            initiallyRead++;
+        }
+        else{
+            LOG_DEBUG(wxT("CacheReaderWriter: disk cache is full in read from %s"),segmentFile);
+        }
+        numRead++;
         lastPos = next;
-        if (lastPos == fileSize) break;
-        endPos=lastPos;
     }
-
-    file->Close();
-    file = NULL;
-    if (shouldStop()) return false;
+    in->Close();
+    delete in;
+    if (shouldStop()) return true;
     if (needsTruncate) {
-        LOG_INFO(wxT("CacheReaderWriter: truncating file %s to %lld"), fileName, (long long) lastPos);
-        truncate(fileName.ToUTF8().data(), lastPos);
-        endPos=lastPos;
+        LOG_INFO(wxT("CacheReaderWriter: truncating file %s to %lld"), segmentFile, (long long) lastPos);
+        truncate(segmentFile.ToUTF8().data(), lastPos);
     }
+    endPos=SEGMENT_POS(segment, lastPos);
+    LOG_INFO(wxT("CacheReaderWriter: read %ld records from %s"), numRead, segmentFile);
+    return handler->OpenSegment(segment, segmentFile, hash);
+}
+
+bool CacheReaderWriter::ReadFile() {
+    initiallyRead=0;
+    state = STATE_READING;
+    FindSegments(fileName, segments);
+    //older versions used a single file without segments
+    if (wxFileExists(fileName)) {
+        if (segments.size() < 1) {
+            wxFile *plain = openCacheFile(fileName, hash);
+            if (plain != NULL) {
+                plain->Close();
+                delete plain;
+                LOG_INFO(wxT("CacheReaderWriter: using %s as first segment"), fileName);
+                wxRenameFile(fileName, SegmentFileName(fileName, 0), true);
+            }
+            else if (resolver != NULL) {
+                MigrateFile();
+            }
+        }
+        if (wxFileExists(fileName)) wxRemoveFile(fileName);
+        FindSegments(fileName, segments);
+    }
+    if (segments.size() < 1) {
+        numSegments = 0;
+        return false;
+    }
+    wxFileOffset indexEnd = 0;
+    bool hasIndex = ReadIndex(segments, indexEnd);
+    LOG_INFO(wxT("start reading %ld cache segments of %s"), (long) segments.size(), fileName);
+    SegmentList valid;
+    SegmentList::iterator it;
+    for (it = segments.begin(); it != segments.end() && !shouldStop(); it++) {
+        unsigned int segment = *it;
+        bool ok = false;
+        if (hasIndex && segment < SEGMENT_OF(indexEnd)) {
+            //completely covered by the index
+            ok = handler->OpenSegment(segment, SegmentFileName(fileName, segment), hash);
+        }
+        else {
+            wxFileOffset start = 0;
+            if (hasIndex && segment == SEGMENT_OF(indexEnd)) start = SEGMENT_OFFSET(indexEnd);
+            ok = ReadSegment(segment, start);
+        }
+        if (ok) {
+            valid.push_back(segment);
+        }
+        else {
+            LOG_ERROR(wxT("CacheReaderWriter: removing invalid segment %s"), SegmentFileName(fileName, segment));
+            handler->CloseSegment(segment);
+            wxRemoveFile(SegmentFileName(fileName, segment));
+        }
+    }
+    if (shouldStop()) return false;
+    segments = valid;
+    numSegments = segments.size();
     LOG_INFO(wxT("CacheReaderWriter: cache reading finished after %ld entries for %s"), initiallyRead, fileName);
-    return append;
+    return segments.size() > 0;
+}
+
+static void unrefEntries(std::vector<CacheEntry *> &entries){
+    std::vector<CacheEntry *>::iterator it;
+    for (it = entries.begin(); it != entries.end(); it++) {
+        (*it)->Unref();
+    }
+    entries.clear();
+}
+
+bool CacheReaderWriter::MigrateFile() {
+    wxFile *in = openCacheFile(fileName, hash, LEGACY_VERSION);
+    if (in == NULL) return false;
+    LOG_INFO(wxT("CacheReaderWriter: converting cache file %s from version %d"), fileName, LEGACY_VERSION);
+    class LegacyRecord{
+    public:
+        MD5Name         name;
+        wxFileOffset    dataPos;
+        unsigned int    dataLen;
+    };
+    std::vector<LegacyRecord> records;
+    LegacyKeyResolver::NameSet names;
+    wxFileOffset fileSize = in->Length();
+    wxFileOffset pos = in->Tell();
+    while (pos < fileSize && !shouldStop()) {
+        LegacyRecordHeader rheader;
+        if (in->Read(&rheader, sizeof (rheader)) != sizeof (rheader)) break;
+        if (memcmp(rheader.magic, RECORDMAGIC, sizeof (rheader.magic)) != 0 ||
+                rheader.version != LEGACY_VERSION ||
+                rheader.headerLen != sizeof (rheader) ||
+                rheader.dataLen > MAX_DATALEN ||
+                (pos + (wxFileOffset) sizeof (rheader) + rheader.dataLen) > fileSize) {
+            LOG_INFO(wxT("CacheReaderWriter: invalid legacy record in %s at %lld"), fileName, (long long) pos);
+            break;
+        }
+        LegacyRecord record;
+        record.name = rheader.name;
+        record.dataPos = pos + sizeof (rheader);
+        record.dataLen = rheader.dataLen;
+        records.push_back(record);
+        names.insert(rheader.name);
+        pos = in->Seek(rheader.dataLen, wxFromCurrent);
+        if (pos == wxInvalidOffset) break;
+    }
+    if (records.size() < 1 || shouldStop()) {
+        in->Close();
+        delete in;
+        return false;
+    }
+    //the resolver needs the charts, so we may have to wait
+    //until the set has been read
+    LegacyKeyResolver::KeyMap keys;
+    long resolved = -1;
+    while ((resolved = resolver->ResolveLegacyKeys(names, keys, MIGRATE_MAX_TILES)) < 0) {
+        if (waitMillis(500)) break;
+    }
+    names.clear();
+    if (resolved < 1 || shouldStop()) {
+        LOG_INFO(wxT("CacheReaderWriter: no tiles found for %ld legacy records in %s"), (long) records.size(), fileName);
+        in->Close();
+        delete in;
+        return false;
+    }
+    wxString tmpName = fileName + wxT(".tmp");
+    wxFile *out = new wxFile(tmpName, wxFile::write);
+    if (!out->IsOpened() || !writeFileHeader(out, hash)) {
+        LOG_ERROR(wxT("CacheReaderWriter: unable to create %s"), tmpName);
+        delete out;
+        in->Close();
+        delete in;
+        return false;
+    }
+    DedupIndex newIndex;
+    CacheWriterImpl writer(tmpName, out, maxFileEntries, &newIndex);
+    bool ok = true;
+    std::vector<CacheEntry *> batch;
+    std::vector<wxFileOffset> offsets;
+    std::vector<LegacyRecord>::iterator it;
+    for (it = records.begin(); it != records.end() && !shouldStop(); it++) {
+        LegacyKeyResolver::KeyMap::iterator key = keys.find(it->name);
+        if (key == keys.end()) continue;
+        if ((writer.numWritten + (long) batch.size()) >= maxFileEntries) break;
+        unsigned char *data = (unsigned char *) malloc(it->dataLen > 0 ? it->dataLen : 1);
+        if (data == NULL) {
+            ok = false;
+            break;
+        }
+        if (in->Seek(it->dataPos) != it->dataPos ||
+                in->Read(data, it->dataLen) != (ssize_t) it->dataLen) {
+            LOG_ERROR(wxT("CacheReaderWriter: unable to read legacy record from %s"), fileName);
+            free(data);
+            ok = false;
+            break;
+        }
+        batch.push_back(new CacheEntry(key->second, data, it->dataLen));
+        if (batch.size() >= MIGRATE_BATCH) {
+            ok = writer.WriteToDisk(batch, offsets) == (long) batch.size();
+            unrefEntries(batch);
+            if (!ok) break;
+        }
+    }
+    if (ok && batch.size() > 0) {
+        ok = writer.WriteToDisk(batch, offsets) == (long) batch.size();
+    }
+    unrefEntries(batch);
+    if (ok) ok = writer.Sync();
+    in->Close();
+    delete in;
+    out->Close();
+    delete out;
+    if (!ok || shouldStop()) {
+        wxRemoveFile(tmpName);
+        return false;
+    }
+    //the converted file becomes the first segment
+    wxString segmentName = SegmentFileName(fileName, 0);
+    if (!wxRenameFile(tmpName, segmentName, true)) {
+        LOG_ERROR(wxT("CacheReaderWriter: unable to rename %s to %s"), tmpName, segmentName);
+        wxRemoveFile(tmpName);
+        return false;
+    }
+    numMigrated = writer.numWritten;
+    LOG_INFO(wxT("CacheReaderWriter: converted %ld of %ld records in %s"),
+            numMigrated, (long) records.size(), fileName);
+    return true;
+}
+
+bool CacheReaderWriter::StartSegment(unsigned int segment) {
+    //the current segment is only closed if the new one is ready
+    wxString segmentFile = SegmentFileName(fileName, segment);
+    wxFile *next = new wxFile(segmentFile, wxFile::write);
+    if (!next->IsOpened() || !writeFileHeader(next, hash)) {
+        LOG_ERROR(wxT("CacheReaderWriter: unable to write file header to %s"), segmentFile);
+        delete next;
+        wxRemoveFile(segmentFile);
+        return false;
+    }
+    next->Flush();
+    if (!handler->OpenSegment(segment, segmentFile, hash)) {
+        next->Close();
+        delete next;
+        wxRemoveFile(segmentFile);
+        return false;
+    }
+    if (file != NULL) {
+        file->Close();
+        delete file;
+    }
+    file = next;
+    LOG_INFO(wxT("CacheReaderWriter: started segment %s"), segmentFile);
+    segments.push_back(segment);
+    numSegments = segments.size();
+    currentSegment = segment;
+    segmentRecords = 0;
+    lastRecordPos = 0;
+    dedupIndex.clear();
+    return true;
+}
+
+bool CacheReaderWriter::EvictSegment(bool onlyEmpty) {
+    CacheHandler::DiskSegmentList infos;
+    handler->GetSegments(infos);
+    DiskSegmentInfo *victim = NULL;
+    CacheHandler::DiskSegmentList::iterator it;
+    for (it = infos.begin(); it != infos.end(); it++) {
+        if (it->segment == currentSegment) continue;
+        if (std::find(segments.begin(), segments.end(), it->segment) == segments.end()) continue;
+        if (onlyEmpty) {
+            if (it->records > 0) continue;
+            victim = &(*it);
+            break;
+        }
+        //coldest: not accessed for the longest time, least hits, oldest
+        if (victim == NULL ||
+                it->lastAccess < victim->lastAccess ||
+                (it->lastAccess == victim->lastAccess && it->hits < victim->hits)) {
+            victim = &(*it);
+        }
+    }
+    if (victim == NULL) return false;
+    unsigned int segment = victim->segment;
+    LOG_INFO(wxT("CacheReaderWriter: evicting segment %u with %ld records, %lu hits from %s"),
+            segment, victim->records, victim->hits, fileName);
+    numCopied += handler->CloseSegment(segment);
+    wxRemoveFile(SegmentFileName(fileName, segment));
+    segments.erase(std::find(segments.begin(), segments.end(), segment));
+    numSegments = segments.size();
+    numEvicted++;
+    return true;
 }
 
 void CacheReaderWriter::run() {
@@ -832,63 +2712,142 @@ void CacheReaderWriter::run() {
     if (maxFileEntries < 1){
         LOG_INFO(wxT("CacheReaderWriter: file caching disabled by parameter for %s"),fileName);
     }
+    segmentLimit = maxFileEntries / NUM_SEGMENTS;
+    if (segmentLimit < 1) segmentLimit = 1;
     bool append = false;
     if (state != STATE_ERROR && maxFileEntries > 0) {
         append = ReadFile();
     }
     if (shouldStop()) return;
-    FileHeader fheader;
     if (state != STATE_ERROR) {
         bool canWrite = (maxFileEntries >= 1);
-        while (true && !shouldStop()) {
-            file = new wxFile(fileName, append ? wxFile::write_append : wxFile::write);
+        if (canWrite && append) {
+            //continue with the last segment
+            currentSegment = segments.back();
+            wxString segmentFile = SegmentFileName(fileName, currentSegment);
+            file = new wxFile(segmentFile, wxFile::write_append);
             if (!file->IsOpened()) {
-                LOG_ERROR(wxT("CacheReaderWriter: cannot open file %s for writing"), fileName);
+                LOG_ERROR(wxT("CacheReaderWriter: cannot open file %s for writing"), segmentFile);
+                delete file;
                 file = NULL;
                 canWrite = false;
-                break;
             }
-            if (!append) {
-                memcpy(fheader.magic, FILE_MAGIC, sizeof (fheader.magic));
-                fheader.version = CURRENT_VERSION;
-                fheader.headerLen = sizeof (fheader);
-                memcpy(fheader.token, hash.ToAscii().data(), sizeof (fheader.token));
-                int wr = file->Write(&fheader, sizeof (fheader));
-                if (wr != sizeof (fheader)) {
-                    LOG_ERROR(wxT("CacheReaderWriter: unable to write file header to %s"), fileName);
-                    canWrite = false;
-                    break;
+            else {
+                CacheHandler::DiskSegmentList infos;
+                handler->GetSegments(infos);
+                CacheHandler::DiskSegmentList::iterator it;
+                for (it = infos.begin(); it != infos.end(); it++) {
+                    if (it->segment == currentSegment) segmentRecords = it->records;
                 }
+                if (SEGMENT_OF(lastRecordPos) != currentSegment) lastRecordPos = 0;
             }
-            break;
+        }
+        else if (canWrite) {
+            canWrite = StartSegment(0);
         }
         if (!canWrite) {
             if (file != NULL) {
                 file->Close();
+                delete file;
             }
             file = NULL;
             LOG_ERROR(wxT("CacheReaderWriter: cache file writing for %s disabled"), fileName);
         }
-        if (file != NULL) {
-            file->Flush();
-        }
-        if (file) handler->OpenCacheFile(fileName, hash);
         state = STATE_WRITING;
     }
     if (shouldStop()) return;
-    LOG_INFO(wxT("CacheReaderWriter for %s: starting write phase, current: %ld still allowing %ld entries"),
-        fileName,initiallyRead,(maxFileEntries-initiallyRead));
-    if (file) endPos=file->Seek(0,wxSeekMode::wxFromEnd); //trigger ftell to report correctly
-    CacheWriterImpl writer(fileName, file,maxFileEntries-initiallyRead);
-    while (!shouldStop()) {
-        waitMillis(1000);
-        if (shouldStop()) break;
-        handler->RunCleanup(&writer,maxFileEntries >=1);
-        numWritten=writer.numWritten;
-        endPos=writer.currentPos;
-        if (file) file->Flush();
+    LOG_INFO(wxT("CacheReaderWriter for %s: starting write phase, current: %ld allowing %ld entries in %ld segments"),
+        fileName,initiallyRead,maxFileEntries,(long)segments.size());
+    if (file) file->Seek(0,wxSeekMode::wxFromEnd); //trigger ftell to report correctly
+    writer=new CacheWriterImpl(fileName, file,-1,&dedupIndex,currentSegment);
+    endPos=writer->currentPos;
+    lastIndexTime=wxGetLocalTime();
+    lastSyncTime=lastIndexTime;
+    indexWritten=0;
+    if (scheduler != NULL && ! shouldStop()){
+        scheduler->Register(this);
+        registered=true;
+    }
+}
+
+long long CacheReaderWriter::WriteCycle(long long maxBytes) {
+    if (writer == NULL) return 0;
+    long long bytesBefore=writer->bytesWritten;
+    if (file) {
+        bool evicted=false;
+        //segments without live records can always go
+        while (EvictSegment(true)) evicted=true;
+        //always keep room for one segment
+        while (segments.size() > 1 &&
+                ((long)handler->CurrentDiskEntries() + segmentLimit) > maxFileEntries) {
+            if (!EvictSegment(false)) break;
+            evicted=true;
+        }
+        //the index must only cover synced records
+        if (evicted && writer->Sync() && WriteIndex(SEGMENT_POS(currentSegment,file->Tell()))){
+            indexWritten=numWritten;
+        }
+    }
+    handler->RunCleanup(writer,maxFileEntries >=1,90,maxBytes);
+    if (writer->numWritten != numWritten) {
+        lastRecordPos=writer->currentPos;
+        segmentRecords+=writer->numWritten-numWritten;
+    }
+    numWritten=writer->numWritten;
+    numRefs=writer->numRefs;
+    bytesSaved=writer->bytesSaved;
+    numBatches=writer->numBatches;
+    endPos=writer->currentPos;
+    long now=wxGetLocalTime();
+    if (file && (syncInterval <= 0 || now >= (lastSyncTime+syncInterval))){
+        writer->Sync();
+        lastSyncTime=now;
     }
+    if (file && now >= nextSegmentTry &&
+            (segmentRecords >= segmentLimit || file->Tell() >= MAX_SEGMENT_SIZE)) {
+        writer->Sync();
+        if (StartSegment(currentSegment+1)) {
+            writer->SetFile(file,currentSegment);
+        }
+        else {
+            //continue with the current segment and retry later
+            LOG_ERROR(wxT("CacheReaderWriter: unable to start segment %u for %s, continue writing to segment %u"),
+                    currentSegment+1, fileName, currentSegment);
+            nextSegmentTry=now+SEGMENT_RETRY;
+        }
+    }
+    if (file && numWritten != indexWritten && now >= (lastIndexTime+INDEX_INTERVAL)){
+        if (writer->Sync() && WriteIndex(SEGMENT_POS(currentSegment,file->Tell()))) indexWritten=numWritten;
+        lastIndexTime=now;
+    }
+    numSyncs=writer->numSyncs;
+    return writer->bytesWritten-bytesBefore;
+}
+
+void CacheReaderWriter::Finish() {
+    if (registered) scheduler->Unregister(this);
+    registered=false;
+    if (writer == NULL) return;
     LOG_INFO(wxT("CacheReaderWriter for %s: stopping cache file writer"), fileName);
-    if (file) file->Close();
+    if (file) {
+        //tiles still queued have been rendered for our settings
+        handler->RunCleanup(writer,true);
+        if (writer->numWritten != numWritten) lastRecordPos=writer->currentPos;
+        numWritten=writer->numWritten;
+        if (writer->Sync() && (numWritten != indexWritten || indexSequence == 0)){
+            WriteIndex(SEGMENT_POS(currentSegment,file->Tell()));
+        }
+        numSyncs=writer->numSyncs;
+        file->Close();
+    }
+    delete writer;
+    writer=NULL;
 }
 
+wxString CacheReaderWriter::WriteFile() {
+    return SegmentFileName(fileName,currentSegment);
+}
+
+wxFileOffset CacheReaderWriter::WritePosition() {
+    return SEGMENT_OFFSET(endPos);
+}
@@ -143,6 +143,11 @@ long ChartInfo::GetLastRender(){
     return lastRender;
 }
 
+void ChartInfo::SetOpenCost(long millis,long memoryKb){
+    openMillis=millis;
+    if (memoryKb > 0) this->memoryKb=memoryKb;
+}
+
 bool ChartInfo::Close(){
     if (chart == NULL) return true;
     LOG_INFO(wxT("closing chart %s"),filename);
@@ -173,14 +178,55 @@ bool ChartInfo::Close(){
 }
 
 int ChartInfo::Init(bool allowRetry) {
+    wxLongLong start=wxGetLocalTimeMillis();
     int rt=DoReopen(false,allowRetry);
     if (rt != PI_INIT_OK) return rt;
+    //initial costs for the open chart management
+    openMillis=(wxGetLocalTimeMillis()-start).ToLong();
+    wxULongLong fileSize=wxFileName::GetSize(filename);
+    if (fileSize != wxInvalidSize) memoryKb=(fileSize/1024).GetLo();
     nativeScale=chart->GetNativeScale();
     chart->GetChartExtent(&extent);
+    ReadCoverage();
     isValid=true;
     return PI_INIT_OK;
 }
 
+static void addCoverPolygon(CoverList &list,float *points,int numPoints){
+    if (points == NULL || numPoints < 3) return;
+    CoverPolygon polygon;
+    //lat,lon pairs
+    for (int i=0;i<numPoints;i++){
+        polygon.Add(points[2*i],points[2*i+1]);
+    }
+    list.push_back(polygon);
+}
+
+void ChartInfo::ReadCoverage(){
+    covr.clear();
+    noCovr.clear();
+    for (int i=0;i<chart->GetCOVREntries();i++){
+        addCoverPolygon(covr,chart->GetCOVRTableHead(i),chart->GetCOVRTablenPoints(i));
+    }
+    PlugInChartBaseExtended *extended=wxDynamicCast(chart, PlugInChartBaseExtended);
+    if (extended != NULL){
+        for (int i=0;i<extended->GetNoCOVREntries();i++){
+            addCoverPolygon(noCovr,extended->GetNoCOVRTableHead(i),extended->GetNoCOVRTablenPoints(i));
+        }
+    }
+    //do not trust polygons outside of the extent
+    CoverList::iterator it;
+    for (it=covr.begin();it!=covr.end();it++){
+        if (! it->Intersects(extent.NLAT,extent.WLON,extent.SLAT,extent.ELON)){
+            LOG_INFO(wxT("ChartInfo: COVR outside of extent for %s, using the extent"),filename);
+            covr.clear();
+            noCovr.clear();
+            break;
+        }
+    }
+    LOG_DEBUG(wxT("ChartInfo: %s has %d COVR and %d NoCOVR polygons"),filename,(int)covr.size(),(int)noCovr.size());
+}
+
 int ChartInfo::FillInfo(const ZoomLevelScales *scales) {
     zoom=scales->FindZoomForScale(nativeScale);
     xmin=TileHelper::long2tilex(extent.WLON,zoom);
@@ -206,43 +252,157 @@ int ChartInfo::HasTile(LatLon &northwest,LatLon &southeast){
     if (northwest.lon > extent.ELON) return 0;
     if (southeast.lon < extent.WLON) return 0;
     if (northwest.lat < extent.SLAT) return 0;
+    if (! IntersectsCoverage(northwest.lat,northwest.lon,southeast.lat,southeast.lon)) return 0;
     return nativeScale;
 }
+
+bool ChartInfo::IntersectsCoverage(double north,double west,double south,double east){
+    if (covr.size() < 1) return true;
+    bool found=false;
+    CoverList::iterator it;
+    for (it=covr.begin();it!=covr.end() && ! found;it++){
+        if (it->Intersects(north,west,south,east)) found=true;
+    }
+    if (! found) return false;
+    for (it=noCovr.begin();it!=noCovr.end();it++){
+        if (it->Contains(north,west,south,east)) return false;
+    }
+    return true;
+}
+
+bool ChartInfo::CoversRect(double north,double west,double south,double east){
+    if (north > extent.NLAT || south < extent.SLAT || west < extent.WLON || east > extent.ELON) return false;
+    if (covr.size() < 1) return true;
+    CoverList::iterator it;
+    for (it=noCovr.begin();it!=noCovr.end();it++){
+        if (it->Intersects(north,west,south,east)) return false;
+    }
+    for (it=covr.begin();it!=covr.end();it++){
+        if (it->Contains(north,west,south,east)) return true;
+    }
+    return false;
+}
+//parts per direction we check if a tile is only partly covered by COVR polygons
+#define COVER_GRID 4
+
 /**
- * we go for a simple coverage model here
- * we directly map coordinates to some arbitrary surface
- * so that we can use wxRegion
- * This function returns the region covered by the chart extent
- * assuming a rectangular surface of regionSize*regionSize pixel
- * for the coordinates described by northwest and southeast
-*/
-wxRegion ChartInfo::Covered(LatLon &northwest,LatLon &southeast, int regionSize){
-    wxRegion rt(0,0,0,0);
-    if (HasTile(northwest, southeast) <= 0) return rt;
-    bool fully=true;
-    if (southeast.lat < extent.SLAT) fully=false;
-    if (southeast.lon > extent.ELON) fully=false;
-    if (northwest.lat > extent.NLAT) fully=false;
-    if (northwest.lon < extent.WLON) fully=false;
-    if (fully) return wxRegion(0,0,regionSize,regionSize);
-    double xw=southeast.lon-northwest.lon;
-    double yw=northwest.lat-southeast.lat;
-    double ds=regionSize;
-    if (yw <= 0 || xw <= 0) return rt;
-    int x=(extent.WLON-northwest.lon)*ds/xw;
-    int rx=(extent.ELON-extent.WLON)*ds/xw;
-    if (x<0) x=0;
-    if (x > regionSize) x=regionSize;
-    if (rx < 0) rx=0;
-    if (rx > regionSize) rx=regionSize;
-    //lat counts up northways but y counts down
-    int y=-(extent.NLAT-northwest.lat)*ds/yw;
-    int ry=-(extent.SLAT-extent.NLAT)*ds/yw;
-    if (y < 0) y=0;
-    if (y > regionSize) y=regionSize;
-    if (ry < 0) ry=0;
-    if (ry > regionSize) ry=regionSize;
-    return wxRegion(x,y,rx,ry);
+ * without COVR polygons a chart covers its complete extent (unless onlyCovr)
+ * otherwise we only subtract the parts of the tile (COVER_GRID*COVER_GRID)
+ * that are completely inside the coverage
+ */
+void ChartInfo::Cover(TileCoverage &coverage,bool onlyCovr){
+    if (covr.size() < 1){
+        if (onlyCovr) return;
+        coverage.Subtract(extent.NLAT,extent.WLON,extent.SLAT,extent.ELON);
+        return;
+    }
+    double north=std::min(coverage.north,extent.NLAT);
+    double south=std::max(coverage.south,extent.SLAT);
+    double west=std::max(coverage.west,extent.WLON);
+    double east=std::min(coverage.east,extent.ELON);
+    if (north <= south || east <= west) return;
+    if (CoversRect(north,west,south,east)){
+        coverage.Subtract(north,west,south,east);
+        return;
+    }
+    double dlat=(north-south)/COVER_GRID;
+    double dlon=(east-west)/COVER_GRID;
+    for (int row=0;row<COVER_GRID;row++){
+        double rowNorth=north-row*dlat;
+        double rowSouth=(row == COVER_GRID-1)?south:rowNorth-dlat;
+        //consecutive covered parts of a row are subtracted together
+        int first=-1;
+        for (int col=0;col<=COVER_GRID;col++){
+            bool covered=false;
+            if (col < COVER_GRID){
+                double partWest=west+col*dlon;
+                double partEast=(col == COVER_GRID-1)?east:partWest+dlon;
+                covered=CoversRect(rowNorth,partWest,rowSouth,partEast);
+            }
+            if (covered){
+                if (first < 0) first=col;
+                continue;
+            }
+            if (first >= 0){
+                double partEast=(col == COVER_GRID)?east:west+col*dlon;
+                coverage.Subtract(rowNorth,west+first*dlon,rowSouth,partEast);
+                first=-1;
+            }
+        }
+    }
+}
+
+//fraction of the tile size we ignore for coverage (far below one pixel)
+#define COVERAGE_EPSILON 1e-4
+
+TileCoverage::TileCoverage(LatLon &northwest,LatLon &southeast){
+    north=northwest.lat;
+    west=northwest.lon;
+    south=southeast.lat;
+    east=southeast.lon;
+    numRects=0;
+    minLat=(northwest.lat-southeast.lat)*COVERAGE_EPSILON;
+    minLon=(southeast.lon-northwest.lon)*COVERAGE_EPSILON;
+    if (northwest.lat <= southeast.lat || southeast.lon <= northwest.lon) return;
+    rects[0].north=northwest.lat;
+    rects[0].west=northwest.lon;
+    rects[0].south=southeast.lat;
+    rects[0].east=southeast.lon;
+    numRects=1;
+}
+
+void TileCoverage::Subtract(double north,double west,double south,double east){
+    Rect result[MAX_RECTS];
+    int numResult=0;
+    for (int i=0;i<numRects;i++){
+        const Rect &r=rects[i];
+        double iNorth=std::min(r.north,north);
+        double iSouth=std::max(r.south,south);
+        double iWest=std::max(r.west,west);
+        double iEast=std::min(r.east,east);
+        Rect parts[4];
+        int numParts=0;
+        if (iNorth > iSouth && iEast > iWest){
+            //the remaining stripes: full width above and below,
+            //left and right only beside the covered part
+            if ((r.north-iNorth) > minLat){
+                parts[numParts++]={r.north,r.west,iNorth,r.east};
+            }
+            if ((iSouth-r.south) > minLat){
+                parts[numParts++]={iSouth,r.west,r.south,r.east};
+            }
+            if ((iWest-r.west) > minLon){
+                parts[numParts++]={iNorth,r.west,iSouth,iWest};
+            }
+            if ((r.east-iEast) > minLon){
+                parts[numParts++]={iNorth,iEast,iSouth,r.east};
+            }
+        }
+        else{
+            parts[numParts++]=r;
+        }
+        if ((numResult+numParts+(numRects-i-1)) > MAX_RECTS){
+            //no room for splitting, keep the rectangle
+            parts[0]=r;
+            numParts=1;
+        }
+        for (int p=0;p<numParts;p++){
+            result[numResult++]=parts[p];
+        }
+    }
+    for (int i=0;i<numResult;i++){
+        rects[i]=result[i];
+    }
+    numRects=numResult;
+}
+
+wxString TileCoverage::ToString() const{
+    wxString rt=wxString::Format("uncovered=%d",numRects);
+    for (int i=0;i<numRects;i++){
+        rt.Append(wxString::Format(",[n=%f,w=%f,s=%f,e=%f]",
+                rects[i].north,rects[i].west,rects[i].south,rects[i].east));
+    }
+    return rt;
 }
 
 bool ChartInfo::UpdateBoundings(BoundingBox* box){
@@ -295,10 +455,14 @@ ChartInfo::RenderResult ChartInfo::Render(wxDC &out,const PlugIn_ViewPort& VPoin
     if (IsRaster()){
         //compute restricted region for raster charts
         //still somehow experimental
+        //offsets are relative to the upper left corner of the view port
+        //as this could be a metatile with more then one tile
         int x=0;
         int y=0;
-        int xmax=TILE_SIZE;
-        int ymax=TILE_SIZE;
+        int xmax=VPoint.pix_width;
+        int ymax=VPoint.pix_height;
+        double vpx=TileHelper::lon2pixelx(VPoint.lon_min,zoom);
+        double vpy=TileHelper::lat2pixely(VPoint.lat_max,zoom);
         bool mustRecomputeRegion=false;
         if (VPoint.lat_max < extent.SLAT || VPoint.lat_min > extent.NLAT||
                 VPoint.lon_min > extent.ELON || VPoint.lon_max < extent.WLON){
@@ -307,23 +471,23 @@ ChartInfo::RenderResult ChartInfo::Render(wxDC &out,const PlugIn_ViewPort& VPoin
         }
         if (VPoint.lat_min < extent.SLAT) {            
             mustRecomputeRegion=true;
-            ymax=(int)ceil(TileHelper::lat2tileyOffset(extent.SLAT,zoom));          
-            if (ymax > TILE_SIZE) ymax=TILE_SIZE;
+            ymax=(int)ceil(TileHelper::lat2pixely(extent.SLAT,zoom)-vpy);
+            if (ymax > VPoint.pix_height) ymax=VPoint.pix_height;
         }
         if (VPoint.lat_max > extent.NLAT){           
             mustRecomputeRegion=true;
-            y=(int)floor(TileHelper::lat2tileyOffset(extent.NLAT,zoom));            
+            y=(int)floor(TileHelper::lat2pixely(extent.NLAT,zoom)-vpy);
             if (y < 0) y=0;
         }
         if (VPoint.lon_min < extent.WLON) {            
-            x=(int)floor(TileHelper::lon2tilexOffset(extent.WLON,zoom));            
+            x=(int)floor(TileHelper::lon2pixelx(extent.WLON,zoom)-vpx);
             if (x < 0) x=0;
             mustRecomputeRegion=true;
         }
         if (VPoint.lon_max > extent.ELON) {            
             mustRecomputeRegion=true;
-            xmax=(int)ceil(TileHelper::lon2tilexOffset(extent.ELON,zoom));            
-            if (xmax > TILE_SIZE) xmax=TILE_SIZE;
+            xmax=(int)ceil(TileHelper::lon2pixelx(extent.ELON,zoom)-vpx);
+            if (xmax > VPoint.pix_width) xmax=VPoint.pix_width;
         }        
         if (mustRecomputeRegion){
             wxRegion cpRegion(
@@ -390,10 +554,130 @@ ObjectList ChartInfo::FeatureInfo(PlugIn_ViewPort& VPoint,
 }
 
 
-void ChartInfo::FromCache(int nativeScale, ExtentPI extent){
+void ChartInfo::FromCache(int nativeScale, ExtentPI extent,wxString covr,wxString noCovr){
     this->nativeScale=nativeScale;
     this->extent=extent;
     this->isValid=true;
+    this->covr.clear();
+    this->noCovr.clear();
+    for (int i=0;i<2;i++){
+        CoverList &list=(i == 0)?this->covr:this->noCovr;
+        wxStringTokenizer tokenizer((i == 0)?covr:noCovr,";");
+        while (tokenizer.HasMoreTokens()){
+            CoverPolygon polygon;
+            if (CoverPolygon::FromString(tokenizer.GetNextToken(),polygon)){
+                list.push_back(polygon);
+            }
+        }
+    }
+    if (this->covr.size() < 1) this->noCovr.clear();
+}
+
+wxString ChartInfo::GetCoverage(bool noCovr){
+    CoverList &list=noCovr?this->noCovr:this->covr;
+    wxString rt;
+    CoverList::iterator it;
+    for (it=list.begin();it!=list.end();it++){
+        if (it != list.begin()) rt.Append(";");
+        rt.Append(it->ToString());
+    }
+    return rt;
+}
+
+void CoverPolygon::Add(double lat,double lon){
+    points.push_back(LatLon(lat,lon));
+    if (lat > north) north=lat;
+    if (lat < south) south=lat;
+    if (lon < west) west=lon;
+    if (lon > east) east=lon;
+}
+
+/**
+ * even-odd rule
+ */
+bool CoverPolygon::Contains(double lat,double lon) const{
+    if (lat > north || lat < south || lon < west || lon > east) return false;
+    bool inside=false;
+    size_t num=points.size();
+    for (size_t i=0,j=num-1;i<num;j=i++){
+        const LatLon &pi=points[i];
+        const LatLon &pj=points[j];
+        if ((pi.lat > lat) != (pj.lat > lat)){
+            double crossLon=pj.lon+(lat-pj.lat)*(pi.lon-pj.lon)/(pi.lat-pj.lat);
+            if (lon < crossLon) inside=!inside;
+        }
+    }
+    return inside;
+}
+
+/**
+ * clip each edge against the rectangle (Liang-Barsky)
+ */
+bool CoverPolygon::EdgeIntersects(double north,double west,double south,double east) const{
+    size_t num=points.size();
+    for (size_t i=0,j=num-1;i<num;j=i++){
+        double x0=points[j].lon;
+        double y0=points[j].lat;
+        double dx=points[i].lon-x0;
+        double dy=points[i].lat-y0;
+        double p[4]={-dx,dx,-dy,dy};
+        double q[4]={x0-west,east-x0,y0-south,north-y0};
+        double t0=0;
+        double t1=1;
+        bool outside=false;
+        for (int k=0;k<4 && ! outside;k++){
+            if (p[k] == 0){
+                if (q[k] < 0) outside=true;
+                continue;
+            }
+            double r=q[k]/p[k];
+            if (p[k] < 0){
+                if (r > t1) outside=true;
+                else if (r > t0) t0=r;
+            }
+            else{
+                if (r < t0) outside=true;
+                else if (r < t1) t1=r;
+            }
+        }
+        if (! outside) return true;
+    }
+    return false;
+}
+
+bool CoverPolygon::Intersects(double north,double west,double south,double east) const{
+    if (north < this->south || south > this->north || east < this->west || west > this->east) return false;
+    if (EdgeIntersects(north,west,south,east)) return true;
+    //no edge crosses, so the rectangle is either completely inside or outside
+    return Contains((north+south)/2,(west+east)/2);
+}
+
+bool CoverPolygon::Contains(double north,double west,double south,double east) const{
+    if (north > this->north || south < this->south || west < this->west || east > this->east) return false;
+    if (EdgeIntersects(north,west,south,east)) return false;
+    return Contains((north+south)/2,(west+east)/2);
+}
+
+wxString CoverPolygon::ToString() const{
+    wxString rt;
+    std::vector<LatLon>::const_iterator it;
+    for (it=points.begin();it!=points.end();it++){
+        if (it != points.begin()) rt.Append(" ");
+        rt.Append(wxString::Format("%.6f,%.6f",it->lat,it->lon));
+    }
+    return rt;
+}
+
+bool CoverPolygon::FromString(wxString str,CoverPolygon &out){
+    wxStringTokenizer tokenizer(str," ");
+    while (tokenizer.HasMoreTokens()){
+        wxString point=tokenizer.GetNextToken();
+        double lat,lon;
+        if (! point.BeforeFirst(',').ToCDouble(&lat)) return false;
+        if (! point.AfterFirst(',').ToCDouble(&lon)) return false;
+        out.Add(lat,lon);
+    }
+    return out.points.size() >= 3;
 }
 
 
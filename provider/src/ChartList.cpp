@@ -31,12 +31,28 @@
 #include <wx/log.h>
 #include "StringHelper.h"
 #include "Logger.h"
+#include <algorithm>
+#include <set>
 
+//grid cells are tiles GRID_ZOOM_OFFSET levels below the chart zoom
+#define GRID_ZOOM_OFFSET 3
+//charts that would need more cells go to the large list
+#define MAX_GRID_CELLS 64
+//remembered lookups, the least recently used ones are dropped
+#define MAX_LOOKUPS 20000
+//the tile y range of the mercator projection
+#define MAX_GRID_LAT 85.0511
 
 
 ChartList::ChartList() {
-   
-    
+    minZoom=0;
+    maxZoom=0;
+    indexValid=false;
+    indexSequence=0;
+    lookupHits=0;
+    lookupMisses=0;
+    lookupEvictions=0;
+    numCulled=0;
 };
 ChartList::~ChartList(){
     InfoList::iterator it;
@@ -48,24 +64,222 @@ void ChartList::AddChart(ChartInfo *chart){
     chartList.push_back(chart);
     if (! chart->IsValid()) return;
     chart->UpdateBoundings(&boundings);
+    InvalidateIndex();
+}
+
+void ChartList::InvalidateIndex(){
+    Synchronized locker(indexLock);
+    indexValid=false;
+    indexSequence++;
+    lookups.clear();
+    lookupOrder.clear();
+}
+
+static unsigned long long cellKey(int x,int y){
+    return (((unsigned long long)x) << 32) | (unsigned int)y;
+}
+
+static int clampTile(int v,int zoom){
+    if (v < 0) return 0;
+    int max=(1 << zoom)-1;
+    if (v > max) return max;
+    return v;
+}
+
+static double clampLat(double lat){
+    if (lat > MAX_GRID_LAT) return MAX_GRID_LAT;
+    if (lat < -MAX_GRID_LAT) return -MAX_GRID_LAT;
+    return lat;
+}
+
+void ChartList::BuildIndex(){
+    for (int z=0;z<=MAX_ZOOM;z++){
+        zoomIndex[z].Clear();
+        int gridZoom=z-GRID_ZOOM_OFFSET;
+        if (gridZoom < 0) gridZoom=0;
+        zoomIndex[z].gridZoom=gridZoom;
+    }
+    long numCells=0;
+    long numLarge=0;
+    for (size_t i=0;i<chartList.size();i++){
+        ChartInfo *info=chartList[i];
+        if (! info->IsValid()) continue;
+        int zoom=info->GetZoom();
+        if (zoom < 0 || zoom > MAX_ZOOM) continue;
+        ZoomIndex &index=zoomIndex[zoom];
+        ExtentPI extent=info->GetExtent();
+        if (extent.WLON > extent.ELON || extent.SLAT > extent.NLAT){
+            //leave the decision to HasTile
+            index.large.push_back(i);
+            numLarge++;
+            continue;
+        }
+        int gz=index.gridZoom;
+        int xmin=clampTile(TileHelper::long2tilex(extent.WLON,gz),gz);
+        int xmax=clampTile(TileHelper::long2tilex(extent.ELON,gz),gz);
+        int ymin=clampTile(TileHelper::lat2tiley(clampLat(extent.NLAT),gz),gz);
+        int ymax=clampTile(TileHelper::lat2tiley(clampLat(extent.SLAT),gz),gz);
+        if ((long)(xmax-xmin+1)*(long)(ymax-ymin+1) > MAX_GRID_CELLS){
+            index.large.push_back(i);
+            numLarge++;
+            continue;
+        }
+        for (int x=xmin;x<=xmax;x++){
+            for (int y=ymin;y<=ymax;y++){
+                index.cells[cellKey(x,y)].push_back(i);
+                numCells++;
+            }
+        }
+    }
+    indexValid=true;
+    LOG_DEBUG(wxT("ChartList: built index for %ld charts, %ld cell entries, %ld large charts"),
+            (long)chartList.size(),numCells,numLarge);
 }
 
-static wxString regionToString(const wxRegion &r){
-    wxCoord x,y,w,h;
-    r.GetBox(x,y,w,h);
-    wxString rt;
-    rt.Printf("x=%d,y=%d,w=%d,h=%d,e=%s",x,y,w,h,r.IsEmpty()?"true":"false");
+ChartList::InfoList ChartList::FindCandidates(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast){
+    std::vector<int> positions;
+    {
+        Synchronized locker(indexLock);
+        if (! indexValid) BuildIndex();
+        for (int z=minZoom;z<=maxZoom;z++){
+            ZoomIndex &index=zoomIndex[z];
+            positions.insert(positions.end(),index.large.begin(),index.large.end());
+            if (index.cells.size() < 1) continue;
+            int gz=index.gridZoom;
+            int xmin=clampTile(TileHelper::long2tilex(northwest.lon,gz),gz);
+            int xmax=clampTile(TileHelper::long2tilex(southeast.lon,gz),gz);
+            int ymin=clampTile(TileHelper::lat2tiley(clampLat(northwest.lat),gz),gz);
+            int ymax=clampTile(TileHelper::lat2tiley(clampLat(southeast.lat),gz),gz);
+            for (int x=xmin;x<=xmax;x++){
+                for (int y=ymin;y<=ymax;y++){
+                    std::unordered_map<unsigned long long,std::vector<int> >::iterator it=
+                            index.cells.find(cellKey(x,y));
+                    if (it == index.cells.end()) continue;
+                    positions.insert(positions.end(),it->second.begin(),it->second.end());
+                }
+            }
+        }
+    }
+    //same order as a scan of the list
+    std::sort(positions.begin(),positions.end());
+    positions.erase(std::unique(positions.begin(),positions.end()),positions.end());
+    InfoList rt;
+    rt.reserve(positions.size());
+    std::vector<int>::iterator it;
+    for (it=positions.begin();it != positions.end();it++){
+        rt.push_back(chartList[*it]);
+    }
     return rt;
 }
-WeightedChartList ChartList::FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp){
+
+ChartList::LookupKey::LookupKey(int minZoom,int maxZoom,int goUp,bool cull,LatLon &northwest,LatLon &southeast){
+    this->minZoom=minZoom;
+    this->maxZoom=maxZoom;
+    this->goUp=goUp;
+    this->cull=cull;
+    north=northwest.lat;
+    west=northwest.lon;
+    south=southeast.lat;
+    east=southeast.lon;
+}
+
+bool ChartList::LookupKey::operator<(const LookupKey &other) const{
+    if (minZoom != other.minZoom) return minZoom < other.minZoom;
+    if (maxZoom != other.maxZoom) return maxZoom < other.maxZoom;
+    if (goUp != other.goUp) return goUp < other.goUp;
+    if (cull != other.cull) return cull < other.cull;
+    if (north != other.north) return north < other.north;
+    if (west != other.west) return west < other.west;
+    if (south != other.south) return south < other.south;
+    return east < other.east;
+}
+
+WeightedChartList ChartList::FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp,
+        bool cull){
     WeightedChartList rt;
     if (minZoom > maxZoom) return rt;
     if (minZoom < 0) minZoom=0;
     if (maxZoom > MAX_ZOOM) maxZoom=MAX_ZOOM;
-    int coverScale=1000;
-    wxRegion tileRegion(0,0,coverScale,coverScale);
+    LookupKey key(minZoom,maxZoom,goUp,cull,northwest,southeast);
+    unsigned long sequence;
+    {
+        Synchronized locker(indexLock);
+        LookupCache::iterator it=lookups.find(key);
+        if (it != lookups.end()){
+            lookupHits++;
+            lookupOrder.splice(lookupOrder.begin(),lookupOrder,it->second.position);
+            return it->second.charts;
+        }
+        lookupMisses++;
+        sequence=indexSequence;
+    }
+    rt=DoFindChartForTile(minZoom,maxZoom,northwest,southeast,goUp);
+    int culled=0;
+    if (cull) culled=CullHidden(rt,northwest,southeast);
+    {
+        Synchronized locker(indexLock);
+        numCulled+=culled;
+        //do not store results for charts or zoom levels that changed meanwhile
+        if (sequence == indexSequence && lookups.find(key) == lookups.end()){
+            while (lookups.size() >= MAX_LOOKUPS && ! lookupOrder.empty()){
+                lookups.erase(lookupOrder.back());
+                lookupOrder.pop_back();
+                lookupEvictions++;
+            }
+            lookupOrder.push_front(key);
+            LookupEntry &entry=lookups[key];
+            entry.charts=rt;
+            entry.position=lookupOrder.begin();
+        }
+    }
+    return rt;
+}
+
+/**
+ * better charts first: higher zoom, lower scale
+ */
+static bool betterFirst(const ChartInfoWithScale &first,const ChartInfoWithScale &second){
+    if (first.info->GetZoom() != second.info->GetZoom()){
+        return first.info->GetZoom() > second.info->GetZoom();
+    }
+    return first.scale < second.scale;
+}
+
+int ChartList::CullHidden(WeightedChartList &charts,LatLon &northwest,LatLon &southeast){
+    WeightedChartList sorted;
+    WeightedChartList::iterator it;
+    for (it=charts.begin();it != charts.end();it++){
+        if (! it->info->IsOverlay()) sorted.push_back(*it);
+    }
+    if (sorted.size() < 2) return 0;
+    std::stable_sort(sorted.begin(),sorted.end(),betterFirst);
+    TileCoverage coverage(northwest,southeast);
+    std::set<ChartInfo*> hidden;
+    for (it=sorted.begin();it != sorted.end();it++){
+        if (coverage.IsCovered()){
+            hidden.insert(it->info);
+            continue;
+        }
+        it->info->Cover(coverage,true);
+    }
+    if (hidden.size() < 1) return 0;
+    WeightedChartList rt;
+    for (it=charts.begin();it != charts.end();it++){
+        if (hidden.find(it->info) == hidden.end()) rt.push_back(*it);
+    }
+    charts=rt;
+    return hidden.size();
+}
+
+WeightedChartList ChartList::DoFindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp){
+    WeightedChartList rt;
+    if (minZoom > maxZoom) return rt;
+    if (minZoom < 0) minZoom=0;
+    if (maxZoom > MAX_ZOOM) maxZoom=MAX_ZOOM;
+    TileCoverage coverage(northwest,southeast);
+    InfoList candidates=FindCandidates(minZoom,maxZoom,northwest,southeast);
     InfoList::iterator it;
-    for (it=chartList.begin();it!= chartList.end();it++){
+    for (it=candidates.begin();it!= candidates.end();it++){
         ChartInfo *info=(*it);
         if (! info->IsValid()) {
             continue;
@@ -76,11 +290,10 @@ WeightedChartList ChartList::FindChartForTile(int minZoom,int maxZoom,LatLon &no
         int scale=(info->HasTile(northwest,southeast));
         if (scale > 0){
             if (!info->IsOverlay() ) {
-                if (info->GetZoom() >= (maxZoom-1) && goUp > 0){
-                    wxRegion cover=info->Covered(northwest,southeast,coverScale);
-                    if (! tileRegion.IsEmpty()) tileRegion.Subtract(cover);
+                if (info->GetZoom() >= (maxZoom-1) && goUp > 0 && ! coverage.IsCovered()){
+                    info->Cover(coverage);
                     if (Logger::instance()->HasLevel(LOG_LEVEL_DEBUG)){
-                        LOG_DEBUG("Chart [%d], region %s, tileRegion %s",info->GetIndex(),regionToString(cover),regionToString(tileRegion));
+                        LOG_DEBUG("Chart [%d], tile %s",info->GetIndex(),coverage.ToString());
                     }
                 }
             }
@@ -93,9 +306,9 @@ WeightedChartList ChartList::FindChartForTile(int minZoom,int maxZoom,LatLon &no
     if (upperZoom > MAX_ZOOM) upperZoom=MAX_ZOOM;
     if (upperZoom > maxZoom ) {
         //tmp: if we did not find a tile at the wanted zoom - go x levels up
-        bool ok = tileRegion.IsEmpty();        
+        bool ok = coverage.IsCovered();
         if (!ok) {
-            WeightedChartList add = FindChartForTile(maxZoom + 1, upperZoom, northwest, southeast, 0);
+            WeightedChartList add = DoFindChartForTile(maxZoom + 1, upperZoom, northwest, southeast, 0);
             if (add.size() > 0) {
                 bool found=false;
                 for (int z=maxZoom+1;z<=upperZoom && ! found ;z++){
@@ -103,16 +316,15 @@ WeightedChartList ChartList::FindChartForTile(int minZoom,int maxZoom,LatLon &no
                     for (it = add.begin(); it != add.end(); it++) {
                         if (it->info->GetZoom() == z){
                             rt.push_back(*it);
-                            if (! it->info->IsOverlay()) {
-                                wxRegion cover=it->info->Covered(northwest,southeast,coverScale);
-                                if (! tileRegion.IsEmpty()) tileRegion.Subtract(cover);
+                            if (! it->info->IsOverlay() && ! coverage.IsCovered()) {
+                                it->info->Cover(coverage);
                                 if (Logger::instance()->HasLevel(LOG_LEVEL_DEBUG)){
-                                    LOG_DEBUG("Chart uz [%d], region %s, tileRegion %s",it->info->GetIndex(),regionToString(cover),regionToString(tileRegion));
+                                    LOG_DEBUG("Chart uz [%d], tile %s",it->info->GetIndex(),coverage.ToString());
                                 }
                             }
                         }
                     }
-                    if (tileRegion.IsEmpty()){
+                    if (coverage.IsCovered()){
                         found=true;
                         break;
                     }
@@ -136,6 +348,7 @@ void ChartList::UpdateZooms(ZoomLevelScales* scales){
         if (info->GetZoom() < minZoom) minZoom=info->GetZoom();
         if (info->GetZoom() > maxZoom) maxZoom=info->GetZoom();
     }
+    InvalidateIndex();
 }
 
 ChartList::InfoList ChartList::GetZoomCharts(int zoom){
@@ -156,14 +369,33 @@ ChartList::InfoList ChartList::GetAllCharts(){
 
 
 wxString ChartList::ToJson(){
+    unsigned long numLookups,hits,misses,evictions,culled;
+    {
+        Synchronized locker(indexLock);
+        numLookups=lookups.size();
+        hits=lookupHits;
+        misses=lookupMisses;
+        evictions=lookupEvictions;
+        culled=numCulled;
+    }
     wxString rt=wxString::Format("{"
             JSON_IV(numCharts,%d) ",\n"
             JSON_IV(minZoom,%d) ",\n"
-            JSON_IV(maxZoom,%d) "\n"
+            JSON_IV(maxZoom,%d) ",\n"
+            JSON_IV(lookups,%lu) ",\n"
+            JSON_IV(lookupHits,%lu) ",\n"
+            JSON_IV(lookupMisses,%lu) ",\n"
+            JSON_IV(lookupEvictions,%lu) ",\n"
+            JSON_IV(chartsCulled,%lu) "\n"
             "}",
             GetSize(),
             GetMinZoom(),
-            GetMaxZoom());
+            GetMaxZoom(),
+            numLookups,
+            hits,
+            misses,
+            evictions,
+            culled);
     return rt;
 }
 int ChartList::NumValidCharts(){
@@ -40,8 +40,16 @@ ChartManager::ChartManager(SettingsManager *settings,ExtensionList *extensions)
     this->settings=settings;
     this->extensions=extensions;
     filler=NULL;
+    cacheBudget=NULL;
+    uniformTiles=new UniformTiles();
+    diskScheduler=NULL;
     this->memKb=0;    
     maxOpenCharts=-1; //will be estimated during load
+    openInflation=0;
+    numChartOpens=0;
+    numChartCloses=0;
+    numChartEvictions=0;
+    chartOpenMillis=0;
     state=STATE_INIT;
     numCandidates=0;
     numRead=0;
@@ -77,11 +85,23 @@ wxString ChartManager::LocalJson(){
     }
     wxString rt=wxString::Format(
             JSON_IV(openCharts,%ld) ",\n"
+            JSON_IV(maxOpenCharts,%d) ",\n"
+            JSON_IV(chartOpens,%lu) ",\n"
+            JSON_IV(chartCloses,%lu) ",\n"
+            JSON_IV(chartEvictions,%lu) ",\n"
+            JSON_IV(uniformTiles,%ld) ",\n"
+            JSON_IV(avgOpenMs,%llu) ",\n"
             JSON_SV(state,%s) ",\n"
             JSON_IV(numCandidates,%d) ",\n"
             JSON_IV(numRead,%d) ",\n"
             JSON_IV(memoryKb,%d) "\n",
             openCharts.size(),
+            maxOpenCharts,
+            numChartOpens,
+            numChartCloses,
+            numChartEvictions,
+            (long)uniformTiles->Size(),
+            numChartOpens?chartOpenMillis/numChartOpens:0,
             status,
             numCandidates,
             numRead,
@@ -507,7 +527,8 @@ int ChartManager::ReadCharts(wxArrayString& dirsAndFiles,int memKb){
     return rt;
 }
 
-bool ChartManager::StartCaches(wxString dataDir,long maxCacheEntries,long maxFileEntries) {
+bool ChartManager::StartCaches(wxString dataDir,long maxCacheEntries,long maxFileEntries,long budgetKb,
+        long writeKbPerSecond) {
     if (chartSets.size() < 1) return false;
     int numCharts = 0;
     ChartSetMap::iterator it;
@@ -518,12 +539,32 @@ bool ChartManager::StartCaches(wxString dataDir,long maxCacheEntries,long maxFil
         LOG_INFO(wxT("no chart candidates found, do not start caches"));
         return false;
     }
+    if (budgetKb > 0 && maxCacheEntries > 0 && cacheBudget == NULL){
+        LOG_INFO(wxT("creating a memory cache budget of %ldkb for all chart sets"),budgetKb);
+        cacheBudget=new CacheBudget((size_t)budgetKb*1024);
+        AddItem("cacheBudget",cacheBudget);
+    }
+    int slot=0;
+    wxString variant=settings->PrepareVariant(slot);
+    settings->PublishVariant();
+    LOG_INFO(wxT("starting caches for settings variant %s"),variant);
+    if (diskScheduler == NULL){
+        //one thread for the disk writes of all sets
+        diskScheduler=new DiskScheduler(writeKbPerSecond);
+        AddItem("diskScheduler",diskScheduler);
+        diskScheduler->start();
+    }
     for (it = chartSets.begin(); it != chartSets.end(); it++) {
-        long maxCachePerSet = (maxCacheEntries * it->second->numCandidates) / numCharts;
+        //with a budget each set can use the complete memory
+        //if the others are not in use
+        long maxCachePerSet = maxCacheEntries;
+        if (cacheBudget == NULL){
+            maxCachePerSet = (maxCacheEntries * it->second->numCandidates) / numCharts;
+        }
         LOG_INFO(wxT("creating cache for chart set %s with size %ld, file size %ld"),
                 it->second->GetKey(),
                 maxCachePerSet,maxFileEntries);
-        it->second->CreateCache(dataDir,maxCachePerSet,maxFileEntries);
+        it->second->CreateCache(dataDir,maxCachePerSet,maxFileEntries,cacheBudget,diskScheduler,uniformTiles);
     }
     return true;
 }
@@ -559,6 +600,7 @@ unsigned long ChartManager::GetMaxCacheSizeKb(){
     Synchronized locker(lock);
     ChartSetMap::iterator it;
     unsigned long rt=0;
+    if (cacheBudget != NULL) rt+=cacheBudget->MaxBytes()/1024;
     for (it=chartSets.begin();it != chartSets.end();it++){
         if (it->second->cache == NULL) continue;
         rt+=it->second->cache->GetMaxSizeKb();
@@ -609,8 +651,16 @@ bool ChartManager::UpdateSettings(){
         delete filler;
         filler=NULL;
     }
-    LOG_INFO(wxT("ChartManager: updating chart sets"));
+    //a reused generation must not serve tiles of its former settings
+    //so drop them before any tile key gets the generation
+    int slot=0;
+    wxString variant=settings->PrepareVariant(slot);
     ChartSetMap::iterator it;
+    for (it=chartSets.begin();it!=chartSets.end();it++){
+        it->second->ReserveGeneration(slot,variant);
+    }
+    settings->PublishVariant();
+    LOG_INFO(wxT("ChartManager: updating chart sets"));
     for (it=chartSets.begin();it!=chartSets.end();it++){
         it->second->UpdateSettings();
     }
@@ -632,6 +682,10 @@ bool ChartManager::Stop(){
         it->second->SetEnabled(false);
         it->second->Stop();
     }
+    if (diskScheduler != NULL){
+        diskScheduler->stop();
+        diskScheduler->join();
+    }
     LOG_INFO(wxT("stopping chart manager done"));
     return true;
 }
@@ -640,7 +694,6 @@ void ChartManager::CloseDisabled(){
     LOG_INFO(wxT("ChartManager::CloseDisabled"));
     ChartInfoSet disabled;
     ChartSetMap::iterator it;
-    int numClosed=0;
     for (it=chartSets.begin();it!=chartSets.end();it++){
         ChartSet *set=it->second;
         if (set->IsEnabled()) continue;
@@ -650,43 +703,114 @@ void ChartManager::CloseDisabled(){
             disabled.insert((*cit));
         }
     }
-    ChartInfoQueue newOpenCharts;
-    while (openCharts.size() > 0){
-        ChartInfo *info=openCharts.front();
-        openCharts.pop_front();
-        if (! info->IsOpen()) continue;
-        if (disabled.find(info) != disabled.end()){
-            LOG_INFO(wxT("ChartManager::CloseDisabled closing %s"),info->GetFileName());
-            info->Close();
-            numClosed++;
+    std::vector<ChartInfo*> toClose;
+    {
+        Synchronized locker(statusLock);
+        OpenChartMap::iterator oit=openCharts.begin();
+        while (oit != openCharts.end()){
+            ChartInfo *info=oit->first;
+            if (! info->IsOpen()){
+                oit=openCharts.erase(oit);
+                continue;
+            }
+            if (disabled.find(info) != disabled.end()){
+                toClose.push_back(info);
+                oit=openCharts.erase(oit);
+                continue;
+            }
+            oit++;
+        }
+    }
+    int numClosed=CloseCharts(toClose,false);
+    LOG_INFO(wxT("ChartManager::CloseDisabled finished and closed %d charts"),numClosed);
+}
+double ChartManager::OpenPriority(ChartInfo *chart){
+    long millis=chart->GetOpenMillis();
+    if (millis < 1) millis=1;
+    long kb=chart->GetMemoryKb();
+    if (kb < 1) kb=1;
+    return openInflation+(double)millis/(double)kb;
+}
+//statusLock must be held
+ChartInfo *ChartManager::PickLeastValuable(){
+    if (openCharts.size() < 1) return NULL;
+    OpenChartMap::iterator victim=openCharts.begin();
+    OpenChartMap::iterator it;
+    for (it=openCharts.begin();it!=openCharts.end();it++){
+        if (it->second < victim->second) victim=it;
+    }
+    ChartInfo *chart=victim->first;
+    //charts that are cheap to reopen for their size will go first,
+    //the inflation lets recently used charts win over old expensive ones
+    openInflation=victim->second;
+    openCharts.erase(victim);
+    return chart;
+}
+//statusLock must not be held
+int ChartManager::CloseCharts(std::vector<ChartInfo*> &charts,bool evicted){
+    int rt=0;
+    std::vector<ChartInfo*>::iterator it;
+    for (it=charts.begin();it!=charts.end();it++){
+        ChartInfo *chart=*it;
+        if (! chart->IsOpen()) continue;
+        if (evicted){
+            LOG_DEBUG(wxT("ChartManager: closing %s, open=%ldms, mem=%ldkb"),
+                    chart->GetFileName(),chart->GetOpenMillis(),chart->GetMemoryKb());
         }
         else{
-            newOpenCharts.push_back(info);
+            LOG_INFO(wxT("ChartManager: closing %s"),chart->GetFileName());
         }
+        chart->Close();
+        rt++;
     }
-    openCharts=newOpenCharts;
-    LOG_INFO(wxT("ChartManager::CloseDisabled finished and closed %d charts"),numClosed);
+    Synchronized locker(statusLock);
+    numChartCloses+=rt;
+    if (evicted) numChartEvictions+=rt;
+    return rt;
 }
 //must be called from main thread
 bool ChartManager::OpenChart(ChartInfo* chart, bool allowRetry){
     if (chart == NULL) return false;
     if (!chart->IsValid()) return false;
-    if (chart->IsOpen()) return true;
+    if (chart->IsOpen()){
+        Synchronized locker(statusLock);
+        OpenChartMap::iterator it=openCharts.find(chart);
+        if (it != openCharts.end()) it->second=OpenPriority(chart);
+        return true;
+    }
     if (maxOpenCharts > 0){
-        while (openCharts.size() >= (size_t)maxOpenCharts){
-            openCharts.front()->Close();
-            openCharts.pop_front();
+        std::vector<ChartInfo*> victims;
+        {
+            Synchronized locker(statusLock);
+            openCharts.erase(chart);
+            while (openCharts.size() >= (size_t)maxOpenCharts){
+                ChartInfo *victim=PickLeastValuable();
+                if (victim == NULL) break;
+                victims.push_back(victim);
+            }
         }
+        //closing can take a while, do not block the status
+        CloseCharts(victims,true);
     }
     int globalKb,ourKb;
     SystemHelper::GetMemInfo(&globalKb,&ourKb);
     LOG_DEBUG(wxT("Memory before chart open global=%dkb,our=%dkb"),globalKb,ourKb);
+    int kbBefore=ourKb;
+    wxLongLong start=wxGetLocalTimeMillis();
     if (!chart->Reopen(true,allowRetry)){
         return false;
     }
+    long millis=(wxGetLocalTimeMillis()-start).ToLong();
     SystemHelper::GetMemInfo(&globalKb,&ourKb);
     LOG_DEBUG(wxT("Memory after chart open global=%dkb,our=%dkb"),globalKb,ourKb);
-    openCharts.push_back(chart);
+    //the delta is only a rough value as other threads allocate as well
+    chart->SetOpenCost(millis,ourKb-kbBefore);
+    {
+        Synchronized locker(statusLock);
+        numChartOpens++;
+        chartOpenMillis+=millis;
+        openCharts[chart]=OpenPriority(chart);
+    }
     CheckMemoryLimit();
     return true;
 }
@@ -732,6 +856,8 @@ bool ChartManager::WriteChartInfoCache(wxFileConfig* config){
                 config->Write("wlon", extent.WLON);
                 config->Write("nlat", extent.NLAT);
                 config->Write("elon", extent.ELON);
+                config->Write("covr", info->GetCoverage());
+                config->Write("nocovr", info->GetCoverage(true));
             }
             if (info->IsIgnored()){
                 config->Write("ignored",true);
@@ -830,6 +956,15 @@ bool ChartManager::ReadChartInfoCache(wxFileConfig* config, int memKb){
                         rt=true;
                         break;
                     }
+                    //caches of older versions: read the coverage once
+                    //the entry is always written when parsing
+                    if (!config->HasEntry("covr")) {
+                        LOG_INFO("no coverage for %s in chart info cache of %s, parsing the set once",
+                                candidate.fileName, set->GetKey());
+                        set->StartParsing();
+                        rt=true;
+                        break;
+                    }
                 }
                 if (round != 1) continue;
                 ChartInfo *info=new ChartInfo(it->second.classname,candidate.fileName);
@@ -846,7 +981,9 @@ bool ChartManager::ReadChartInfoCache(wxFileConfig* config, int memKb){
                     config->Read("wlon", &extent.WLON);
                     config->Read("nlat", &extent.NLAT);
                     config->Read("elon", &extent.ELON);
-                    info->FromCache(nativeScale,extent);
+                    wxString covr=config->Read("covr","");
+                    wxString noCovr=config->Read("nocovr","");
+                    info->FromCache(nativeScale,extent,covr,noCovr);
                     numRead++;
                 }
                 else {
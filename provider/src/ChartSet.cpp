@@ -33,8 +33,17 @@
 #include "Logger.h"
 #include "StringHelper.h"
 #include <wx/filename.h>
+#include <wx/dir.h>
 #include <algorithm>
+#include <atomic>
 
+//cache files for different settings we keep on disk (including the current one)
+#define MAX_CACHE_VARIANTS 3
+//hex digits of the settings variant in the cache file name
+#define VARIANT_ID_LEN 8
+#define CACHE_EXTENSION ".avcache"
+
+static std::atomic<int> nextSetId(0);
 
 
 ChartSet::ChartSet(ChartSetInfo info, SettingsManager *manager,bool canDelete){
@@ -46,6 +55,7 @@ ChartSet::ChartSet(ChartSetInfo info, SettingsManager *manager,bool canDelete){
         this->rdwr=NULL;
         this->state=STATE_INIT;
         this->maxDiskCacheEntries=0;
+        this->diskScheduler=NULL;
         this->maxCacheEntries=0;
         this->dataDir=wxEmptyString;
         this->settings=manager;
@@ -59,18 +69,119 @@ ChartSet::ChartSet(ChartSetInfo info, SettingsManager *manager,bool canDelete){
         int cacheId=CACHE_VERSION_IDENTIFIER;
         MD5_ADD_VALUE(setToken,cacheId);
         numValidCharts=0;
+        //set ids are only used to separate in memory keys
+        //if we ever have more sets, ids will be reused
+        setId=(++nextSetId) & TileKey::MAX_SET_ID;
     }
 
-wxString ChartSet::GetCacheFileName(){
-    wxFileName cacheFile(dataDir,info.name+".avcache");
+wxString ChartSet::GetCacheFileName(wxString variant){
+    wxString name=info.name;
+    if (variant != wxEmptyString){
+        name+=wxT(".")+variant.Left(VARIANT_ID_LEN);
+    }
+    wxFileName cacheFile(dataDir,name+CACHE_EXTENSION);
     cacheFile.MakeAbsolute();
     return cacheFile.GetFullPath();
 }
-void ChartSet::CreateCache(wxString dataDir,long maxEntries,long maxFileEntries){
+
+void ChartSet::AdoptLegacyCache(wxString cacheFile){
+    wxString legacyFile=GetCacheFileName(wxEmptyString);
+    if (wxFileExists(legacyFile) && ! wxFileExists(cacheFile)){
+        CacheReaderWriter::SegmentList segments;
+        CacheReaderWriter::FindSegments(cacheFile,segments);
+        if (segments.size() < 1){
+            //will be checked against the token (and converted) by the reader
+            LOG_INFO(wxT("ChartSet %s: using cache file %s for %s"),GetKey(),legacyFile,cacheFile);
+            wxRenameFile(legacyFile,cacheFile);
+        }
+    }
+    CacheReaderWriter::RemoveFiles(legacyFile);
+}
+
+long ChartSet::EvictCacheVariants(wxString current,size_t keep,long maxEntries){
+    if (! wxDirExists(dataDir)) return maxEntries;
+    wxDir dir(dataDir);
+    if (! dir.IsOpened()) return maxEntries;
+    wxString prefix=info.name+wxT(".");
+    size_t baseLen=prefix.Length()+VARIANT_ID_LEN+wxString(CACHE_EXTENSION).Length();
+    //newest modification of any file of a variant
+    typedef std::map<wxString,time_t> VariantMap;
+    VariantMap variants;
+    wxString name;
+    bool found=dir.GetFirst(&name,prefix+wxT("*"),wxDIR_FILES);
+    while (found){
+        wxString base=name.Left(baseLen);
+        if (name.Length() > baseLen && base.EndsWith(CACHE_EXTENSION) &&
+                name.GetChar(baseLen) == '.'){
+            wxFileName fileName(dataDir,base);
+            fileName.MakeAbsolute();
+            wxString variantFile=fileName.GetFullPath();
+            if (variantFile != current){
+                time_t modified=wxFileName(dataDir,name).GetModificationTime().GetTicks();
+                VariantMap::iterator it=variants.find(variantFile);
+                if (it == variants.end() || it->second < modified){
+                    variants[variantFile]=modified;
+                }
+            }
+        }
+        found=dir.GetNext(&name);
+    }
+    std::vector<std::pair<time_t,wxString> > sorted;
+    VariantMap::iterator it;
+    for (it=variants.begin();it != variants.end();it++){
+        sorted.push_back(std::make_pair(it->second,it->first));
+    }
+    //newest first
+    std::sort(sorted.rbegin(),sorted.rend());
+    //all variants together must fit into maxEntries
+    //the current one gets what the others leave, but at least its share
+    long minShare=maxEntries/MAX_CACHE_VARIANTS;
+    long used=0;
+    bool evict=false;
+    for (size_t i=0;i<sorted.size();i++){
+        if (! evict && i < keep){
+            //without an index we cannot tell the size
+            long entries=CacheReaderWriter::CountEntries(sorted[i].second);
+            if (entries >= 0 && (used+entries) <= (maxEntries-minShare)){
+                used+=entries;
+                continue;
+            }
+            evict=true;
+        }
+        LOG_INFO(wxT("ChartSet %s: removing cache variant %s"),GetKey(),sorted[i].second);
+        if (! CacheReaderWriter::RemoveFiles(sorted[i].second)){
+            LOG_ERROR(wxT("ChartSet %s: unable to remove cache file %s"),GetKey(),sorted[i].second);
+        }
+    }
+    return maxEntries-used;
+}
+
+void ChartSet::StartCacheWriter(){
+    MD5 cacheToken=setToken;
+    cacheToken.AddValue(info.userKey);
+    cacheToken.AddFileInfo(wxT("Chartinfo.txt"),info.dirname);
+    settings->AddSettingsToMD5(&cacheToken);
+    wxString variant=settings->GetVariant();
+    wxString cacheFile=GetCacheFileName(variant);
+    AdoptLegacyCache(cacheFile);
+    long fileEntries=EvictCacheVariants(cacheFile,MAX_CACHE_VARIANTS-1,maxDiskCacheEntries);
+    //mark the variant as recently used
+    wxString indexFile=CacheReaderWriter::IndexFileName(cacheFile);
+    if (wxFileExists(indexFile)) wxFileName(indexFile).Touch();
+    cache->SetVariant(settings->GetVariantSlot(),variant);
+    LOG_INFO(_T("ChartSet %s: starting cache %s with token %s, %ld of %ld entries"),GetKey(),cacheFile,
+            cacheToken.GetHex(),fileEntries,maxDiskCacheEntries);
+    rdwr=new CacheReaderWriter(cacheFile,cacheToken.GetHex(),cache,fileEntries,this,diskScheduler);
+    rdwr->start();
+    AddItem("cacheWriter",rdwr);
+}
+void ChartSet::CreateCache(wxString dataDir,long maxEntries,long maxFileEntries,CacheBudget *budget,
+        DiskScheduler *scheduler,UniformTiles *uniformTiles){
     this->maxCacheEntries=maxEntries;
     this->maxDiskCacheEntries=maxFileEntries;
+    this->diskScheduler=scheduler;
     this->dataDir=dataDir;
-    cache=new CacheHandler(GetKey(),maxEntries,maxFileEntries);
+    cache=new CacheHandler(GetKey(),maxEntries,maxFileEntries,budget,uniformTiles);
     AddItem("cache",cache);
     if (maxEntries < 1){
         LOG_INFO(wxT("no cache configured, do not start reader/writer"));
@@ -80,13 +191,7 @@ void ChartSet::CreateCache(wxString dataDir,long maxEntries,long maxFileEntries)
         LOG_INFO(wxT("ChartSet %s is not active, do not start caches"),GetKey());
         return;
     }   
-    MD5 cacheToken=setToken;
-    cacheToken.AddValue(info.userKey);
-    cacheToken.AddFileInfo(wxT("Chartinfo.txt"),info.dirname);
-    settings->AddSettingsToMD5(&cacheToken);
-    rdwr=new CacheReaderWriter(GetCacheFileName(),cacheToken.GetHex(),cache,maxFileEntries);
-    rdwr->start();
-    AddItem("cacheWriter",rdwr);
+    StartCacheWriter();
 }
 
 void ChartSet::UpdateSettings(bool removeCacheFile){
@@ -97,7 +202,7 @@ void ChartSet::UpdateSettings(bool removeCacheFile){
         scales=new ZoomLevelScales(settings->GetBaseScale());
     }
     //potentially we render a couple of tiles still with the old settings
-    //but as we delete the caches afterwards...
+    //but they have the old generation in their keys...
     SetZoomLevels();
     LOG_INFO(wxT("ChartSet %s: resetting caches"),GetKey());
     if (maxCacheEntries < 1){
@@ -108,22 +213,29 @@ void ChartSet::UpdateSettings(bool removeCacheFile){
         RemoveItem("cacheWriter");
         rdwr->stop();
         rdwr->join();
+        rdwr->Finish();
         delete rdwr;
         rdwr=NULL;
     }
     LOG_INFO(wxT("ChartSet %s: writer stopped, resetting now"),GetKey());
-    if (cache != NULL) cache->Reset();
+    if (cache != NULL){
+        if (active && ! removeCacheFile){
+            //keep the tiles of the previous settings in memory
+            cache->ResetDisk();
+        }
+        else{
+            cache->Reset();
+        }
+    }
     {
         Synchronized locker(lock);
         lastRequests.clear();
     }
     if (removeCacheFile){
-        wxString cacheFile=GetCacheFileName();
-        if (wxFileExists(cacheFile)){
-            LOG_INFO(wxT("ChartSet %s: removing cache file %s"),GetKey(),cacheFile);
-            if (!wxRemoveFile(cacheFile)){
-                LOG_ERROR(wxT("ChartSet %s: unable to remove cache file"),GetKey());
-            }
+        LOG_INFO(wxT("ChartSet %s: removing cache files"),GetKey());
+        EvictCacheVariants(wxEmptyString,0,0);
+        if (!CacheReaderWriter::RemoveFiles(GetCacheFileName(wxEmptyString))){
+            LOG_ERROR(wxT("ChartSet %s: unable to remove cache file"),GetKey());
         }
     }
     if (! active){
@@ -134,14 +246,7 @@ void ChartSet::UpdateSettings(bool removeCacheFile){
         LOG_ERROR(wxT("ChartSet %s cannot be actived as it was not there during start"),GetKey());
         return;
     }    
-    MD5 cacheToken=setToken;
-    cacheToken.AddValue(info.userKey);
-    cacheToken.AddFileInfo(wxT("Chartinfo.txt"),info.dirname);
-    settings->AddSettingsToMD5(&cacheToken);
-    LOG_INFO(_T("starting cache with token %s"),cacheToken.GetHex());
-    rdwr=new CacheReaderWriter(GetCacheFileName(),cacheToken.GetHex(),cache,maxDiskCacheEntries);
-    rdwr->start();
-    AddItem("cacheWriter",rdwr);
+    StartCacheWriter();
 }
 
 void ChartSet::AddCandidate(ChartCandidate candidate){
@@ -197,6 +302,7 @@ void ChartSet::Stop(){
     if (rdwr != NULL){
         rdwr->stop();
         rdwr->join();
+        rdwr->Finish();
     }
 }
 
@@ -210,16 +316,71 @@ bool ChartSet::CacheReady(){
             );
 }
 
-bool ChartSet::SetTileCacheKey(TileInfo& tile){
+void ChartSet::ReserveGeneration(int generation,wxString variant){
+    if (cache != NULL) cache->ReserveGeneration(generation,variant);
+}
+
+bool ChartSet::SetTileCacheKey(TileInfo& tile,int metaSize){
+    if (! TileKey::IsValidTile(tile.zoom,tile.x,tile.y)) return false;
+    tile.cacheKey=TileKey(setId,settings->GetVariantSlot(),tile.zoom,tile.x,tile.y,metaSize);
+    return true;
+}
+
+MD5Name ChartSet::LegacyTileKey(int zoom,int x,int y){
     MD5 tileCacheKey;
     tileCacheKey.AddValue(info.userKey);
     tileCacheKey.AddValue(info.dirname);
-    MD5_ADD_VALUE(tileCacheKey,tile.zoom);
-    MD5_ADD_VALUE(tileCacheKey,tile.x);
-    MD5_ADD_VALUE(tileCacheKey,tile.y);
-    if (!tileCacheKey.IsOk()) return false;
-    tile.cacheKey=tileCacheKey.GetValueCopy();
-    return true;
+    MD5_ADD_VALUE(tileCacheKey,zoom);
+    MD5_ADD_VALUE(tileCacheKey,x);
+    MD5_ADD_VALUE(tileCacheKey,y);
+    return tileCacheKey.GetValueCopy();
+}
+
+long ChartSet::ResolveLegacyKeys(const LegacyKeyResolver::NameSet& names, LegacyKeyResolver::KeyMap& keys, long maxTiles){
+    if (state == STATE_DELETED) return 0;
+    if (state != STATE_READY) return -1;
+    ChartList::InfoList allCharts=charts->GetAllCharts();
+    long numTiles=0;
+    //we check the tiles of all charts from low to high zoom levels
+    //as the number of tiles grows fast we will stop at some zoom level
+    for (int zoom=0;zoom <= MAX_ZOOM && numTiles < maxTiles && keys.size() < names.size();zoom++){
+        std::vector<TileBox> boxes;
+        ChartList::InfoList::iterator it;
+        for (it=allCharts.begin();it != allCharts.end();it++){
+            TileBox box=(*it)->GetTileBounds();
+            if (! box.Valid()) continue;
+            while (box.zoom > zoom) box.DownZoom();
+            while (box.zoom < zoom){
+                box.UpZoom();
+                box.xmax++;
+                box.ymax++;
+            }
+            bool contained=false;
+            std::vector<TileBox>::iterator bit;
+            for (bit=boxes.begin();bit != boxes.end();bit++){
+                if (bit->xmin <= box.xmin && bit->xmax >= box.xmax &&
+                        bit->ymin <= box.ymin && bit->ymax >= box.ymax){
+                    contained=true;
+                    break;
+                }
+            }
+            if (! contained) boxes.push_back(box);
+        }
+        std::vector<TileBox>::iterator bit;
+        for (bit=boxes.begin();bit != boxes.end() && numTiles < maxTiles;bit++){
+            for (int x=bit->xmin;x <= bit->xmax && numTiles < maxTiles;x++){
+                for (int y=bit->ymin;y <= bit->ymax && numTiles < maxTiles;y++){
+                    numTiles++;
+                    MD5Name name=LegacyTileKey(zoom,x,y);
+                    if (names.find(name) == names.end()) continue;
+                    keys[name]=TileKey(0,0,zoom,x,y);
+                }
+            }
+        }
+    }
+    LOG_INFO(wxT("ChartSet %s: resolved %ld of %ld legacy cache keys checking %ld tiles"),
+            GetKey(),(long)keys.size(),(long)names.size(),numTiles);
+    return keys.size();
 }
 
 void ChartSet::LastRequest(wxString sessionId, TileInfo tile){
@@ -281,7 +442,8 @@ wxString ChartSet::LocalJson(){
             JSON_IV(reopenErrors,%d) ",\n"
             JSON_SV(disabledBy,%s) ",\n"
             JSON_IV(canDelete,%s) ",\n"
-            JSON_IV(numValidCharts,%d) "\n",
+            JSON_IV(numValidCharts,%d) ",\n"
+            JSON_IV(chartRenders,%lu) "\n",
             numCandidates,
             status, 
             PF_BOOL(active),
@@ -290,7 +452,8 @@ wxString ChartSet::LocalJson(){
             reopenErrors,
             disabledBy,
             PF_BOOL(canDelete),
-            numValidCharts
+            numValidCharts,
+            numChartRenders
             );
 }
 void    ChartSet::SetReady(){
@@ -313,8 +476,9 @@ void ChartSet::GetOverview(int& minZoom, int& maxZoom, BoundingBox& boundings){
     maxZoom=charts->GetMaxZoom();
     boundings=charts->GetBoundings();
 }
-WeightedChartList  ChartSet::FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp){
-    return charts->FindChartForTile(minZoom,maxZoom,northwest,southeast,goUp);
+WeightedChartList  ChartSet::FindChartForTile(int minZoom,int maxZoom,LatLon &northwest,LatLon &southeast,int goUp,
+        bool cull){
+    return charts->FindChartForTile(minZoom,maxZoom,northwest,southeast,goUp,cull);
 }
 wxString ChartSet::GetSetToken(){
     MD5 token=setToken;
@@ -285,6 +285,15 @@ void Worker::SendData(int socket,HTTPResponse *response,HTTPRequest *request){
     SocketHelper::WriteAll(socket, sHTTP.c_str(), sHTTP.Length(),1000 );
     WriteHeadersAndCookies(socket,response,request);
     unsigned long maxLen=0;
+    wxFileOffset fileOffset=0;
+    int fd=response->GetFile(fileOffset);
+    if (fd >= 0){
+        long sent=SocketHelper::SendFile(socket,fd,fileOffset,response->GetLength(),10000);
+        if (sent < 0 || (unsigned long)sent != response->GetLength()){
+            LOG_ERROR(wxT("unable to send all data to socket %d, expected %ld, sent %ld"),socket,response->GetLength(),sent);
+        }
+        return;
+    }
     if (response->SupportsChunked()){
         maxLen=10000;
         const unsigned char *data;
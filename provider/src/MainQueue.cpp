@@ -27,10 +27,23 @@
 
 #include "MainQueue.h"
 #include "Logger.h"
+#include "StringHelper.h"
 
-MainMessage::MainMessage():RefCount(){
+//how many queued messages we check for the same affinity
+#define AFFINITY_WINDOW 32
+//how often a message can be overtaken by messages with the current affinity
+#define AFFINITY_MAX_BYPASS 16
+
+MainMessage::MainMessage(Priority priority):RefCount(){
     waiter=new Condition(lock);
     isDone=false;
+    this->priority=priority;
+    deadline=0;
+    numWaiters=0;
+    cancelled=false;
+    demoted=false;
+    affinity=0;
+    bypassed=0;
 }
 
 void MainMessage::SetDone(){
@@ -39,6 +52,39 @@ void MainMessage::SetDone(){
     waiter->notifyAll(locker);
 }
 
+void MainMessage::SetDeadline(long timeout){
+    if (timeout <= 0){
+        deadline=0;
+        return;
+    }
+    deadline=wxGetLocalTimeMillis()+timeout;
+}
+
+bool MainMessage::IsExpired(){
+    if (deadline == 0) return false;
+    return wxGetLocalTimeMillis() > deadline;
+}
+
+void MainMessage::AddWaiter(){
+    Synchronized locker(lock);
+    numWaiters++;
+    cancelled=false;
+}
+
+bool MainMessage::GiveUp(){
+    Synchronized locker(lock);
+    if (numWaiters > 0) numWaiters--;
+    if (numWaiters == 0 && ! isDone){
+        cancelled=true;
+    }
+    return cancelled;
+}
+
+bool MainMessage::IsCancelled(){
+    Synchronized locker(lock);
+    return cancelled;
+}
+
 bool MainMessage::WaitForResult(long timeout){
     wxLongLong start = wxGetLocalTimeMillis();
     while (true) {
@@ -65,41 +111,200 @@ MainMessage::~MainMessage(){
 
 MainQueue::MainQueue() {
     shouldStop=false;
+    readCondition=new Condition(lock);
+    writeCondition=new Condition(lock);
+    for (int i=0;i<MainMessage::PRIO_NUM;i++){
+        numProcessed[i]=0;
+        numExpired[i]=0;
+        numCancelled[i]=0;
+        numDemoted[i]=0;
+        numReordered[i]=0;
+    }
+    lastAffinity=0;
+}
+
+MainMessage * MainQueue::TakeNext(int priority){
+    Queue &queue=queues[priority];
+    MainMessage *rt=queue.front();
+    if (priority >= MainMessage::PRIO_HINT && lastAffinity != 0
+            && rt->affinity != lastAffinity
+            && rt->bypassed < AFFINITY_MAX_BYPASS){
+        size_t window=queue.size();
+        if (window > AFFINITY_WINDOW) window=AFFINITY_WINDOW;
+        for (size_t i=1;i<window;i++){
+            if (queue[i]->affinity != lastAffinity) continue;
+            for (size_t k=0;k<i;k++){
+                queue[k]->bypassed++;
+            }
+            rt=queue[i];
+            queue.erase(queue.begin()+i);
+            numReordered[priority]++;
+            return rt;
+        }
+    }
+    queue.pop_front();
+    if (rt->affinity != 0) lastAffinity=rt->affinity;
+    return rt;
+}
+
+MainMessage * MainQueue::Dequeue(long timeout){
+    Synchronized locker(lock);
+    for (int i=0;i<MainMessage::PRIO_NUM;i++){
+        if (queues[i].size() > 0){
+            MainMessage *rt=TakeNext(i);
+            writeCondition->notifyAll(locker);
+            return rt;
+        }
+    }
+    readCondition->wait(locker,timeout);
+    for (int i=0;i<MainMessage::PRIO_NUM;i++){
+        if (queues[i].size() > 0){
+            MainMessage *rt=TakeNext(i);
+            writeCondition->notifyAll(locker);
+            return rt;
+        }
+    }
+    return NULL;
 }
 
 void MainQueue::Loop(wxApp* app) {
     LOG_INFO(wxT("MainQueue::Loop started"));
     MainMessage *msg=NULL;
     while(! shouldStop){
-        msg=queue.Dequeue(100);
+        msg=Dequeue(100);
         if (msg != NULL){
-            msg->Process();
+            int prio=msg->GetPriority();
+            if (msg->IsExpired()){
+                //the caller already gave up - do not waste time
+                LOG_DEBUG(wxT("MainQueue: dropping expired message with prio %d"),prio);
+                msg->Process(true);
+                Synchronized locker(lock);
+                numExpired[prio]++;
+            }
+            else{
+                msg->Process();
+                Synchronized locker(lock);
+                numProcessed[prio]++;
+            }
             msg->Unref();
         }
         app->Yield(true);
     }
-    while (( msg = queue.Dequeue(1))!= NULL) {
+    while (( msg = Dequeue(1))!= NULL) {
         msg->Process(true);
         msg->Unref();
     }
     LOG_INFOC(wxT("MainLoop finished"));
 }
 
+bool MainQueue::HasWaiting(MainMessage::Priority priority){
+    for (int i=0;i<=priority && i < MainMessage::PRIO_NUM;i++){
+        if (queues[i].size() > 0) return true;
+    }
+    return false;
+}
+
 bool MainQueue::Enqueue(MainMessage* msg,long timeout,bool onlyIfEmpty){
     if (shouldStop) return false;
+    MainMessage::Priority prio=msg->GetPriority();
+    wxLongLong start=wxGetLocalTimeMillis();
+    Synchronized locker(lock);
+    while (onlyIfEmpty && HasWaiting(prio)){
+        if (shouldStop) return false;
+        wxLongLong wait=100;
+        if (timeout != 0){
+            //timeout 0: wait until the queue is empty
+            wxLongLong now=wxGetLocalTimeMillis();
+            if (now < start || now >= (start+timeout)) return false;
+            wait=start+timeout-now;
+            if (wait > 100) wait=100;
+        }
+        writeCondition->wait(locker,wait.ToLong());
+    }
     msg->Ref();
-    bool rt=queue.Enqueue(msg,timeout,onlyIfEmpty);
-    if (! rt) msg->Unref();
-    return rt;
+    queues[prio].push_back(msg);
+    readCondition->notifyAll(locker);
+    return true;
+}
+
+void MainQueue::Promote(MainMessage *msg,MainMessage::Priority priority,long timeout){
+    Synchronized locker(lock);
+    MainMessage::Priority current=msg->GetPriority();
+    //only messages still waiting in our queues can be changed
+    //others are already being processed here or by a worker
+    Queue::iterator it;
+    for (it=queues[current].begin();it!=queues[current].end();it++){
+        if (*it == msg) break;
+    }
+    if (it == queues[current].end()) return;
+    if (timeout > 0 && msg->deadline != 0){
+        wxLongLong newDeadline=wxGetLocalTimeMillis()+timeout;
+        if (newDeadline > msg->deadline) msg->deadline=newDeadline;
+    }
+    if (priority >= current) return;
+    queues[current].erase(it);
+    queues[priority].push_back(msg);
+    msg->priority=priority;
+}
+
+bool MainQueue::Demote(MainMessage *msg,MainMessage::Priority priority,long timeout){
+    if (shouldStop) return false;
+    Synchronized locker(lock);
+    numDemoted[msg->GetPriority()]++;
+    msg->SetDeadline(timeout);
+    msg->demoted=true;
+    msg->priority=priority;
+    msg->Ref();
+    queues[priority].push_back(msg);
+    readCondition->notifyAll(locker);
+    return true;
+}
+
+void MainQueue::CountCancelled(MainMessage::Priority priority){
+    Synchronized locker(lock);
+    numCancelled[priority]++;
+}
+
+long MainQueue::NumQueued(MainMessage::Priority priority){
+    Synchronized locker(lock);
+    return (long)queues[priority].size();
 }
 
 void MainQueue::Stop(){
     LOG_INFO(wxT("MainQueue::Stop"));
     shouldStop=true;
+    //wake up producers waiting for room
+    Synchronized locker(lock);
+    writeCondition->notifyAll(locker);
 }
 
+wxString MainQueue::ToJson(){
+    static const char * names[]={"interactive","feature","admin","hint","prefill"};
+    Synchronized locker(lock);
+    wxString rt=wxT("{");
+    for (int i=0;i<MainMessage::PRIO_NUM;i++){
+        if (i > 0) rt.Append(",\n");
+        rt.Append(wxString::Format(wxT("\"%s\":{"
+            JSON_IV(queued,%ld) ",\n"
+            JSON_IV(processed,%ld) ",\n"
+            JSON_IV(expired,%ld) ",\n"
+            JSON_IV(cancelled,%ld) ",\n"
+            JSON_IV(demoted,%ld) ",\n"
+            JSON_IV(reordered,%ld) "\n"
+            "}"),
+            names[i],
+            (long)queues[i].size(),
+            numProcessed[i],
+            numExpired[i],
+            numCancelled[i],
+            numDemoted[i],
+            numReordered[i]));
+    }
+    rt.Append(wxT("}"));
+    return rt;
+}
 
 MainQueue::~MainQueue() {
-    //TODO: empty queue?
+    delete readCondition;
+    delete writeCondition;
 }
-
@@ -34,17 +34,14 @@ RefCount::~RefCount() {
 }
 
 void RefCount::Ref(){
-    wxMutexLocker locker(lock);
-    count++;
+    count.fetch_add(1,std::memory_order_relaxed);
 }
 void RefCount::Unref(){
-    int current=-1;
-    {
-        wxMutexLocker locker(lock);
-        if (count > 0){
-            count--;
-            current=count;
+    int current=count.load(std::memory_order_relaxed);
+    while (current > 0){
+        if (count.compare_exchange_weak(current,current-1,std::memory_order_acq_rel)){
+            if (current == 1) delete this;
+            return;
         }
     }
-    if (current == 0) delete this;
 }
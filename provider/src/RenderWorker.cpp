@@ -0,0 +1,663 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Render Worker processes
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#include "RenderWorker.h"
+#include "Renderer.h"
+#include "ChartManager.h"
+#include "Logger.h"
+#include "StringHelper.h"
+#include "SocketHelper.h"
+#include <wx/filename.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+
+#define WORKER_MAGIC 0x57525641 //AVRW
+#define WORKER_KEY_LEN 512
+#define WORKER_RESULT_SIZE (TILE_SIZE*TILE_SIZE*3)
+
+typedef enum{
+    WRS_HELLO=0,
+    WRS_OK,
+    WRS_NOSET,
+    WRS_NOCHART,
+    WRS_FAIL
+} WorkerStatus;
+
+typedef struct{
+    uint32_t    magic;
+    uint32_t    sequence;
+    int32_t     zoom;
+    int32_t     x;
+    int32_t     y;
+    char        setKey[WORKER_KEY_LEN];
+} WorkerRequest;
+
+typedef struct{
+    uint32_t    magic;
+    uint32_t    sequence;
+    int32_t     status;
+    uint32_t    len;
+} WorkerResponse;
+
+/**
+ * write all bytes
+ * @return false on error
+ */
+static bool writeAll(int fd,const void *buffer,size_t len){
+    const char *p=(const char *)buffer;
+    while (len > 0){
+        ssize_t wr=write(fd,p,len);
+        if (wr < 0){
+            if (errno == EINTR) continue;
+            SocketHelper::LogSysError(-1,"RenderWorker write",fd);
+            return false;
+        }
+        p+=wr;
+        len-=wr;
+    }
+    return true;
+}
+
+/**
+ * read a complete record
+ * the timeout only applies until the first byte has been read
+ * @return 1 if ok, 0 on timeout, -1 on error or EOF
+ */
+static int readAll(int fd,void *buffer,size_t len,long timeout){
+    char *p=(char *)buffer;
+    bool started=false;
+    while (len > 0){
+        struct pollfd pfd;
+        pfd.fd=fd;
+        pfd.events=POLLIN;
+        pfd.revents=0;
+        int prs=poll(&pfd,1,started?timeout+1000:timeout);
+        if (prs < 0){
+            if (errno == EINTR) continue;
+            SocketHelper::LogSysError(-1,"RenderWorker poll",fd);
+            return -1;
+        }
+        if (prs == 0){
+            if (started) return -1;
+            return 0;
+        }
+        ssize_t rd=read(fd,p,len);
+        if (rd < 0){
+            if (errno == EINTR) continue;
+            SocketHelper::LogSysError(-1,"RenderWorker read",fd);
+            return -1;
+        }
+        if (rd == 0) return -1; //EOF
+        started=true;
+        p+=rd;
+        len-=rd;
+    }
+    return 1;
+}
+
+/**
+ * create an (already unlinked) file that we can share with the child
+ * prefer /dev/shm to avoid any disk writes
+ * @return the fd or -1
+ */
+static int createSharedFile(size_t size){
+    wxArrayString dirs;
+    dirs.Add(wxT("/dev/shm"));
+    dirs.Add(wxFileName::GetTempDir());
+    for (size_t i=0;i<dirs.size();i++){
+        if (!wxDirExists(dirs[i])) continue;
+        wxString pattern=dirs[i]+wxFileName::GetPathSeparator()+wxT("avnav-render-XXXXXX");
+        char name[1024];
+        strncpy(name,pattern.ToUTF8().data(),sizeof(name)-1);
+        name[sizeof(name)-1]=0;
+        int fd=mkstemp(name);
+        if (fd < 0) continue;
+        unlink(name);
+        if (ftruncate(fd,size) != 0){
+            close(fd);
+            continue;
+        }
+        return fd;
+    }
+    return -1;
+}
+
+RenderWorker::RenderWorker(int index,wxString exe,wxArrayString args,
+        ChartManager *manager,MainQueue *mainQueue,long timeout):Thread(){
+    this->index=index;
+    this->exe=exe;
+    this->args=args;
+    this->manager=manager;
+    this->mainQueue=mainQueue;
+    this->timeout=timeout;
+    state=STATE_NONE;
+    pid=-1;
+    socket=-1;
+    shmFd=-1;
+    shm=NULL;
+    startSequence=-1;
+    requestSequence=0;
+    queueLen=0;
+    busy=false;
+    numRendered=0;
+    numErrors=0;
+    numFallback=0;
+    numStarts=0;
+    busyTime=0;
+    lastStatusTime=Logger::MicroSeconds100();
+    utilization=0;
+}
+
+RenderWorker::~RenderWorker(){
+    StopChild(true);
+    if (shm != NULL) munmap(shm,WORKER_RESULT_SIZE);
+    if (shmFd >= 0) close(shmFd);
+}
+
+bool RenderWorker::StartChild(){
+    if (shmFd < 0){
+        shmFd=createSharedFile(WORKER_RESULT_SIZE);
+        if (shmFd < 0){
+            LOG_ERROR(wxT("RenderWorker %d: unable to create shared memory"),index);
+            return false;
+        }
+        void *area=mmap(NULL,WORKER_RESULT_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,shmFd,0);
+        if (area == MAP_FAILED){
+            SocketHelper::LogSysError(-1,"RenderWorker mmap",shmFd);
+            close(shmFd);
+            shmFd=-1;
+            return false;
+        }
+        shm=(unsigned char *)area;
+    }
+    int fds[2];
+    if (SocketHelper::LogSysError(socketpair(AF_UNIX,SOCK_STREAM,0,fds),"RenderWorker socketpair",-1)){
+        return false;
+    }
+    //prepare everything before the fork
+    //as we are not allowed to allocate in the child
+    wxArrayString childArgs;
+    childArgs.Add(exe);
+    for (size_t i=0;i<args.size();i++){
+        childArgs.Add(args[i]);
+    }
+    //the worker spec contains the fds - insert it before the positional parameters
+    int pos=childArgs.Index(wxT("--"));
+    wxString spec=wxString::Format(wxT("%d,%d,%d"),fds[1],shmFd,index);
+    if (pos == wxNOT_FOUND){
+        childArgs.Add(wxT("-k"));
+        childArgs.Add(spec);
+    }
+    else{
+        childArgs.Insert(spec,pos);
+        childArgs.Insert(wxT("-k"),pos);
+    }
+    std::vector<char *> argv;
+    for (size_t i=0;i<childArgs.size();i++){
+        argv.push_back(strdup(childArgs[i].ToUTF8().data()));
+    }
+    argv.push_back(NULL);
+    long maxFd=sysconf(_SC_OPEN_MAX);
+    if (maxFd < 0) maxFd=1024;
+    startSequence=manager->GetSettings()->GetCurrentSequence();
+    pid_t child=fork();
+    if (child == 0){
+        //child - only async signal safe calls from here
+        for (int fd=3;fd < maxFd;fd++){
+            if (fd == fds[1] || fd == shmFd) continue;
+            close(fd);
+        }
+        execv(argv[0],argv.data());
+        _exit(127);
+    }
+    for (size_t i=0;i<argv.size();i++){
+        if (argv[i] != NULL) free(argv[i]);
+    }
+    close(fds[1]);
+    if (child < 0){
+        SocketHelper::LogSysError(-1,"RenderWorker fork",-1);
+        close(fds[0]);
+        return false;
+    }
+    fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+    pid=child;
+    socket=fds[0];
+    state=STATE_STARTING;
+    LOG_INFO(wxT("RenderWorker %d: started child pid %d"),index,(int)pid);
+    return true;
+}
+
+void RenderWorker::StopChild(bool kill){
+    if (socket >= 0){
+        close(socket);
+        socket=-1;
+    }
+    if (pid > 0){
+        if (kill){
+            ::kill(pid,SIGKILL);
+        }
+        else{
+            //closing the socket will make the child exit
+            for (int i=0;i<50;i++){
+                if (waitpid(pid,NULL,WNOHANG) != 0){
+                    pid=-1;
+                    break;
+                }
+                wxMilliSleep(100);
+            }
+            if (pid > 0) ::kill(pid,SIGKILL);
+        }
+        if (pid > 0) waitpid(pid,NULL,0);
+        LOG_INFO(wxT("RenderWorker %d: child stopped"),index);
+        pid=-1;
+    }
+    state=STATE_NONE;
+}
+
+bool RenderWorker::WaitForHello(long waitTime){
+    WorkerResponse response;
+    int rs=readAll(socket,&response,sizeof(response),waitTime);
+    if (rs == 0) return false;
+    if (rs < 0 || response.magic != WORKER_MAGIC || response.status != WRS_HELLO){
+        LOG_ERROR(wxT("RenderWorker %d: child did not start correctly"),index);
+        StopChild(true);
+        state=STATE_ERROR;
+        return false;
+    }
+    LOG_INFO(wxT("RenderWorker %d: child ready"),index);
+    state=STATE_READY;
+    return true;
+}
+
+bool RenderWorker::Enqueue(RenderMessage* msg){
+    if (state != STATE_READY) return false;
+    msg->Ref();
+    {
+        Synchronized locker(statusLock);
+        queueLen++;
+    }
+    if (!queue.Enqueue(msg,0)){
+        Synchronized locker(statusLock);
+        queueLen--;
+        msg->Unref();
+        return false;
+    }
+    return true;
+}
+
+long RenderWorker::GetLoad(){
+    Synchronized locker(statusLock);
+    return queueLen+(busy?1:0);
+}
+
+void RenderWorker::FallBack(RenderMessage* msg){
+    {
+        Synchronized locker(statusLock);
+        numFallback++;
+    }
+    if (!mainQueue->Enqueue(msg,0)){
+        msg->SetDone();
+    }
+}
+
+void RenderWorker::DrainQueue(bool discard){
+    RenderMessage *msg=NULL;
+    while ((msg=queue.Dequeue(1)) != NULL){
+        {
+            Synchronized locker(statusLock);
+            queueLen--;
+        }
+        if (discard){
+            msg->SetDone();
+        }
+        else{
+            FallBack(msg);
+        }
+        msg->Unref();
+    }
+}
+
+void RenderWorker::HandleMessage(RenderMessage* msg){
+    Renderer *renderer=Renderer::Instance();
+    if (!renderer->CheckRenderMessage(msg)) return;
+    TileInfo tile=msg->GetTile();
+    WorkerRequest request;
+    memset(&request,0,sizeof(request));
+    request.magic=WORKER_MAGIC;
+    request.sequence=++requestSequence;
+    request.zoom=tile.zoom;
+    request.x=tile.x;
+    request.y=tile.y;
+    wxScopedCharBuffer key=msg->GetSet()->GetKey().ToUTF8();
+    if (key.length() >= WORKER_KEY_LEN){
+        FallBack(msg);
+        return;
+    }
+    memcpy(request.setKey,key.data(),key.length());
+    if (!writeAll(socket,&request,sizeof(request))){
+        LOG_ERROR(wxT("RenderWorker %d: unable to send request, restarting"),index);
+        StopChild(true);
+        FallBack(msg);
+        return;
+    }
+    WorkerResponse response;
+    int rs=readAll(socket,&response,sizeof(response),timeout);
+    if (rs <= 0 || response.magic != WORKER_MAGIC || response.sequence != request.sequence){
+        {
+            Synchronized locker(statusLock);
+            numErrors++;
+        }
+        if (rs == 0){
+            LOG_ERROR(wxT("RenderWorker %d: timeout for %s, restarting"),index,tile.ToString());
+            StopChild(true);
+            FallBack(msg);
+            return;
+        }
+        LOG_ERROR(wxT("RenderWorker %d: invalid response for %s, restarting"),index,tile.ToString());
+        StopChild(true);
+        FallBack(msg);
+        return;
+    }
+    switch(response.status){
+        case WRS_OK:
+            if (response.len != WORKER_RESULT_SIZE){
+                msg->SetDone();
+                break;
+            }
+            {
+                Synchronized locker(statusLock);
+                numRendered++;
+            }
+            msg->StoreResult(shm,true);
+            break;
+        case WRS_NOCHART:
+            LOG_DEBUG(wxT("RenderWorker %d: no chart for %s"),index,tile.ToString());
+            msg->SetDone();
+            break;
+        default:
+            //the child does not know the set or fails - let the main thread do the job
+            LOG_DEBUG(wxT("RenderWorker %d: child unable to render %s, fallback"),index,tile.ToString());
+            FallBack(msg);
+            break;
+    }
+}
+
+void RenderWorker::run(){
+    LOG_INFO(wxT("RenderWorker %d started"),index);
+    while (! shouldStop()){
+        if (state == STATE_NONE || state == STATE_ERROR){
+            DrainQueue(false);
+            if (state == STATE_ERROR){
+                if (waitMillis(5000)) break;
+            }
+            if (!StartChild()){
+                state=STATE_ERROR;
+                continue;
+            }
+            Synchronized locker(statusLock);
+            numStarts++;
+            continue;
+        }
+        if (state == STATE_STARTING){
+            WaitForHello(1000);
+            continue;
+        }
+        if (startSequence != manager->GetSettings()->GetCurrentSequence()){
+            LOG_INFO(wxT("RenderWorker %d: settings changed, restarting child"),index);
+            state=STATE_NONE;
+            DrainQueue(false);
+            StopChild(false);
+            continue;
+        }
+        RenderMessage *msg=queue.Dequeue(1000);
+        if (msg == NULL) continue;
+        long start=Logger::MicroSeconds100();
+        {
+            Synchronized locker(statusLock);
+            queueLen--;
+            busy=true;
+        }
+        HandleMessage(msg);
+        msg->Unref();
+        {
+            Synchronized locker(statusLock);
+            busy=false;
+            busyTime+=Logger::MicroSeconds100()-start;
+        }
+    }
+    state=STATE_NONE;
+    DrainQueue(true);
+    StopChild(false);
+    LOG_INFO(wxT("RenderWorker %d stopped"),index);
+}
+
+wxString RenderWorker::ToJson(){
+    Synchronized locker(statusLock);
+    long now=Logger::MicroSeconds100();
+    long elapsed=now-lastStatusTime;
+    //recompute utilization at most every 10s
+    if (elapsed >= 100000){
+        utilization=(double)busyTime*100.0/(double)elapsed;
+        busyTime=0;
+        lastStatusTime=now;
+    }
+    wxString stateName="NONE";
+    WorkerState current=state;
+    switch(current){
+        case STATE_STARTING:
+            stateName="STARTING";
+            break;
+        case STATE_READY:
+            stateName="READY";
+            break;
+        case STATE_ERROR:
+            stateName="ERROR";
+            break;
+        default:
+            break;
+    }
+    return wxString::Format(wxT("{"
+            JSON_IV(index,%d) ",\n"
+            JSON_SV(state,%s) ",\n"
+            JSON_IV(pid,%d) ",\n"
+            JSON_IV(queueLength,%ld) ",\n"
+            JSON_IV(busy,%s) ",\n"
+            JSON_IV(rendered,%ld) ",\n"
+            JSON_IV(errors,%ld) ",\n"
+            JSON_IV(fallback,%ld) ",\n"
+            JSON_IV(starts,%ld) ",\n"
+            JSON_IV(utilization,%.1f) "\n"
+            "}"),
+            index,
+            stateName,
+            (int)pid,
+            queueLen,
+            PF_BOOL(busy),
+            numRendered,
+            numErrors,
+            numFallback,
+            numStarts,
+            utilization
+            );
+}
+
+RenderWorkerPool::RenderWorkerPool(int numWorkers,wxString exe,wxArrayString args,
+        wxArrayString params,wxString logBase,ChartManager *manager,
+        MainQueue *mainQueue,long timeout){
+    numDispatched=0;
+    numRejected=0;
+    for (int i=0;i<numWorkers;i++){
+        wxArrayString childArgs=args;
+        childArgs.Add(wxT("-l"));
+        childArgs.Add(wxString::Format(wxT("%s.worker%d"),logBase,i));
+        childArgs.Add(wxT("--"));
+        for (size_t p=0;p<params.size();p++){
+            childArgs.Add(params[p]);
+        }
+        RenderWorker *worker=new RenderWorker(i,exe,childArgs,manager,mainQueue,timeout);
+        workers.push_back(worker);
+        AddItem("workers",worker,true);
+    }
+}
+
+RenderWorkerPool::~RenderWorkerPool(){
+    Stop();
+    for (size_t i=0;i<workers.size();i++){
+        RemoveItem("workers",workers[i]);
+        delete workers[i];
+    }
+}
+
+void RenderWorkerPool::Start(){
+    LOG_INFO(wxT("RenderWorkerPool: starting %d workers"),(int)workers.size());
+    for (size_t i=0;i<workers.size();i++){
+        workers[i]->start();
+    }
+}
+
+void RenderWorkerPool::Stop(){
+    for (size_t i=0;i<workers.size();i++){
+        workers[i]->stop();
+    }
+    for (size_t i=0;i<workers.size();i++){
+        workers[i]->join();
+    }
+}
+
+bool RenderWorkerPool::Enqueue(RenderMessage* msg){
+    //the shared memory only has space for one tile
+    if (msg->GetMetaSize() > 1) return false;
+    //only idle workers get a message - otherwise it waits in the main queue
+    //where priorities, deadlines and batching apply
+    Synchronized locker(lock);
+    bool rt=false;
+    for (size_t i=0;i<workers.size() && !rt;i++){
+        if (!workers[i]->IsReady()) continue;
+        if (workers[i]->GetLoad() != 0) continue;
+        rt=workers[i]->Enqueue(msg);
+    }
+    if (rt) numDispatched++;
+    else numRejected++;
+    return rt;
+}
+
+wxString RenderWorkerPool::LocalJson(){
+    Synchronized locker(lock);
+    return wxString::Format(
+            JSON_IV(numWorkers,%d) ",\n"
+            JSON_IV(dispatched,%ld) ",\n"
+            JSON_IV(rejected,%ld) "\n",
+            (int)workers.size(),
+            numDispatched,
+            numRejected
+            );
+}
+
+RenderWorkerChild::RenderWorkerChild(wxString spec,ChartManager *manager,MainQueue *queue):Thread(){
+    this->manager=manager;
+    this->queue=queue;
+    socket=-1;
+    shmFd=-1;
+    index=-1;
+    shm=NULL;
+    if (sscanf(spec.ToUTF8().data(),"%d,%d,%d",&socket,&shmFd,&index) != 3){
+        LOG_ERROR(wxT("RenderWorkerChild: invalid worker spec %s"),spec);
+        socket=-1;
+        return;
+    }
+    void *area=mmap(NULL,WORKER_RESULT_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,shmFd,0);
+    if (area == MAP_FAILED){
+        SocketHelper::LogSysError(-1,"RenderWorkerChild mmap",shmFd);
+        return;
+    }
+    shm=(unsigned char *)area;
+}
+
+RenderWorkerChild::~RenderWorkerChild(){
+    if (shm != NULL) munmap(shm,WORKER_RESULT_SIZE);
+    if (socket >= 0) close(socket);
+    if (shmFd >= 0) close(shmFd);
+}
+
+bool RenderWorkerChild::IsOk(){
+    return socket >= 0 && shm != NULL;
+}
+
+void RenderWorkerChild::run(){
+    LOG_INFO(wxT("RenderWorkerChild %d started"),index);
+    WorkerResponse response;
+    memset(&response,0,sizeof(response));
+    response.magic=WORKER_MAGIC;
+    response.status=WRS_HELLO;
+    if (!writeAll(socket,&response,sizeof(response))){
+        queue->Stop();
+        return;
+    }
+    Renderer *renderer=Renderer::Instance();
+    while (! shouldStop()){
+        WorkerRequest request;
+        int rs=readAll(socket,&request,sizeof(request),1000);
+        if (rs == 0) continue;
+        if (rs < 0 || request.magic != WORKER_MAGIC){
+            LOG_INFO(wxT("RenderWorkerChild %d: parent closed connection"),index);
+            break;
+        }
+        request.setKey[WORKER_KEY_LEN-1]=0;
+        wxString key=wxString::FromUTF8(request.setKey);
+        response.sequence=request.sequence;
+        response.len=0;
+        ChartSet *set=manager->GetChartSet(key);
+        if (set == NULL){
+            response.status=WRS_NOSET;
+        }
+        else{
+            TileInfo tile(request.zoom,request.x,request.y,key);
+            Renderer::RenderResult res=renderer->RenderRaw(set,tile,shm);
+            switch(res){
+                case Renderer::RENDER_OK:
+                    response.status=WRS_OK;
+                    response.len=WORKER_RESULT_SIZE;
+                    break;
+                case Renderer::RENDER_NOCHART:
+                    response.status=WRS_NOCHART;
+                    break;
+                default:
+                    response.status=WRS_FAIL;
+                    break;
+            }
+        }
+        if (!writeAll(socket,&response,sizeof(response))) break;
+    }
+    queue->Stop();
+    LOG_INFO(wxT("RenderWorkerChild %d stopped"),index);
+}
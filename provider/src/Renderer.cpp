@@ -35,11 +35,20 @@
 #include "CacheHandler.h"
 #include "ChartManager.h"
 #include "S57AttributeDecoder.h"
+#include "RenderWorker.h"
+#include "SocketHelper.h"
+
+//number of unused render result buffers we keep per size
+#define MAX_POOLED_PIXEL_BUFFERS 16
+//max number of cancelled requests waiting to be rendered for the cache
+#define MAX_DEMOTED_QUEUE 20
+//interval (ms) to check if the client is still connected while waiting
+#define CLIENT_CHECK_INTERVAL 200
 
 
 
 RenderMessageBase::RenderMessageBase(TileInfo& tile, ChartSet *set, 
-        Renderer *renderer,long settingsSequence): MainMessage() {
+        Renderer *renderer,long settingsSequence,Priority priority): MainMessage(priority) {
     this->tile = tile;
     renderOk = false;
     creationTime=Logger::MicroSeconds100();
@@ -57,15 +66,24 @@ RenderMessageBase::~RenderMessageBase(){
 }
 
 RenderMessage::RenderMessage(TileInfo& tile, ChartSet *set, 
-        Renderer *renderer,long settingsSequence):
-        RenderMessageBase(tile,set,renderer,settingsSequence){
-    cacheResult=NULL;
+        Renderer *renderer,long settingsSequence,Priority priority,int metaSize):
+        RenderMessageBase(tile,set,renderer,settingsSequence,priority){
     renderResult=NULL;
+    prefill=(priority >= PRIO_HINT);
+    this->metaSize=metaSize;
 }
 
 RenderMessage::~RenderMessage(){
-    if (cacheResult != NULL) cacheResult->Unref();
-    if (renderResult != NULL) free(renderResult);
+    for (size_t i=0;i<cacheResults.size();i++){
+        cacheResults[i]->Unref();
+    }
+    ReleaseRenderResult();
+}
+
+void RenderMessage::ReleaseRenderResult(){
+    if (renderResult == NULL) return;
+    renderer->GetPixelPool()->Release(renderResult,GetResultSize());
+    renderResult=NULL;
 }
 
 void RenderMessageBase::SetDequeueTime(){
@@ -92,50 +110,142 @@ void RenderMessage::StoreResult(wxImage& result, bool ok){
     renderOk=ok;
     //copy the image data here 
     //as we do not want to hand over the image to a different thread
-    renderResult=(unsigned char *)malloc(TILE_SIZE*TILE_SIZE*3);
-    int sz=TILE_SIZE*TILE_SIZE*3;
-    int isz=result.GetWidth()*result.GetHeight()*3;
-    if (isz < sz) {
-        sz=isz;
+    size_t sz=GetResultSize();
+    renderResult=renderer->GetPixelPool()->Get(sz);
+    if (renderResult == NULL){
+        renderOk=false;
+    }
+    else{
+        size_t isz=result.GetWidth()*result.GetHeight()*3;
+        if (isz < sz) {
+            memset(renderResult,0,sz);
+            sz=isz;
+        }
+        memcpy(renderResult,result.GetData(),sz);
+    }
+    afterRenderTime=Logger::MicroSeconds100();
+    SetDone();
+}
+
+void RenderMessage::StoreResult(const unsigned char *rgb, bool ok){
+    renderOk=ok;
+    if (ok){
+        renderResult=renderer->GetPixelPool()->Get(GetResultSize());
+        if (renderResult == NULL){
+            renderOk=false;
+        }
+        else{
+            memcpy(renderResult,rgb,GetResultSize());
+        }
     }
-    memcpy(this->renderResult,result.GetData(),sz);
     afterRenderTime=Logger::MicroSeconds100();
     SetDone();
 }
 
 void RenderMessage::StoreResult(CacheEntry *entry, bool ok){
-    cacheResult=entry;
+    cacheResults.push_back(entry);
     renderOk=true;
     afterRenderTime=Logger::MicroSeconds100();
     SetDone();
 }
 
+void RenderMessage::ClearPrefill(){
+    Synchronized locker(resultLock);
+    prefill=false;
+}
+
 bool RenderMessage::CreateFinalResult(wxColor &back){
-    if (cacheResult != NULL) return false;
+    Synchronized locker(resultLock);
+    if (cacheResults.size() > 0) return false;
     if (!renderOk) return false;
     if (renderResult == NULL) return false;
-    wxImage renderImage(TILE_SIZE,TILE_SIZE,renderResult,false);
-    renderImage.SetMaskColour(back.Red(),back.Green(),back.Blue());
     SetAfterImageTime();
-    wxMemoryOutputStream *stream=new wxMemoryOutputStream();
-    renderImage.SaveFile(*stream, wxBITMAP_TYPE_PNG);
-    cacheResult=new CacheEntry(tile.GetCacheKey(),stream);
+    int stride=GetPixelSize()*3;
+    TileEncoder *encoder=renderer->GetEncoder();
+    for (int ty=0;ty<metaSize;ty++){
+        for (int tx=0;tx<metaSize;tx++){
+            TileInfo partTile(tile);
+            if (metaSize > 1){
+                partTile.x+=tx;
+                partTile.y+=ty;
+                partTile.cacheKey=tile.cacheKey.WithTile(partTile.zoom,partTile.x,partTile.y);
+            }
+            const unsigned char *start=renderResult+ty*TILE_SIZE*stride+tx*TILE_SIZE*3;
+            CacheEntry *entry=NULL;
+            unsigned long color=0;
+            if (TileEncoder::IsUniform(start,TILE_SIZE,TILE_SIZE,stride,color)){
+                //open sea, land, no data: share one encoded tile
+                CacheEntry *uniform=renderer->GetUniformTile(color,back);
+                if (uniform != NULL){
+                    entry=new CacheEntry(partTile.GetCacheKey(),uniform);
+                    uniform->Unref();
+                }
+            }
+            if (entry == NULL){
+                unsigned char *png=NULL;
+                size_t pngLen=0;
+                if (! encoder->Encode(start,TILE_SIZE,TILE_SIZE,stride,back,png,pngLen)){
+                    LOG_ERROR(wxT("unable to encode %s"),partTile.ToString());
+                    continue;
+                }
+                entry=new CacheEntry(partTile.GetCacheKey(),png,pngLen);
+            }
+            entry->prefill=prefill;
+            cacheResults.push_back(entry);
+        }
+    }
+    ReleaseRenderResult();
     afterPngTime=Logger::MicroSeconds100();
-    renderResult=NULL; //should be freed when the image goes away
+    if (cacheResults.size() < (size_t)(metaSize*metaSize)){
+        //GetCacheResult relies on the index
+        for (size_t i=0;i<cacheResults.size();i++){
+            cacheResults[i]->Unref();
+        }
+        cacheResults.clear();
+        renderOk=false;
+        return false;
+    }
     return true;
 }
 
-CacheEntry * RenderMessage::GetCacheResult(){
-    if (cacheResult != NULL){
-        cacheResult->Ref();
-        return cacheResult;
+CacheEntry * RenderMessage::GetCacheResult(TileInfo *requested){
+    Synchronized locker(resultLock);
+    if (cacheResults.size() < 1) return NULL;
+    size_t index=0;
+    if (requested != NULL && metaSize > 1){
+        int dx=requested->x-tile.x;
+        int dy=requested->y-tile.y;
+        if (dx < 0 || dx >= metaSize || dy < 0 || dy >= metaSize) return NULL;
+        index=dy*metaSize+dx;
     }
-    return NULL;
+    if (index >= cacheResults.size()) return NULL;
+    cacheResults[index]->Ref();
+    return cacheResults[index];
+}
+
+size_t RenderMessage::NumResults(){
+    Synchronized locker(resultLock);
+    return cacheResults.size();
+}
+
+CacheEntry * RenderMessage::GetCacheResultAt(size_t index){
+    Synchronized locker(resultLock);
+    if (index >= cacheResults.size()) return NULL;
+    cacheResults[index]->Ref();
+    return cacheResults[index];
 }
 
 void RenderMessageBase::SetCharts(WeightedChartList charts){
     this->charts=charts;
     findTime=Logger::MicroSeconds100();
+    //tiles with the same charts should be rendered together
+    //to avoid closing and reopening charts
+    unsigned long hash=0;
+    WeightedChartList::iterator it;
+    for (it=charts.begin();it!=charts.end();it++){
+        hash=hash*31+(unsigned long)(it->info);
+    }
+    SetAffinity(hash);
 }
 
 void RenderMessageBase::SetViewPort(PlugIn_ViewPort vp){
@@ -143,11 +253,18 @@ void RenderMessageBase::SetViewPort(PlugIn_ViewPort vp){
 }
 
 void RenderMessage::Process(bool discard){
+    //only finish messages that have been demoted before this run
+    bool wasDemoted=IsDemoted();
     if (discard) {
-        SetDone();
-        return;
+        //expired - but maybe still worth rendering for the cache
+        if (wasDemoted || ! renderer->TryDemote(this)){
+            SetDone();
+        }
+    }
+    else{
+        renderer->DoRenderTile(this);
     }
-    renderer->DoRenderTile(this);
+    if (wasDemoted) renderer->FinishDemoted(this);
 }
 
 FeatureInfoMessage::FeatureInfoMessage(
@@ -158,7 +275,7 @@ FeatureInfoMessage::FeatureInfoMessage(
         float  lat,
         float  lon,
         float  tolerance):
-        RenderMessageBase(tile,set,renderer,settingsSequence){
+        RenderMessageBase(tile,set,renderer,settingsSequence,PRIO_FEATURE){
     this->lat=lat;
     this->lon=lon;
     this->tolerance=tolerance;   
@@ -172,6 +289,12 @@ void FeatureInfoMessage::Process(bool discard){
     }
     long start=Logger::MicroSeconds100();
     TileInfo tile=GetTile();
+    if (IsCancelled()){
+        LOG_DEBUG(wxT("HandleFeatureRequest: %s cancelled"),tile.ToString());
+        renderer->queue->CountCancelled(GetPriority());
+        SetDone();
+        return;
+    }
     if (GetSettingsSequence() != manager->GetSettings()->GetCurrentSequence()){
         LOG_DEBUG(wxT("HandleFeatureRequest: %s settings sequence changed, cancel"),tile.ToString());
         SetDone();
@@ -213,7 +336,8 @@ ObjectList* FeatureInfoMessage::GetResult(){
 }
 
 //must be called in main thread
-Renderer::Renderer(ChartManager *manager,MainQueue *queue, long timeout){
+Renderer::Renderer(ChartManager *manager,MainQueue *queue, long timeout):
+    pixelPool(MAX_POOLED_PIXEL_BUFFERS){
     this->manager=manager;
     this->queue=queue;
     stop=false;
@@ -229,6 +353,55 @@ Renderer::Renderer(ChartManager *manager,MainQueue *queue, long timeout){
 
 Renderer *Renderer::_instance=NULL;
 
+void Renderer::SetMetaTileSize(int size){
+    if (size != 1 && size != 2 && size != 4){
+        LOG_ERROR(wxT("invalid metatile size %d, using 1"),size);
+        size=1;
+    }
+    metaTileSize=size;
+    if (size > 1 && metaBitmap == NULL){
+        metaBitmap=new wxBitmap(TILE_SIZE*size, TILE_SIZE*size, 32);
+        wxMemoryDC initialDc(*metaBitmap);
+        initialDc.SetBackground(wxBrush(backColor));
+        initialDc.Clear();
+        initialDc.SelectObject(wxNullBitmap);
+    }
+}
+
+int Renderer::GetMetaTileSize(int zoom){
+    int rt=metaTileSize;
+    //at low zoom levels the world is smaller then our metatile
+    while (rt > 1 && rt > (1 << zoom)) rt=rt/2;
+    return rt;
+}
+
+CacheEntry * Renderer::GetUniformTile(unsigned long color, const wxColor& transparent){
+    UniformTiles *uniformTiles=manager->GetUniformTiles();
+    CacheEntry *rt=uniformTiles->Find(color);
+    if (rt != NULL) return rt;
+    if (uniformTiles->Size() >= MAX_UNIFORM_TILES) return NULL;
+    unsigned char row[TILE_SIZE*3];
+    for (int i=0;i<TILE_SIZE*3;i+=3){
+        row[i]=(color >> 16) & 0xff;
+        row[i+1]=(color >> 8) & 0xff;
+        row[i+2]=color & 0xff;
+    }
+    unsigned char *png=NULL;
+    size_t pngLen=0;
+    //stride 0: all rows are the same
+    if (! encoder.Encode(row,TILE_SIZE,TILE_SIZE,0,transparent,png,pngLen)){
+        LOG_ERROR(wxT("unable to encode uniform tile %06lx"),color);
+        return NULL;
+    }
+    CacheEntry *created=new CacheEntry(TileKey(),png,pngLen);
+    rt=uniformTiles->Add(color,created);
+    created->Unref();
+    if (rt != NULL){
+        LOG_DEBUG(wxT("created uniform tile %06lx, len=%ld"),color,(long)pngLen);
+    }
+    return rt;
+}
+
 void Renderer::CreateInstance(ChartManager *manager,MainQueue *queue, long timeout){
     if (_instance != NULL) return;
     Renderer * ni=new Renderer(manager,queue,timeout);
@@ -237,13 +410,76 @@ void Renderer::CreateInstance(ChartManager *manager,MainQueue *queue, long timeo
 
 
 
-void Renderer::DoRenderTile(RenderMessage *msg){
-    long start=Logger::MicroSeconds100();
+bool Renderer::KeepCancelled(RenderMessage *msg){
+    if (msg->GetSet()->cache == NULL) return false;
+    //cancelled prefills will be retried by the filler anyway
+    if (msg->GetPriority() >= MainMessage::PRIO_PREFILL) return false;
+    if (msg->GetSettingsSequence() != manager->GetSettings()->GetCurrentSequence()) return false;
+    return queue->NumQueued(MainMessage::PRIO_PREFILL) < MAX_DEMOTED_QUEUE;
+}
+
+bool Renderer::TryDemote(RenderMessage *msg){
+    if (msg->IsDemoted()) return false;
+    if (! KeepCancelled(msg)) return false;
+    if (! AddInFlight(msg)) return false;
+    if (queue->Demote(msg,MainMessage::PRIO_PREFILL,renderTimeout)){
+        LOG_DEBUG(wxT("DoRenderTile: %s demoted to prefill"),msg->GetTile().ToString());
+        return true;
+    }
+    RemoveInFlight(msg);
+    return false;
+}
+
+void Renderer::FinishDemoted(RenderMessage *msg){
+    RemoveInFlight(msg);
+    //if somebody is waiting again he will store the result
+    if (! msg->IsCancelled() || ! msg->IsOk()) return;
+    if (msg->CreateFinalResult(backColor)){
+        StoreInCache(msg);
+    }
+}
+
+void Renderer::StoreInCache(RenderMessage *msg){
+    ChartSet *set=msg->GetSet();
+    if (set->cache == NULL) return;
+    size_t numResults=msg->NumResults();
+    for (size_t i=0;i<numResults;i++){
+        CacheEntry *entry=msg->GetCacheResultAt(i);
+        if (numResults > 1){
+            //do not replace tiles from a metatile that we already have
+            CacheEntry *existing=set->cache->FindEntry(entry->name,false);
+            if (existing != NULL || set->cache->HasDiskEntry(entry->name)){
+                if (existing != NULL) existing->Unref();
+                entry->Unref();
+                continue;
+            }
+        }
+        set->cache->AddEntry(entry);
+        entry->Unref();
+    }
+}
+
+bool Renderer::CheckRenderMessage(RenderMessage *msg){
     TileInfo tile=msg->GetTile();
+    if (msg->IsCancelled() && ! msg->IsDemoted()){
+        //nobody is waiting any more
+        //either render it later for the cache or skip it
+        if (TryDemote(msg)) return false;
+        LOG_DEBUG(wxT("DoRenderTile: %s cancelled, skip"),tile.ToString());
+        queue->CountCancelled(msg->GetPriority());
+        msg->SetDone();
+        return false;
+    }
+    if (msg->IsExpired()){
+        if (TryDemote(msg)) return false;
+        LOG_DEBUG(wxT("DoRenderTile: %s expired, cancel"),tile.ToString());
+        msg->SetDone();
+        return false;
+    }
     if (msg->GetSettingsSequence() != manager->GetSettings()->GetCurrentSequence()){
         LOG_DEBUG(wxT("DoRenderTile: %s settings sequence changed, cancel"),tile.ToString());
         msg->SetDone();
-        return;
+        return false;
     }
     //we need to check the cache again as maybe some requests already had
     //been in the queue
@@ -251,9 +487,11 @@ void Renderer::DoRenderTile(RenderMessage *msg){
     if (!set->IsActive()){
         LOG_DEBUG(wxT("DoRenderTile: chart set no longer active"),tile.ToString());
         msg->SetDone();
-        return;
+        return false;
     }
     msg->SetDequeueTime();
+    //no late cache hits for metatiles - we would need all of them
+    if (msg->GetMetaSize() > 1) return true;
     //we only check the in memory cache again
     //it is very unlikely that a tile was not in the cache when the request started but now
     //already removed from the in memory cache and written to disk
@@ -265,37 +503,59 @@ void Renderer::DoRenderTile(RenderMessage *msg){
         if (ce){
             LOG_DEBUG(wxT("late cache hit for %s"),tile.ToString());
             msg->StoreResult(ce,true);
-            return ;
+            return false;
         }
     }
-    
-    wxBitmap renderBitmap=initialBitmap->GetSubBitmap(wxRect(0,0,TILE_SIZE,TILE_SIZE));
-    int startIndex=0;
-    wxMemoryDC renderDc(renderBitmap);
+    return true;
+}
+
+void Renderer::DoRenderTile(RenderMessage *msg){
+    if (! CheckRenderMessage(msg)) return;
+    TileInfo tile=msg->GetTile();
+    ChartSet *set=msg->GetSet();
+    int pixelSize=msg->GetPixelSize();
+    wxBitmap *baseBitmap=initialBitmap;
+    if (msg->GetMetaSize() > 1){
+        if (metaBitmap == NULL || metaBitmap->GetWidth() != pixelSize){
+            LOG_ERROR(wxT("DoRenderTile: no bitmap for metatile %s"),tile.ToString());
+            msg->SetDone();
+            return;
+        }
+        baseBitmap=metaBitmap;
+    }
     //see ChartPlugInWrapper::RenderRegionViewOnDC
     //see Quilt::DoRenderQuiltRegionViewOnDC
     PlugIn_ViewPort vpoint=msg->GetViewPort();
     WeightedChartList infos=msg->GetChartList();
-    wxRegion region(0,0,TILE_SIZE,TILE_SIZE);
+    wxRegion region(0,0,pixelSize,pixelSize);
     LOG_DEBUG(_T("do render for %s with %d entries"),tile.ToString(),(int)infos.size());
-    for (size_t i=startIndex;i<infos.size();i++){
+    vpoint.chart_scale=set->GetScaleForZoom(tile.zoom);//chart->GetNativeScale();
+    //charts hidden by better ones have already been removed in FindChartForTile
+    wxBitmap renderBitmap=baseBitmap->GetSubBitmap(wxRect(0,0,pixelSize,pixelSize));
+    wxMemoryDC renderDc(renderBitmap);
+    for (size_t i=0;i<infos.size();i++){
         ChartInfo *chart=infos[i].info;
-        vpoint.chart_scale=set->GetScaleForZoom(tile.zoom);//chart->GetNativeScale();
-        if (!manager->OpenChart(chart,set->ShouldRetryReopen())){ //ensure the chart to be open
-            set->SetReopenStatus(chart->GetFileName(),false);
-            LOG_ERROR("unable to open chart %s, cannot render %s",chart->GetFileName(),tile.ToString());
-            msg->SetDone();
-            return;
-        } 
-        else{
-            set->SetReopenStatus(chart->GetFileName(),true);
-            chart->Render(renderDc,vpoint,region,tile.zoom);
-        }
+        if (! OpenChartForRender(msg,chart)) return;
+        chart->Render(renderDc,vpoint,region,tile.zoom);
     }
+    renderDc.SelectObject(wxNullBitmap);
+    set->CountChartRenders(infos.size());
     wxImage result=renderBitmap.ConvertToImage();
     msg->StoreResult(result,true);
 }
 
+bool Renderer::OpenChartForRender(RenderMessage *msg, ChartInfo *chart){
+    ChartSet *set=msg->GetSet();
+    if (!manager->OpenChart(chart,set->ShouldRetryReopen())){ //ensure the chart to be open
+        set->SetReopenStatus(chart->GetFileName(),false);
+        LOG_ERROR("unable to open chart %s, cannot render %s",chart->GetFileName(),msg->GetTile().ToString());
+        msg->SetDone();
+        return false;
+    } 
+    set->SetReopenStatus(chart->GetFileName(),true);
+    return true;
+}
+
 /**
  * sort the weighted list
  * better ones (higher zoom, lower scale) at the end
@@ -320,11 +580,12 @@ bool scaleSort(ChartInfoWithScale first, ChartInfoWithScale second){
         ChartSet *set, 
         TileInfo &tile,
         RenderMessageBase *msg,
-        bool allLower  
+        bool allLower,
+        int metaSize
     ){
     PlugIn_ViewPort vpoint;
-    vpoint.pix_width=TILE_SIZE;
-    vpoint.pix_height=TILE_SIZE;
+    vpoint.pix_width=TILE_SIZE*metaSize;
+    vpoint.pix_height=TILE_SIZE*metaSize;
     vpoint.rotation=0.0;
     vpoint.skew=0.0;
     vpoint.m_projection_type=PI_PROJECTION_MERCATOR;
@@ -333,6 +594,14 @@ bool scaleSort(ChartInfoWithScale first, ChartInfoWithScale second){
     //southeast: maxlon,minlat
     LatLon northwest=TileHelper::TileNorthWest(tile);
     LatLon southeast=TileHelper::TileSouthEast(tile);
+    if (metaSize > 1){
+        //the center of a metatile is the upper left corner
+        //of the tile in the middle
+        TileInfo centerTile(tile.zoom,tile.x+metaSize/2,tile.y+metaSize/2,tile.chartSetKey);
+        center=TileHelper::TileNorthWest(centerTile);
+        TileInfo lastTile(tile.zoom,tile.x+metaSize-1,tile.y+metaSize-1,tile.chartSetKey);
+        southeast=TileHelper::TileSouthEast(lastTile);
+    }
     vpoint.clat=center.lat;
     vpoint.clon=center.lon;
     vpoint.lat_min=southeast.lat;
@@ -353,7 +622,8 @@ bool scaleSort(ChartInfoWithScale first, ChartInfoWithScale second){
                 tile.zoom,
                 northwest,
                 southeast,
-                manager->GetSettings()->GetUnderZoom());
+                manager->GetSettings()->GetUnderZoom(),
+                ! allLower);
     long timeFind=Logger::MicroSeconds100();
     if (infos.size() < 1) {
         LOG_DEBUG(wxT("prepare render %s no charts found"),tile.ToString(true));
@@ -377,27 +647,148 @@ bool scaleSort(ChartInfoWithScale first, ChartInfoWithScale second){
 
  
  
-Renderer::RenderResult Renderer::renderTile(ChartSet *set,TileInfo &tile,CacheEntry *&out,long timeout,bool forCache){
+RenderMessage * Renderer::FindInFlight(ChartSet *set,TileKey key,long sequence){
+    Synchronized locker(inFlightLock);
+    InFlightMap::iterator it=inFlight.find(key);
+    if (it == inFlight.end()) return NULL;
+    //set ids in the key are reused with many sets
+    if (it->second->GetSet() != set) return NULL;
+    if (it->second->GetSettingsSequence() != sequence) return NULL;
+    it->second->Ref();
+    return it->second;
+}
+
+bool Renderer::AddInFlight(RenderMessage *msg){
+    Synchronized locker(inFlightLock);
+    TileInfo tile=msg->GetTile();
+    InFlightMap::iterator it=inFlight.find(tile.GetCacheKey());
+    if (it != inFlight.end()){
+        //still registered by the request that queued it
+        if (it->second == msg) return true;
+        return false; //another one was faster
+    }
+    msg->Ref();
+    inFlight[tile.GetCacheKey()]=msg;
+    return true;
+}
+
+void Renderer::RemoveInFlight(RenderMessage *msg){
+    Synchronized locker(inFlightLock);
+    TileInfo tile=msg->GetTile();
+    InFlightMap::iterator it=inFlight.find(tile.GetCacheKey());
+    if (it == inFlight.end() || it->second != msg) return;
+    inFlight.erase(it);
+    msg->Unref();
+}
+ 
+bool Renderer::WaitForRender(RenderMessage *msg,int clientSocket){
+    if (clientSocket < 0 || renderTimeout <= 0) return msg->WaitForResult(renderTimeout);
+    wxLongLong start=wxGetLocalTimeMillis();
+    while (true){
+        long remain=(start+renderTimeout-wxGetLocalTimeMillis()).ToLong();
+        if (remain <= 0) return false;
+        if (remain > CLIENT_CHECK_INTERVAL) remain=CLIENT_CHECK_INTERVAL;
+        if (msg->WaitForResult(remain)) return true;
+        if (SocketHelper::IsClosed(clientSocket)){
+            LOG_DEBUG(_T("client for %s disconnected"),msg->GetTile().ToString(true));
+            return false;
+        }
+    }
+}
+
+Renderer::RenderResult Renderer::renderTile(ChartSet *set,TileInfo &tile,CacheEntry *&out,long timeout,bool forCache,bool isHint,int clientSocket,DiskRange **diskRange){
     set->SetTileCacheKey(tile);
+    if (diskRange != NULL) *diskRange=NULL;
     if (! forCache && set->cache != NULL){
-        out=set->cache->FindEntry(tile.GetCacheKey());
+        if (diskRange != NULL){
+            out=set->cache->FindForSend(tile.GetCacheKey(),*diskRange);
+            if (*diskRange != NULL){
+                LOG_DEBUG(_T("render tile %s - request disk hit"),tile.ToString());
+                return RENDER_OK;
+            }
+        }
+        else{
+            out=set->cache->FindEntry(tile.GetCacheKey());
+        }
         if (out != NULL){
             out->prefill=false; //tile has now being requested...
             LOG_DEBUG(_T("render tile %s - request cache hit"),tile.ToString());
             return RENDER_OK;
         }
     }
-    LOG_DEBUG(_T("render tile %s - %s must render"),tile.ToString(),(forCache?"prefill":"request"));
-    RenderMessage *msg=new RenderMessage(tile,set,
-            this,manager->GetSettings()->GetCurrentSequence());
-    if (! PrepareRenderMessage(set,tile,msg))return RENDER_NOCHART;
-    if (!queue->Enqueue(msg,timeout,forCache)){
-        LOG_DEBUG(wxT("queue full for %s"),tile.ToString(true));
-        msg->Unref(); //our own
-        return RENDER_QUEUE;
+    long sequence=manager->GetSettings()->GetCurrentSequence();
+    MainMessage::Priority priority=MainMessage::PRIO_INTERACTIVE;
+    if (forCache){
+        priority=isHint?MainMessage::PRIO_HINT:MainMessage::PRIO_PREFILL;
     }
-    bool rt=msg->WaitForResult(renderTimeout);
+    //prefill and render hints always render complete metatiles
+    int metaSize=GetMetaTileSize(tile.zoom);
+    TileInfo metaTile(tile);
+    if (metaSize > 1){
+        metaTile.x-=tile.x%metaSize;
+        metaTile.y-=tile.y%metaSize;
+        set->SetTileCacheKey(metaTile,metaSize);
+    }
+    //if the same tile is already being rendered we simply wait for this result
+    //this could also be a metatile that contains our tile
+    RenderMessage *msg=FindInFlight(set,tile.GetCacheKey(),sequence);
+    if (msg == NULL && metaSize > 1){
+        msg=FindInFlight(set,metaTile.GetCacheKey(),sequence);
+    }
+    bool isLeader=(msg == NULL);
+    if (isLeader){
+        if (! forCache) metaSize=1;
+        LOG_DEBUG(_T("render tile %s - %s must render, meta=%d"),tile.ToString(),(forCache?"prefill":"request"),metaSize);
+        if (metaSize > 1){
+            msg=new RenderMessage(metaTile,set,this,sequence,priority,metaSize);
+            if (! PrepareRenderMessage(set,metaTile,msg,false,metaSize))return RENDER_NOCHART;
+        }
+        else{
+            msg=new RenderMessage(tile,set,this,sequence,priority);
+            if (! PrepareRenderMessage(set,tile,msg))return RENDER_NOCHART;
+        }
+        //the caller will give up after renderTimeout
+        msg->SetDeadline(renderTimeout);
+        msg->AddWaiter();
+        //register before queuing so that nobody can miss us
+        //and we cannot be done before being registered
+        if (! AddInFlight(msg)){
+            //somebody else was faster - wait for this one
+            RenderMessage *other=FindInFlight(set,msg->GetTile().GetCacheKey(),sequence);
+            if (other != NULL){
+                msg->Unref();
+                msg=other;
+                isLeader=false;
+            }
+            //otherwise the entry is from another set or settings sequence
+            //we render without being registered
+        }
+        if (isLeader){
+            bool queued=false;
+            if (workers != NULL){
+                queued=workers->Enqueue(msg);
+            }
+            if (!queued && !queue->Enqueue(msg,timeout,forCache)){
+                LOG_DEBUG(wxT("queue full for %s"),tile.ToString(true));
+                RemoveInFlight(msg);
+                msg->Unref(); //our own
+                return RENDER_QUEUE;
+            }
+        }
+    }
+    if (! isLeader){
+        msg->AddWaiter();
+        LOG_DEBUG(_T("render tile %s - %s coalesced"),tile.ToString(),(forCache?"prefill":"request"));
+        if (! forCache && msg->GetMetaSize() == 1) msg->ClearPrefill();
+        queue->Promote(msg,priority,renderTimeout);
+        if (set->cache != NULL) set->cache->CountCoalesced(forCache);
+    }
+    bool rt=WaitForRender(msg,clientSocket);
+    //a demoted message stays registered until it is finished
+    if (isLeader && ! msg->IsDemoted()) RemoveInFlight(msg);
     if (! rt) {
+        //let the main thread know that we are not interested any more
+        msg->GiveUp();
         LOG_ERROR(_T("render timeout for %s"),tile.ToString(true));
         msg->Unref();
         return RENDER_FAIL;
@@ -411,10 +802,14 @@ Renderer::RenderResult Renderer::renderTile(ChartSet *set,TileInfo &tile,CacheEn
     wxColor back;
     GetGlobalColor(_T("NODTA"), &back);
     bool isNew=msg->CreateFinalResult(back);
-    out=msg->GetCacheResult();
+    out=msg->GetCacheResult(&tile);
+    if (out == NULL){
+        LOG_ERROR(_T("render result missing for %s"),tile.ToString(true));
+        msg->Unref();
+        return RENDER_FAIL;
+    }
     if (isNew){
-        if (forCache) out->prefill=true;
-        if (set->cache != NULL) set->cache->AddEntry(out);
+        StoreInCache(msg);
     }
     if (! forCache){
         out->prefill=false; //was a real render request - but could have been late hit
@@ -430,6 +825,27 @@ Renderer::RenderResult Renderer::renderTile(ChartSet *set,TileInfo &tile,CacheEn
     
 }
 
+Renderer::RenderResult Renderer::RenderRaw(ChartSet *set,TileInfo &tile,unsigned char *out){
+    set->SetTileCacheKey(tile);
+    RenderMessage *msg=new RenderMessage(tile,set,
+            this,manager->GetSettings()->GetCurrentSequence());
+    if (! PrepareRenderMessage(set,tile,msg))return RENDER_NOCHART;
+    if (!queue->Enqueue(msg,renderTimeout)){
+        msg->Unref(); //our own
+        return RENDER_QUEUE;
+    }
+    bool rt=msg->WaitForResult(renderTimeout);
+    if (! rt || ! msg->IsOk() || msg->GetRenderResult() == NULL) {
+        LOG_ERROR(_T("raw render failed for %s"),tile.ToString(true));
+        msg->Unref();
+        return RENDER_FAIL;
+    }
+    memcpy(out,msg->GetRenderResult(),TILE_SIZE*TILE_SIZE*3);
+    LOG_DEBUG(_T("raw render %s: %s"),tile.ToString(true),msg->GetTimings());
+    msg->Unref();
+    return RENDER_OK;
+}
+
 bool objectDescriptionSort(ObjectDescription first, ObjectDescription second){
     //1.we prefer points
     //2.we sort by distance
@@ -556,11 +972,14 @@ wxString Renderer::FeatureRequest(
     FeatureInfoMessage *msg=new FeatureInfoMessage(tile,set,
             this,manager->GetSettings()->GetCurrentSequence(),lat,lon,tolerance);
     if (! PrepareRenderMessage(set,tile,msg,true))return wxEmptyString;
+    msg->SetDeadline(800000);
+    msg->AddWaiter();
     if (!queue->Enqueue(msg,1000,false)){
         msg->Unref(); //our own
         return wxEmptyString;
     }
     bool rt=msg->WaitForResult(800000);
+    if (! rt) msg->GiveUp();
     if (! rt || ! msg->IsOk()) {
         LOG_ERROR(_T("%s failed for %s"),fct,tile.ToString());
         msg->Unref();
@@ -50,6 +50,13 @@ SettingsManager::SettingsManager(wxString configDir, wxString dataDir,wxString e
     baseScale=1.0;
     overZoom=4;
     underZoom=2;
+    variantSequence=0;
+    preparedSlot=0;
+    variantSlot=0;
+    variantUse=0;
+    for (int i=0;i<TileKey::NUM_GENERATIONS;i++){
+        slotUsed[i]=0;
+    }
 }
 
 
@@ -175,6 +182,56 @@ long SettingsManager::GetCurrentSequence() {
     return configSequence;
 }
 
+void SettingsManager::UpdateVariant(){
+    if (variantSequence == configSequence && preparedVariant != wxEmptyString) return;
+    MD5 md5;
+    if (! AddSettingsToMD5(&md5)) return;
+    variantSequence=configSequence;
+    wxString newVariant=md5.GetHex();
+    if (newVariant == preparedVariant) return;
+    preparedVariant=newVariant;
+    int slot=-1;
+    int oldest=0;
+    for (int i=0;i<TileKey::NUM_GENERATIONS;i++){
+        if (slotVariants[i] == preparedVariant){
+            slot=i;
+            break;
+        }
+        if (slotUsed[i] < slotUsed[oldest]) oldest=i;
+    }
+    if (slot < 0){
+        slot=oldest;
+        slotVariants[slot]=preparedVariant;
+    }
+    variantUse++;
+    slotUsed[slot]=variantUse;
+    preparedSlot=slot;
+}
+
+wxString SettingsManager::PrepareVariant(int &slot){
+    Synchronized locker(variantLock);
+    UpdateVariant();
+    slot=preparedSlot;
+    return preparedVariant;
+}
+
+void SettingsManager::PublishVariant(){
+    Synchronized locker(variantLock);
+    if (variant == preparedVariant) return;
+    variant=preparedVariant;
+    variantSlot=preparedSlot;
+    LOG_INFO(wxT("SettingsManager: settings variant %s, generation %d"),variant,preparedSlot);
+}
+
+wxString SettingsManager::GetVariant(){
+    Synchronized locker(variantLock);
+    return variant;
+}
+
+int SettingsManager::GetVariantSlot(){
+    return variantSlot;
+}
+
 
 
 bool SettingsManager::AddSettingsToMD5(MD5* md5){
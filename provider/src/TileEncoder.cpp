@@ -0,0 +1,473 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  PNG encoder for tiles
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2020 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+
+#include "TileEncoder.h"
+#include "Logger.h"
+#include "StringHelper.h"
+#include "SimpleThread.h"
+#include <zlib.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ENCODER_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define ENCODER_NEON
+#endif
+
+//if a tile has more colors that are not part of the color table
+//we assume it to be a raster chart or anti aliased and write RGB
+#define MAX_FOREIGN_COLORS 64
+#define MAX_PALETTE 256
+//open addressing table for palette lookup, must be a power of 2
+#define HASH_SIZE 1024
+
+#define RGB_KEY(p) ((((unsigned long)(p)[0]) << 16) | (((unsigned long)(p)[1]) << 8) | ((unsigned long)(p)[2]))
+
+static const unsigned char pngSignature[]={137,80,78,71,13,10,26,10};
+
+static inline void putUint32(unsigned char *p,unsigned long v){
+    p[0]=(v >> 24) & 0xff;
+    p[1]=(v >> 16) & 0xff;
+    p[2]=(v >> 8) & 0xff;
+    p[3]=v & 0xff;
+}
+
+class TileEncoder::Context{
+public:
+    Buffer      palette;
+    Buffer      indices;
+    Buffer      raw;
+    Buffer      candidate;
+    Buffer      out;
+    z_stream    stream;
+    bool        streamOk;
+    Context(){
+        memset(&stream,0,sizeof(stream));
+        streamOk=(deflateInit(&stream,Z_DEFAULT_COMPRESSION) == Z_OK);
+    }
+    ~Context(){
+        if (streamOk) deflateEnd(&stream);
+    }
+};
+
+static inline void appendBytes(std::vector<unsigned char> &out,const unsigned char *data,size_t len){
+    out.insert(out.end(),data,data+len);
+}
+
+static inline unsigned int hashColor(unsigned long key){
+    return ((key * 2654435761UL) >> 7) & (HASH_SIZE-1);
+}
+
+TileEncoder::TileEncoder() {
+    numContexts=0;
+    numPalette=0;
+    numRgb=0;
+    numForeign=0;
+    bytesPalette=0;
+    bytesRgb=0;
+}
+
+TileEncoder::~TileEncoder() {
+    for (size_t i=0;i<freeContexts.size();i++){
+        delete freeContexts[i];
+    }
+}
+
+TileEncoder::Context * TileEncoder::GetContext(){
+    {
+        Synchronized locker(statusLock);
+        if (freeContexts.size() > 0){
+            Context *rt=freeContexts.back();
+            freeContexts.pop_back();
+            return rt;
+        }
+        numContexts++;
+    }
+    return new Context();
+}
+
+void TileEncoder::ReleaseContext(Context* context){
+    Synchronized locker(statusLock);
+    freeContexts.push_back(context);
+}
+
+void TileEncoder::SetColorTable(ColorTable& table){
+    knownColors.clear();
+    ColorTable::iterator it;
+    for (it=table.begin();it != table.end();it++){
+        unsigned long key=(((unsigned long)it->second.Red()) << 16) |
+                (((unsigned long)it->second.Green()) << 8) |
+                ((unsigned long)it->second.Blue());
+        knownColors.insert(key);
+    }
+    LOG_INFO(wxT("TileEncoder: %d known colors"),(int)knownColors.size());
+}
+
+void TileEncoder::WriteChunk(Buffer& out, const char* type, const unsigned char* data, size_t len){
+    unsigned char buffer[8];
+    putUint32(buffer,len);
+    memcpy(buffer+4,type,4);
+    appendBytes(out,buffer,8);
+    unsigned long crc=crc32(0L,Z_NULL,0);
+    crc=crc32(crc,(const Bytef*)type,4);
+    if (len > 0){
+        appendBytes(out,data,len);
+        crc=crc32(crc,(const Bytef*)data,len);
+    }
+    putUint32(buffer,crc);
+    appendBytes(out,buffer,4);
+}
+
+void TileEncoder::WriteHeader(Buffer& out, int width, int height, int bitDepth, int colorType){
+    unsigned char header[13];
+    putUint32(header,width);
+    putUint32(header+4,height);
+    header[8]=bitDepth;
+    header[9]=colorType;
+    header[10]=0; //compression
+    header[11]=0; //filter
+    header[12]=0; //interlace
+    appendBytes(out,pngSignature,sizeof(pngSignature));
+    WriteChunk(out,"IHDR",header,sizeof(header));
+}
+
+/**
+ * compress the filtered image data directly into the IDAT chunk
+ */
+bool TileEncoder::WriteImageData(Context *context){
+    if (! context->streamOk){
+        LOG_ERROR(wxT("TileEncoder: no zlib stream"));
+        return false;
+    }
+    z_stream *stream=&context->stream;
+    if (deflateReset(stream) != Z_OK){
+        LOG_ERROR(wxT("TileEncoder: unable to reset zlib stream"));
+        return false;
+    }
+    Buffer &out=context->out;
+    size_t chunkStart=out.size();
+    uLong bound=deflateBound(stream,context->raw.size());
+    out.resize(chunkStart+8+bound);
+    memcpy(&out[chunkStart+4],"IDAT",4);
+    stream->next_in=&context->raw[0];
+    stream->avail_in=context->raw.size();
+    stream->next_out=&out[chunkStart+8];
+    stream->avail_out=bound;
+    int res=deflate(stream,Z_FINISH);
+    if (res != Z_STREAM_END){
+        LOG_ERROR(wxT("TileEncoder: compress failed with %d"),res);
+        return false;
+    }
+    size_t len=bound-stream->avail_out;
+    putUint32(&out[chunkStart],len);
+    unsigned long crc=crc32(0L,Z_NULL,0);
+    crc=crc32(crc,(const Bytef*)&out[chunkStart+4],len+4);
+    out.resize(chunkStart+8+len);
+    unsigned char crcBuffer[4];
+    putUint32(crcBuffer,crc);
+    appendBytes(out,crcBuffer,4);
+    WriteChunk(out,"IEND",NULL,0);
+    return true;
+}
+
+/**
+ * collect the colors of the tile
+ * index 0 is always the transparent color
+ * @return false if we should better write RGB
+ */
+bool TileEncoder::BuildPalette(Context *context,const unsigned char* rgb, int width, int height, int stride,
+        unsigned long transparent){
+    Buffer &palette=context->palette;
+    Buffer &indices=context->indices;
+    unsigned long keys[HASH_SIZE];
+    unsigned char values[HASH_SIZE];
+    bool used[HASH_SIZE];
+    memset(used,0,sizeof(used));
+    int numColors=0;
+    int numForeignColors=0;
+    palette.clear();
+    indices.resize(width*height);
+    unsigned int slot=hashColor(transparent);
+    used[slot]=true;
+    keys[slot]=transparent;
+    values[slot]=numColors++;
+    palette.push_back((transparent >> 16) & 0xff);
+    palette.push_back((transparent >> 8) & 0xff);
+    palette.push_back(transparent & 0xff);
+    unsigned long lastKey=transparent;
+    unsigned char lastIndex=0;
+    unsigned char *dst=&indices[0];
+    for (int y=0;y<height;y++){
+        const unsigned char *src=rgb+y*stride;
+        for (int x=0;x<width;x++,src+=3,dst++){
+            unsigned long key=RGB_KEY(src);
+            if (key == lastKey){
+                *dst=lastIndex;
+                continue;
+            }
+            slot=hashColor(key);
+            while (used[slot] && keys[slot] != key){
+                slot=(slot+1) & (HASH_SIZE-1);
+            }
+            if (! used[slot]){
+                if (numColors >= MAX_PALETTE) return false;
+                if (knownColors.find(key) == knownColors.end()){
+                    numForeignColors++;
+                    if (numForeignColors > MAX_FOREIGN_COLORS) return false;
+                }
+                used[slot]=true;
+                keys[slot]=key;
+                values[slot]=numColors++;
+                palette.push_back(src[0]);
+                palette.push_back(src[1]);
+                palette.push_back(src[2]);
+            }
+            lastKey=key;
+            lastIndex=values[slot];
+            *dst=lastIndex;
+        }
+    }
+    if (numForeignColors > 0){
+        Synchronized locker(statusLock);
+        numForeign++;
+    }
+    return true;
+}
+
+bool TileEncoder::EncodePalette(Context *context,int width, int height){
+    Buffer &palette=context->palette;
+    Buffer &indices=context->indices;
+    Buffer &out=context->out;
+    int numColors=palette.size()/3;
+    int bitDepth=8;
+    if (numColors <= 2) bitDepth=1;
+    else if (numColors <= 4) bitDepth=2;
+    else if (numColors <= 16) bitDepth=4;
+    int perByte=8/bitDepth;
+    int rowBytes=(width+perByte-1)/perByte;
+    //palette images compress best without filters
+    Buffer &raw=context->raw;
+    raw.assign((rowBytes+1)*height,0);
+    unsigned char *dst=&raw[0];
+    const unsigned char *src=&indices[0];
+    for (int y=0;y<height;y++){
+        *dst=0; //filter none
+        dst++;
+        if (bitDepth == 8){
+            memcpy(dst,src,width);
+            src+=width;
+        }
+        else{
+            for (int x=0;x<width;x++,src++){
+                int shift=8-bitDepth*(1+(x % perByte));
+                dst[x/perByte]|=(*src) << shift;
+            }
+        }
+        dst+=rowBytes;
+    }
+    WriteHeader(out,width,height,bitDepth,3);
+    WriteChunk(out,"PLTE",&palette[0],palette.size());
+    unsigned char alpha=0; //index 0 is transparent
+    WriteChunk(out,"tRNS",&alpha,1);
+    return WriteImageData(context);
+}
+
+static inline int paeth(int a,int b,int c){
+    int p=a+b-c;
+    int pa=abs(p-a);
+    int pb=abs(p-b);
+    int pc=abs(p-c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
+}
+
+bool TileEncoder::EncodeRgb(Context *context,const unsigned char* rgb, int width, int height, int stride,
+        unsigned long transparent){
+    int rowBytes=width*3;
+    Buffer &out=context->out;
+    Buffer &raw=context->raw;
+    raw.resize((rowBytes+1)*height);
+    Buffer &candidate=context->candidate;
+    candidate.resize(rowBytes);
+    //adaptive filtering: choose the filter with the lowest sum of absolute values
+    for (int y=0;y<height;y++){
+        const unsigned char *cur=rgb+y*stride;
+        const unsigned char *prev=(y > 0)?rgb+(y-1)*stride:NULL;
+        unsigned char *dst=&raw[y*(rowBytes+1)];
+        long bestSum=-1;
+        for (int filter=0;filter<5;filter++){
+            if (prev == NULL && filter >= 2) break;
+            long sum=0;
+            for (int i=0;i<rowBytes;i++){
+                int a=(i >= 3)?cur[i-3]:0;
+                int b=prev?prev[i]:0;
+                int c=(prev && i >= 3)?prev[i-3]:0;
+                unsigned char v=cur[i];
+                switch(filter){
+                    case 1: v=cur[i]-a; break;
+                    case 2: v=cur[i]-b; break;
+                    case 3: v=cur[i]-((a+b)/2); break;
+                    case 4: v=cur[i]-paeth(a,b,c); break;
+                    default: break;
+                }
+                candidate[i]=v;
+                sum+=(v < 128)?v:256-v;
+            }
+            if (bestSum < 0 || sum < bestSum){
+                bestSum=sum;
+                dst[0]=filter;
+                memcpy(dst+1,&candidate[0],rowBytes);
+            }
+        }
+    }
+    WriteHeader(out,width,height,8,2);
+    unsigned char trns[6];
+    trns[0]=0;
+    trns[1]=(transparent >> 16) & 0xff;
+    trns[2]=0;
+    trns[3]=(transparent >> 8) & 0xff;
+    trns[4]=0;
+    trns[5]=transparent & 0xff;
+    WriteChunk(out,"tRNS",trns,sizeof(trns));
+    return WriteImageData(context);
+}
+
+bool TileEncoder::Encode(const unsigned char* rgb, int width, int height, int stride,
+        const wxColor& transparent, unsigned char *&result, size_t &len){
+    if (rgb == NULL || width < 1 || height < 1) return false;
+    unsigned long transparentKey=(((unsigned long)transparent.Red()) << 16) |
+                (((unsigned long)transparent.Green()) << 8) |
+                ((unsigned long)transparent.Blue());
+    Context *context=GetContext();
+    context->out.clear();
+    bool isPalette=BuildPalette(context,rgb,width,height,stride,transparentKey);
+    bool rt=false;
+    if (isPalette){
+        rt=EncodePalette(context,width,height);
+    }
+    else{
+        rt=EncodeRgb(context,rgb,width,height,stride,transparentKey);
+    }
+    if (rt){
+        len=context->out.size();
+        result=(unsigned char *)malloc(len);
+        if (result == NULL){
+            rt=false;
+        }
+        else{
+            memcpy(result,&context->out[0],len);
+        }
+    }
+    ReleaseContext(context);
+    if (! rt) return false;
+    Synchronized locker(statusLock);
+    if (isPalette){
+        numPalette++;
+        bytesPalette+=len;
+    }
+    else{
+        numRgb++;
+        bytesRgb+=len;
+    }
+    return true;
+}
+
+bool TileEncoder::IsUniform(const unsigned char* rgb, int width, int height, int stride, unsigned long& color){
+    if (rgb == NULL || width < 1 || height < 1) return false;
+    color=RGB_KEY(rgb);
+    //16 pixels with 3 bytes are 3 vectors of 16 bytes
+    unsigned char pattern[48];
+    for (int i=0;i<48;i+=3){
+        pattern[i]=rgb[0];
+        pattern[i+1]=rgb[1];
+        pattern[i+2]=rgb[2];
+    }
+    int rowBytes=width*3;
+    int vectorBytes=rowBytes-(rowBytes % 48);
+#if defined(ENCODER_SSE2)
+    __m128i p0=_mm_loadu_si128((const __m128i*)pattern);
+    __m128i p1=_mm_loadu_si128((const __m128i*)(pattern+16));
+    __m128i p2=_mm_loadu_si128((const __m128i*)(pattern+32));
+#elif defined(ENCODER_NEON)
+    uint8x16_t p0=vld1q_u8(pattern);
+    uint8x16_t p1=vld1q_u8(pattern+16);
+    uint8x16_t p2=vld1q_u8(pattern+32);
+#else
+    vectorBytes=0;
+#endif
+    for (int y=0;y<height;y++){
+        const unsigned char *row=rgb+y*stride;
+        int i=0;
+#if defined(ENCODER_SSE2)
+        for (;i<vectorBytes;i+=48){
+            __m128i c0=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row+i)),p0);
+            __m128i c1=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row+i+16)),p1);
+            __m128i c2=_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(row+i+32)),p2);
+            __m128i all=_mm_and_si128(_mm_and_si128(c0,c1),c2);
+            if (_mm_movemask_epi8(all) != 0xffff) return false;
+        }
+#elif defined(ENCODER_NEON)
+        for (;i<vectorBytes;i+=48){
+            uint8x16_t c0=vceqq_u8(vld1q_u8(row+i),p0);
+            uint8x16_t c1=vceqq_u8(vld1q_u8(row+i+16),p1);
+            uint8x16_t c2=vceqq_u8(vld1q_u8(row+i+32),p2);
+            uint8x16_t all=vandq_u8(vandq_u8(c0,c1),c2);
+            uint8x8_t folded=vand_u8(vget_low_u8(all),vget_high_u8(all));
+            if (vget_lane_u64(vreinterpret_u64_u8(folded),0) != 0xffffffffffffffffULL) return false;
+        }
+#endif
+        for (;i<rowBytes;i+=48){
+            int len=rowBytes-i;
+            if (len > 48) len=48;
+            if (memcmp(row+i,pattern,len) != 0) return false;
+        }
+    }
+    return true;
+}
+
+wxString TileEncoder::ToJson(){
+    Synchronized locker(statusLock);
+    return wxString::Format(wxT("{"
+        JSON_IV(knownColors,%ld) ",\n"
+        JSON_IV(contexts,%lu) ",\n"
+        JSON_IV(palette,%lu) ",\n"
+        JSON_IV(paletteForeignColors,%lu) ",\n"
+        JSON_IV(paletteAvgBytes,%llu) ",\n"
+        JSON_IV(rgb,%lu) ",\n"
+        JSON_IV(rgbAvgBytes,%llu) "\n"
+        "}"),
+        (long)knownColors.size(),
+        numContexts,
+        numPalette,
+        numForeign,
+        numPalette?bytesPalette/numPalette:0ULL,
+        numRgb,
+        numRgb?bytesRgb/numRgb:0ULL
+    );
+}
@@ -46,6 +46,10 @@
 #include <algorithm>
 //bytes per pixel
 #define BPI 3
+//average size of a tile in kb (for the cache size if no memory limit is given)
+#define AVERAGE_TILE_KB 3
+//percentage of the memory limit (parameter x) that can be used for the tile cache
+#define CACHE_BUDGET_PERCENT 25
 #include "pluginmanager.h"
 #include "ChartInfo.h"
 #include "ChartList.h"
@@ -75,6 +79,7 @@
 #include "S57AttributeDecoder.h"
 #include "TestHelper.h"
 #include "Version.h"
+#include "RenderWorker.h"
 
 
 
@@ -126,6 +131,11 @@ static const wxCmdLineEntryDesc g_cmdLineDesc [] = {
     {wxCMD_LINE_SWITCH,"n", "noChartScan","use chart cache info if available (fast start)"},
     {wxCMD_LINE_OPTION,"o", "openCpnConfig","parse this OpenCPN config for chart sets",wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL},
     {wxCMD_LINE_OPTION,"w","waitTime", "render timeout in ms (default: 8000)", wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL},
+    {wxCMD_LINE_OPTION,"j","renderWorkers", "number of render worker processes (default: 0 - render in main process)", wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL},
+    {wxCMD_LINE_OPTION,"b","metaTile", "metatile size for prefill and render hints 1,2,4 (default: 1)", wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL},
+    {wxCMD_LINE_OPTION,"y","syncInterval", "seconds between syncs of the disk cache, 0: sync after each write (default: 30)", wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL},
+    {wxCMD_LINE_OPTION,"i","diskWriteRate", "max kb/s written to the disk caches of all chart sets, 0: no limit (default: 0)", wxCMD_LINE_VAL_NUMBER, wxCMD_LINE_PARAM_OPTIONAL},
+    {wxCMD_LINE_OPTION,"k","workerSpec", "internal: run as render worker", wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_OPTIONAL|wxCMD_LINE_HIDDEN},
     
     {wxCMD_LINE_PARAM, NULL, NULL, "", wxCMD_LINE_VAL_STRING, wxCMD_LINE_PARAM_MULTIPLE},
     { wxCMD_LINE_NONE}
@@ -213,6 +223,11 @@ private:
     long maxLogLines=50000;
     long maxPrefillZoom=17;
     bool useChartCache=false;
+    long renderWorkers=0;
+    long metaTileSize=1;
+    long syncInterval=30;
+    long diskWriteRate=0;
+    wxString workerSpec=wxEmptyString; //if set we are a render worker
     ExtensionList extensions={{"*.OESENC",{}},{"*.OESU",{}},{"*.OERNC",{true}}};
     ChartManager *chartManager;
     wxString privateDataDir=wxT("~/.opencpn/");
@@ -258,6 +273,11 @@ public:
         parser.Found("u",&uploadDir);
         parser.Found("o",&openCPNConfig);
         parser.Found("w",&renderTimeout);
+        parser.Found("j",&renderWorkers);
+        parser.Found("b",&metaTileSize);
+        parser.Found("y",&syncInterval);
+        parser.Found("i",&diskWriteRate);
+        parser.Found("k",&workerSpec);
         useChartCache=parser.Found("n");
         if (scaleLevel < 0.1 || scaleLevel > 10){
             LOG_ERRORC(_T("invalid scale level %lf"),scaleLevel);
@@ -276,6 +296,22 @@ public:
                 exit(1);
             }
         }
+        if (renderWorkers < 0 || renderWorkers > 16){
+            LOG_ERRORC(wxT("invalid number of render workers %ld, allowed are 0...16"),renderWorkers);
+            exit(1);
+        }
+        if (metaTileSize != 1 && metaTileSize != 2 && metaTileSize != 4){
+            LOG_ERRORC(wxT("invalid metatile size %ld, allowed are 1,2,4"),metaTileSize);
+            exit(1);
+        }
+        if (syncInterval < 0){
+            LOG_ERRORC(wxT("invalid sync interval %ld"),syncInterval);
+            exit(1);
+        }
+        if (diskWriteRate < 0){
+            LOG_ERRORC(wxT("invalid disk write rate %ld"),diskWriteRate);
+            exit(1);
+        }
         if (maxPrefillZoom < 0 || maxPrefillZoom > MAX_ZOOM){
             LOG_ERRORC(wxT("invalid prefillZoom %ld, allowed are 0...&d"),maxPrefillZoom,MAX_ZOOM);
             exit(1);
@@ -429,6 +465,39 @@ private:
         }
 
     };
+    /**
+     * the command line options for our render workers
+     * (without the log file and the worker spec)
+     * the memory limit is split between the main process and the workers
+     */
+    wxArrayString getWorkerArgs(){
+        wxArrayString rt;
+        rt.Add(wxT("-d"));
+        rt.Add(wxString::Format(wxT("%ld"),debugLevel));
+        rt.Add(wxT("-m"));
+        rt.Add(wxString::Format(wxT("%ld"),maxLogLines));
+        rt.Add(wxT("-s"));
+        rt.Add(wxString::Format(wxT("%f"),scaleLevel));
+        rt.Add(wxT("-w"));
+        rt.Add(wxString::Format(wxT("%ld"),renderTimeout));
+        rt.Add(wxT("-e"));
+        rt.Add(exePath);
+        rt.Add(wxT("-u"));
+        rt.Add(uploadDir);
+        rt.Add(wxT("-p"));
+        rt.Add(wxString::Format(wxT("%ld"),(long)getpid()));
+        if (openCPNConfig != wxEmptyString){
+            rt.Add(wxT("-o"));
+            rt.Add(openCPNConfig);
+        }
+        if (memsizePercent > 0){
+            long workerPercent=memsizePercent/(renderWorkers+1);
+            if (workerPercent < 2) workerPercent=2;
+            rt.Add(wxT("-x"));
+            rt.Add(wxString::Format(wxT("%ld"),workerPercent));
+        }
+        return rt;
+    }
     wxFileConfig * OpenChartInfoCache(wxString configDir,bool forReading){
        wxFileName fn(configDir,wxT("chartinfocache.conf"));
        if (forReading && !fn.FileExists()) return NULL;
@@ -501,7 +570,7 @@ private:
         return rt;
     }
     int run(wxArrayString args) {
-       
+        bool isWorker=(workerSpec != wxEmptyString);
         int argc = args.GetCount();
         if ((argc) < 4) {
             LOG_ERRORC(_T("usage: XXX plugindir datadir configdir port [chart]..."));
@@ -575,7 +644,7 @@ private:
                         uploadChartList.Add(localFile);
                     } 
                 }
-                else{
+                else if (! isWorker){
                     LOG_INFO(wxT("Removing temp chart dir %s"),localFile);
                     wxFileName::Rmdir(localFile,wxPATH_RMDIR_FULL|wxPATH_RMDIR_RECURSIVE);
                 }
@@ -623,26 +692,34 @@ private:
             LOG_ERRORC(wxT("config file not found, unable to continue"));
             exit(1);
         }
-        ChartSetInfo::WriteEulasToConfig(config,&infos);
-        int debuglevel=0;
-        if (Logger::instance()->HasLevel(LOG_LEVEL_DEBUG)) debuglevel=1;
-        config->SetPath( _T("/PlugIns/oesenc") );
-        LOG_INFO(wxT("setting plugin debug to %d"),debuglevel);
-        config->Write( _T("DEBUG_LEVEL"),debuglevel);
-        config->SetPath( _T("/PlugIns/ocharts") );
-        LOG_INFO(wxT("setting plugin debug to %d"),debuglevel);
-        config->Write( _T("DEBUG_LEVEL"),debuglevel);
-        config->SetPath( _T("/PlugIns/ocharts/oesenc") );
-        config->Write( _T("DEBUG_LEVEL"),debuglevel);
-        if (!config->Flush()){
-            LOG_ERRORC(wxT("unable to write to config"));
-            exit(1);
+        if (! isWorker){
+            //workers use the config as written by the main process
+            ChartSetInfo::WriteEulasToConfig(config,&infos);
+            int debuglevel=0;
+            if (Logger::instance()->HasLevel(LOG_LEVEL_DEBUG)) debuglevel=1;
+            config->SetPath( _T("/PlugIns/oesenc") );
+            LOG_INFO(wxT("setting plugin debug to %d"),debuglevel);
+            config->Write( _T("DEBUG_LEVEL"),debuglevel);
+            config->SetPath( _T("/PlugIns/ocharts") );
+            LOG_INFO(wxT("setting plugin debug to %d"),debuglevel);
+            config->Write( _T("DEBUG_LEVEL"),debuglevel);
+            config->SetPath( _T("/PlugIns/ocharts/oesenc") );
+            config->Write( _T("DEBUG_LEVEL"),debuglevel);
+            if (!config->Flush()){
+                LOG_ERRORC(wxT("unable to write to config"));
+                exit(1);
+            }
         }
         
         //start up web server
         TokenHandler *tokenHandler=new TokenHandler("all");
         MainQueue mainQueue;
+        statusCollector.AddItem("mainQueue",&mainQueue);
         Renderer::CreateInstance(chartManager,&mainQueue,renderTimeout);
+        Renderer::Instance()->SetMetaTileSize(metaTileSize);
+        Renderer::Instance()->GetEncoder()->SetColorTable(currentTable);
+        statusCollector.AddItem("encoder",Renderer::Instance()->GetEncoder());
+        statusCollector.AddItem("pixelBuffers",Renderer::Instance()->GetPixelPool());
         LOG_INFO(_T("starting HTTP server on port %d"), port);
         HTTPServer webServer(port,maxThreads);
         webServer.AddHandler(new ListRequestHandler(chartManager));
@@ -705,6 +782,9 @@ private:
             LOG_ERRORC("no chart handlers loaded, exiting");
         }
         webServer.AddHandler(new SettingsRequestHandler(chartManager,&mainQueue,&fprProvider));
+        if (isWorker){
+            return runWorker(&settings,&mainQueue,uploadChartList,chartlist);
+        }
         if (!webServer.Start()) {
             LOG_ERRORC(_T("unable to start server at port %d"), port);
             return 1;
@@ -714,11 +794,17 @@ private:
         settings.StoreBaseSettings(true);
         //compute active/disabled sets
         chartManager->ComputeActiveSets();
-        chartManager->StartCaches(privateDataDir,cacheSize,fileCacheSize);
         int systemKb;
+        SystemHelper::GetMemInfo(&systemKb,NULL);
+        long cacheBudgetKb=cacheSize*AVERAGE_TILE_KB;
+        if (memsizePercent > 0 && systemKb > 0){
+            //the tile cache of all sets gets a fixed part of our memory limit
+            cacheBudgetKb=(long)systemKb*memsizePercent/100*CACHE_BUDGET_PERCENT/100;
+        }
+        CacheReaderWriter::SetSyncInterval(syncInterval);
+        chartManager->StartCaches(privateDataDir,cacheSize,fileCacheSize,cacheBudgetKb,diskWriteRate);
         int chartCacheKb=100000+chartManager->GetMaxCacheSizeKb();
         int minChartCacheDb=150000;
-        SystemHelper::GetMemInfo(&systemKb,NULL);
         int memAvail=SystemHelper::GetAvailableMemoryKb()*90/100;
         int memoryLimit=0;
         if (memsizePercent > 0){
@@ -795,6 +881,18 @@ private:
         int ourKb=0;
         SystemHelper::GetMemInfo(NULL,&ourKb);
         LOG_INFO(wxT("memory after reading charts: %dkb"),ourKb);
+        RenderWorkerPool *workers=NULL;
+        if (renderWorkers > 0){
+            workers=new RenderWorkerPool(renderWorkers,
+                    wxStandardPaths::Get().GetExecutablePath(),
+                    getWorkerArgs(),
+                    myArgs,
+                    logFile,
+                    chartManager,&mainQueue,renderTimeout);
+            statusCollector.AddItem("renderWorkers",workers);
+            Renderer::Instance()->SetWorkers(workers);
+            workers->Start();
+        }
         
         ChartSetInfoList handledSets;
         chartSets=chartManager->GetChartSets();
@@ -814,6 +912,10 @@ private:
         tokenHandler->stop();
         tokenHandler->join();
         webServer.Stop();
+        if (workers != NULL){
+            Renderer::Instance()->SetWorkers(NULL);
+            workers->Stop();
+        }
         chartManager->Stop();
         shutdownPlugins();
         LOG_INFOC(wxT("exiting"));
@@ -821,6 +923,60 @@ private:
         return 0;
     }
 
+    /**
+     * the remaining part of run for a render worker process
+     * we read our charts (preferrably from the chart info cache)
+     * and render the requests from our parent
+     * no HTTP server, no caches, no filler
+     */
+    int runWorker(SettingsManager *settings,MainQueue *mainQueue,
+            wxArrayString &uploadChartList,wxArrayString &chartlist){
+        LOG_INFO(wxT("starting as render worker %s"),workerSpec);
+        settings->StoreBaseSettings(true);
+        chartManager->ComputeActiveSets();
+        int memoryLimit=150000;
+        int systemKb;
+        SystemHelper::GetMemInfo(&systemKb,NULL);
+        if (memsizePercent > 0 && systemKb > 0){
+            memoryLimit=systemKb*memsizePercent/100;
+        }
+        bool mustReadCharts=true;
+        wxFileConfig *readCache=OpenChartInfoCache(privateDataDir,true);
+        if (readCache != NULL){
+            mustReadCharts=chartManager->ReadChartInfoCache(readCache,memoryLimit);
+            delete readCache;
+        }
+        else{
+            ChartSetMap *chartSets=chartManager->GetChartSets();
+            ChartSetMap::iterator it;
+            for (it=chartSets->begin();it != chartSets->end();it++){
+                if (it->second->IsEnabled())it->second->StartParsing();
+            }
+        }
+        if (mustReadCharts){
+            for (size_t i = 0; i < uploadChartList.Count(); i++) {
+                chartlist.Add(uploadChartList.Item(i));
+            }
+            chartManager->ReadCharts(chartlist, memoryLimit);
+        }
+        LOG_INFO(wxT("render worker loaded %d charts"), chartManager->GetNumCharts());
+        RenderWorkerChild child(workerSpec,chartManager,mainQueue);
+        if (! child.IsOk()){
+            LOG_ERRORC(wxT("invalid worker spec %s"),workerSpec);
+            return 1;
+        }
+        child.start();
+        Thread waiter(new StopHandler(NULL,parentPid,mainQueue));
+        waiter.start();
+        waiter.detach();
+        mainQueue->Loop(this);
+        child.stop();
+        child.join();
+        shutdownPlugins();
+        LOG_INFO(wxT("render worker exiting"));
+        Logger::instance()->Flush();
+        return 0;
+    }
     
 };
 wxIMPLEMENT_APP(AvNavProvider);
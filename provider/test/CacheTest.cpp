@@ -0,0 +1,346 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Tests for the tile cache files and metatile prefill checks
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2010 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+#include <wx/file.h>
+#include <string.h>
+#include <vector>
+#include "UnitTest.h"
+#include "CacheHandler.h"
+#include "CacheFiller.h"
+#include "ChartSet.h"
+#include "SettingsManager.h"
+#include "MD5.h"
+
+//the file layouts must match CacheHandler.cpp
+typedef struct{
+    char            magic[8];
+    char            headerLen;
+    unsigned int    version;
+    char            token[MD5_LEN*2];
+} TestFileHeader;
+
+//version 3 records
+typedef struct{
+    char            magic[4];
+    unsigned char   headerLen;
+    unsigned int    version;
+    unsigned int    dataLen;
+    MD5Name         name;
+} TestLegacyRecord;
+
+typedef struct{
+    char            magic[8];
+    unsigned int    version;
+    char            token[MD5_LEN*2];
+    unsigned long long sequence;
+    long long       dataEnd;
+    long long       lastRecord;
+    unsigned long long lastKey;
+    unsigned int    numEntries;
+    unsigned int    numDedup;
+    unsigned int    numSegments;
+    unsigned int    checksum;
+} TestIndexHeader;
+
+#define TEST_HASH "0123456789abcdef0123456789abcdef"
+#define TEST_RECORDS 4
+
+static wxString baseDir;
+
+static MD5Name legacyName(int i){
+    unsigned char name[MD5_LEN];
+    memset(name,0,MD5_LEN);
+    name[0]=0x55;
+    name[1]=i;
+    return MD5Name(name);
+}
+
+static TileKey tileKey(int i){
+    return TileKey(1,0,10,i,0);
+}
+
+static size_t tileLen(int i){
+    return 100+i;
+}
+
+class TestResolver : public LegacyKeyResolver{
+public:
+    KeyMap  known;
+    virtual long ResolveLegacyKeys(const NameSet &names,KeyMap &keys,long maxTiles){
+        NameSet::const_iterator it;
+        for (it=names.begin();it != names.end();it++){
+            KeyMap::iterator found=known.find(*it);
+            if (found != known.end()) keys[*it]=found->second.TilePart();
+        }
+        return keys.size();
+    }
+};
+
+static bool writeLegacyFile(wxString fileName){
+    wxFile out(fileName,wxFile::write);
+    if (! out.IsOpened()) return false;
+    TestFileHeader header;
+    memcpy(header.magic,"AVOCACHE",sizeof(header.magic));
+    header.headerLen=sizeof(header);
+    header.version=3;
+    memcpy(header.token,TEST_HASH,sizeof(header.token));
+    if (out.Write(&header,sizeof(header)) != sizeof(header)) return false;
+    for (int i=0;i<TEST_RECORDS;i++){
+        TestLegacyRecord record;
+        memcpy(record.magic,"AVOR",sizeof(record.magic));
+        record.headerLen=sizeof(record);
+        record.version=3;
+        record.dataLen=tileLen(i);
+        record.name=legacyName(i);
+        if (out.Write(&record,sizeof(record)) != sizeof(record)) return false;
+        std::vector<unsigned char> data(tileLen(i),(unsigned char)i);
+        if (out.Write(data.data(),data.size()) != data.size()) return false;
+    }
+    return out.Close();
+}
+
+static bool hasTileData(CacheHandler &handler,int i){
+    CacheEntry *entry=handler.FindEntry(tileKey(i),true);
+    if (entry == NULL) return false;
+    bool rt=(entry->GetLength() == tileLen(i));
+    for (size_t k=0;rt && k<tileLen(i);k++){
+        if (entry->GetData()[k] != (unsigned char)i) rt=false;
+    }
+    entry->Unref();
+    return rt;
+}
+
+/**
+ * version 3 files (single file, MD5 names) are converted,
+ * records that cannot be resolved are dropped
+ */
+static void testMigrateLegacy(){
+    wxString dir=testDir(baseDir,wxT("migrate"));
+    wxString cacheFile=wxFileName(dir,wxT("legacy.avcache")).GetFullPath();
+    CHECK(writeLegacyFile(cacheFile));
+    TestResolver resolver;
+    for (int i=0;i<TEST_RECORDS-1;i++){
+        resolver.known[legacyName(i)]=tileKey(i);
+    }
+    CacheHandler handler(wxT("legacy"),100,1000);
+    CacheReaderWriter *rdwr=new CacheReaderWriter(cacheFile,wxString(TEST_HASH),&handler,1000,&resolver);
+    rdwr->start();
+    rdwr->join();
+    CHECK(rdwr->GetState() == CacheReaderWriter::STATE_WRITING);
+    CHECK(rdwr->ToJson().Find(wxString::Format(wxT("\"migrated\":%d"),TEST_RECORDS-1)) != wxNOT_FOUND);
+    CHECK(! wxFileExists(cacheFile));
+    CHECK(wxFileExists(CacheReaderWriter::SegmentFileName(cacheFile,0)));
+    CHECK(handler.CurrentDiskEntries() == TEST_RECORDS-1);
+    for (int i=0;i<TEST_RECORDS-1;i++){
+        CHECK(handler.HasDiskEntry(tileKey(i)));
+        CHECK(hasTileData(handler,i));
+    }
+    CHECK(! handler.HasDiskEntry(tileKey(TEST_RECORDS-1)));
+    rdwr->stop();
+    rdwr->Finish();
+    delete rdwr;
+    CHECK(CacheReaderWriter::CountEntries(cacheFile) == TEST_RECORDS-1);
+    //the converted file is read again without conversion
+    CacheHandler reread(wxT("legacy"),100,1000);
+    rdwr=new CacheReaderWriter(cacheFile,wxString(TEST_HASH),&reread,1000);
+    rdwr->start();
+    rdwr->join();
+    CHECK(reread.CurrentDiskEntries() == TEST_RECORDS-1);
+    CHECK(hasTileData(reread,0));
+    rdwr->stop();
+    rdwr->Finish();
+    delete rdwr;
+}
+
+/**
+ * a single file of the current version (from before the segments)
+ * is used as the first segment
+ */
+static void testAdoptSingleFile(){
+    wxString dir=testDir(baseDir,wxT("single"));
+    wxString cacheFile=wxFileName(dir,wxT("single.avcache")).GetFullPath();
+    CacheHandler writer(wxT("single"),100,1000);
+    CacheReaderWriter *rdwr=new CacheReaderWriter(cacheFile,wxString(TEST_HASH),&writer,1000);
+    rdwr->start();
+    rdwr->join();
+    for (int i=0;i<TEST_RECORDS;i++){
+        unsigned char *data=(unsigned char *)malloc(tileLen(i));
+        memset(data,i,tileLen(i));
+        CacheEntry *entry=new CacheEntry(tileKey(i),data,tileLen(i));
+        writer.AddEntry(entry);
+        entry->Unref();
+    }
+    rdwr->stop();
+    rdwr->Finish();
+    delete rdwr;
+    CHECK(CacheReaderWriter::CountEntries(cacheFile) == TEST_RECORDS);
+    CHECK(wxRenameFile(CacheReaderWriter::SegmentFileName(cacheFile,0),cacheFile));
+    CHECK(wxRemoveFile(CacheReaderWriter::IndexFileName(cacheFile)));
+    CacheHandler reader(wxT("single"),100,1000);
+    rdwr=new CacheReaderWriter(cacheFile,wxString(TEST_HASH),&reader,1000);
+    rdwr->start();
+    rdwr->join();
+    CHECK(! wxFileExists(cacheFile));
+    CHECK(wxFileExists(CacheReaderWriter::SegmentFileName(cacheFile,0)));
+    CHECK(reader.CurrentDiskEntries() == TEST_RECORDS);
+    for (int i=0;i<TEST_RECORDS;i++){
+        CHECK(hasTileData(reader,i));
+    }
+    rdwr->stop();
+    rdwr->Finish();
+    delete rdwr;
+}
+
+static SettingsManager *createSettings(wxString dir){
+    wxFile config(wxFileName(dir,wxT("avnav.conf")).GetFullPath(),wxFile::write);
+    config.Write(wxT("[Settings]\nTest=1\n"));
+    config.Close();
+    SettingsManager *rt=new SettingsManager(dir,dir,dir);
+    int slot=0;
+    rt->PrepareVariant(slot);
+    rt->PublishVariant();
+    return rt;
+}
+
+static bool writeIndex(wxString cacheFile,unsigned int numEntries,long age){
+    wxString indexFile=CacheReaderWriter::IndexFileName(cacheFile);
+    wxFile out(indexFile,wxFile::write);
+    if (! out.IsOpened()) return false;
+    TestIndexHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,"AVOINDEX",sizeof(header.magic));
+    header.version=6;
+    memcpy(header.token,TEST_HASH,sizeof(header.token));
+    header.numEntries=numEntries;
+    if (out.Write(&header,sizeof(header)) != sizeof(header)) return false;
+    out.Close();
+    wxFile segment(CacheReaderWriter::SegmentFileName(cacheFile,0),wxFile::write);
+    segment.Close();
+    wxDateTime modified=wxDateTime::Now()-wxTimeSpan::Seconds(age);
+    return wxFileName(indexFile).SetTimes(NULL,&modified,NULL) &&
+        wxFileName(CacheReaderWriter::SegmentFileName(cacheFile,0)).SetTimes(NULL,&modified,NULL);
+}
+
+static bool hasVariant(wxString cacheFile){
+    return wxFileExists(CacheReaderWriter::IndexFileName(cacheFile)) ||
+        wxFileExists(CacheReaderWriter::SegmentFileName(cacheFile,0));
+}
+
+/**
+ * the cache files of other settings variants share the disk entries
+ * with the current one, the oldest are removed first
+ */
+static void testEvictVariants(){
+    wxString dir=testDir(baseDir,wxT("variants"));
+    SettingsManager *settings=createSettings(dir);
+    CHECK(settings->GetVariant() != wxEmptyString);
+    ChartSetInfo info;
+    info.name=wxT("evict");
+    ChartSet set(info,settings);
+    wxString newest=wxFileName(dir,wxT("evict.aaaaaaaa.avcache")).GetFullPath();
+    wxString older=wxFileName(dir,wxT("evict.bbbbbbbb.avcache")).GetFullPath();
+    wxString oldest=wxFileName(dir,wxT("evict.cccccccc.avcache")).GetFullPath();
+    CHECK(writeIndex(newest,150,100));
+    CHECK(writeIndex(older,100,200));
+    CHECK(writeIndex(oldest,10,300));
+    //at least a third for the current variant: only the newest fits
+    set.CreateCache(dir,100,300);
+    CHECK(set.rdwr != NULL);
+    set.Stop();
+    CHECK(hasVariant(newest));
+    CHECK(! hasVariant(older));
+    CHECK(! hasVariant(oldest));
+    CHECK(set.rdwr->ToJson().Find(wxT("\"maxAllowed\":150")) != wxNOT_FOUND);
+    //removing the cache removes all variants
+    set.UpdateSettings(true);
+    set.Stop();
+    CHECK(! hasVariant(newest));
+}
+
+static void addTile(ChartSet &set,int zoom,int x,int y){
+    TileInfo tile(zoom,x,y,set.GetKey());
+    set.SetTileCacheKey(tile);
+    unsigned char *data=(unsigned char *)malloc(10);
+    memset(data,0,10);
+    CacheEntry *entry=new CacheEntry(tile.GetCacheKey(),data,10);
+    set.cache->AddEntry(entry);
+    entry->Unref();
+}
+
+/**
+ * access to the private helpers of the cache filler
+ */
+class CacheFillerTest{
+public:
+    static bool IsCached(ChartSet *set,TileInfo tile,int metaSize){
+        return CacheFiller::IsCached(set,tile,metaSize);
+    }
+};
+
+/**
+ * a prefill of a metatile is only skipped if all its tiles are cached
+ */
+static void testMetatileCached(){
+    wxString dir=testDir(baseDir,wxT("metatile"));
+    SettingsManager *settings=createSettings(dir);
+    ChartSetInfo info;
+    info.name=wxT("meta");
+    ChartSet set(info,settings);
+    set.cache=new CacheHandler(set.GetKey(),1000,0);
+    addTile(set,3,2,4);
+    addTile(set,3,3,4);
+    addTile(set,3,2,5);
+    CHECK(CacheFillerTest::IsCached(&set,TileInfo(3,2,4,set.GetKey()),1));
+    CHECK(! CacheFillerTest::IsCached(&set,TileInfo(3,3,5,set.GetKey()),1));
+    CHECK(! CacheFillerTest::IsCached(&set,TileInfo(3,2,4,set.GetKey()),2));
+    addTile(set,3,3,5);
+    CHECK(CacheFillerTest::IsCached(&set,TileInfo(3,2,4,set.GetKey()),2));
+    CHECK(CacheFillerTest::IsCached(&set,TileInfo(3,3,5,set.GetKey()),2));
+    //the next metatile is still missing
+    CHECK(! CacheFillerTest::IsCached(&set,TileInfo(3,4,4,set.GetKey()),2));
+    //metatiles at the border of small zoom levels only contain existing tiles
+    addTile(set,1,0,0);
+    addTile(set,1,1,0);
+    addTile(set,1,0,1);
+    CHECK(! CacheFillerTest::IsCached(&set,TileInfo(1,1,1,set.GetKey()),4));
+    addTile(set,1,1,1);
+    CHECK(CacheFillerTest::IsCached(&set,TileInfo(1,1,1,set.GetKey()),4));
+}
+
+int main(int argc,char **argv){
+    wxInitializer initializer;
+    if (! initializer.IsOk()){
+        fprintf(stderr,"unable to initialize wx\n");
+        return 1;
+    }
+    baseDir=testDir((argc > 1)?wxString(argv[1]):wxString(),wxT("CacheTest"));
+    Logger::CreateInstance(wxFileName(baseDir,wxT("test.log")).GetFullPath());
+    runTest("migrateLegacy",testMigrateLegacy);
+    runTest("adoptSingleFile",testAdoptSingleFile);
+    runTest("evictVariants",testEvictVariants);
+    runTest("metatileCached",testMetatileCached);
+    return testResult();
+}
@@ -0,0 +1,193 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Tests for tile coverage and chart coverage polygons
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2010 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+#include "UnitTest.h"
+#include "ChartInfo.h"
+#include "ChartList.h"
+#include "Tiles.h"
+
+static void testTileCoverage(){
+    LatLon nw(10,0);
+    LatLon se(0,10);
+    TileCoverage coverage(nw,se);
+    CHECK(! coverage.IsCovered());
+    //outside of the tile
+    coverage.Subtract(30,20,20,30);
+    CHECK(! coverage.IsCovered());
+    coverage.Subtract(10,0,0,5);
+    CHECK(! coverage.IsCovered());
+    coverage.Subtract(12,4,-2,12);
+    CHECK(coverage.IsCovered());
+    //a hole in the middle, then the rest around it
+    TileCoverage hole(nw,se);
+    hole.Subtract(6,4,4,6);
+    CHECK(! hole.IsCovered());
+    hole.Subtract(10,0,6,10);
+    hole.Subtract(4,0,0,10);
+    hole.Subtract(6,0,4,4);
+    CHECK(! hole.IsCovered());
+    hole.Subtract(6,6,4,10);
+    CHECK(hole.IsCovered());
+}
+
+/**
+ * without room for more rectangles the tile must stay uncovered
+ */
+static void testTileCoverageOverflow(){
+    LatLon nw(10,0);
+    LatLon se(0,10);
+    TileCoverage coverage(nw,se);
+    for (int row=0;row<10;row++){
+        for (int col=0;col<10;col++){
+            if (((row+col) % 2) != 0) continue;
+            coverage.Subtract(row+0.6,col+0.4,row+0.4,col+0.6);
+        }
+    }
+    CHECK(! coverage.IsCovered());
+}
+
+static void testPolygon(){
+    //triangle with its right angle in the south west
+    CoverPolygon triangle;
+    triangle.Add(0,0);
+    triangle.Add(0,10);
+    triangle.Add(10,0);
+    CHECK(triangle.Contains(2,2));
+    CHECK(! triangle.Contains(8,8));
+    CHECK(! triangle.Contains(11,5));
+    CHECK(triangle.Contains(3,1,1,3));
+    CHECK(! triangle.Contains(9,1,1,9));
+    CHECK(triangle.Intersects(9,1,1,9));
+    CHECK(! triangle.Intersects(10,8,8,10));
+    //rectangle around the complete polygon
+    CHECK(triangle.Intersects(20,-10,-10,20));
+    CHECK(! triangle.Contains(20,-10,-10,20));
+    CoverPolygon parsed;
+    CHECK(CoverPolygon::FromString(triangle.ToString(),parsed));
+    CHECK(parsed.points.size() == 3);
+    CHECK(parsed.Contains(2,2));
+    CHECK(! parsed.Contains(8,8));
+    CoverPolygon invalid;
+    CHECK(! CoverPolygon::FromString(wxT("1,1 2,2"),invalid));
+    CoverPolygon garbage;
+    CHECK(! CoverPolygon::FromString(wxT("1,1 x,2 3,3"),garbage));
+}
+
+static ExtentPI makeExtent(double north,double west,double south,double east){
+    ExtentPI rt;
+    rt.NLAT=north;
+    rt.WLON=west;
+    rt.SLAT=south;
+    rt.ELON=east;
+    return rt;
+}
+
+static void testChartCover(){
+    LatLon nw(54.6,10.2);
+    LatLon se(54.4,10.4);
+    ChartInfo plain(wxT("test"),wxT("DE5PLAIN.oesenc"));
+    plain.FromCache(20000,makeExtent(55,10,54,11));
+    TileCoverage coverage(nw,se);
+    //without COVR only the extent counts - but not for culling
+    plain.Cover(coverage,true);
+    CHECK(! coverage.IsCovered());
+    plain.Cover(coverage);
+    CHECK(coverage.IsCovered());
+    //COVR only for the western part of the tile
+    ChartInfo half(wxT("test"),wxT("DE5HALF.oesenc"));
+    half.FromCache(20000,makeExtent(55,10,54,11),wxT("54,10 54,10.3 55,10.3 55,10"));
+    TileCoverage halfCoverage(nw,se);
+    half.Cover(halfCoverage,true);
+    CHECK(! halfCoverage.IsCovered());
+    CHECK(half.HasTile(nw,se) > 0);
+    //a NoCOVR area containing the tile
+    ChartInfo hole(wxT("test"),wxT("DE5HOLE.oesenc"));
+    hole.FromCache(20000,makeExtent(55,10,54,11),wxT("54,10 54,11 55,11 55,10"),
+            wxT("54.3,10.1 54.3,10.5 54.7,10.5 54.7,10.1"));
+    CHECK(hole.HasTile(nw,se) == 0);
+}
+
+/**
+ * a base chart and a detail chart for a tile at the zoom of the detail chart
+ */
+static void findTile(ZoomLevelScales &scales,const wxString &covr,const wxString &noCovr,
+        bool cull,/*out*/size_t &numFound,/*out*/bool &hasDetail){
+    ChartList list;
+    ChartInfo *base=new ChartInfo(wxT("test"),wxT("DE1BASE.oesenc"));
+    base->FromCache(1000000,makeExtent(60,0,50,20));
+    list.AddChart(base);
+    ChartInfo *detail=new ChartInfo(wxT("test"),wxT("DE5DETAIL.oesenc"));
+    detail->FromCache(20000,makeExtent(55,10,54,11),covr,noCovr);
+    list.AddChart(detail);
+    list.UpdateZooms(&scales);
+    int zoom=detail->GetZoom();
+    int x=TileHelper::long2tilex(10.5,zoom);
+    int y=TileHelper::lat2tiley(54.5,zoom);
+    LatLon nw(TileHelper::tiley2lat(y,zoom),TileHelper::tilex2long(x,zoom));
+    LatLon se(TileHelper::tiley2lat(y+1,zoom),TileHelper::tilex2long(x+1,zoom));
+    WeightedChartList found=list.FindChartForTile(0,zoom,nw,se,0,cull);
+    numFound=found.size();
+    hasDetail=false;
+    for (size_t i=0;i<found.size();i++){
+        if (found[i].info == detail) hasDetail=true;
+    }
+}
+
+static void testCulling(){
+    ZoomLevelScales scales(1.0);
+    CHECK(scales.FindZoomForScale(20000) > scales.FindZoomForScale(1000000));
+    wxString square=wxT("54,10 54,11 55,11 55,10");
+    size_t numFound=0;
+    bool hasDetail=false;
+    findTile(scales,square,wxEmptyString,false,numFound,hasDetail);
+    CHECK(numFound == 2);
+    findTile(scales,square,wxEmptyString,true,numFound,hasDetail);
+    CHECK(numFound == 1);
+    CHECK(hasDetail);
+    //without COVR we cannot be sure - keep the base chart
+    findTile(scales,wxEmptyString,wxEmptyString,true,numFound,hasDetail);
+    CHECK(numFound == 2);
+    //the tile is in a NoCOVR area of the detail chart
+    findTile(scales,square,wxT("54.4,10.4 54.4,10.6 54.6,10.6 54.6,10.4"),true,numFound,hasDetail);
+    CHECK(numFound == 1);
+    CHECK(! hasDetail);
+}
+
+int main(int argc,char **argv){
+    wxInitializer initializer;
+    if (! initializer.IsOk()){
+        fprintf(stderr,"unable to initialize wx\n");
+        return 1;
+    }
+    wxString dir=testDir((argc > 1)?wxString(argv[1]):wxString(),wxT("CoverageTest"));
+    Logger::CreateInstance(wxFileName(dir,wxT("test.log")).GetFullPath());
+    runTest("tileCoverage",testTileCoverage);
+    runTest("tileCoverageOverflow",testTileCoverageOverflow);
+    runTest("polygon",testPolygon);
+    runTest("chartCover",testChartCover);
+    runTest("culling",testCulling);
+    return testResult();
+}
@@ -0,0 +1,189 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Tests for the main queue priorities and cancellation
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2010 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+#include <thread>
+#include <atomic>
+#include "UnitTest.h"
+#include "MainQueue.h"
+
+class TestMessage : public MainMessage{
+public:
+    bool processed=false;
+    TestMessage(Priority priority):MainMessage(priority){}
+    virtual void Process(bool discard=false){
+        processed=true;
+        SetDone();
+    }
+};
+
+/**
+ * a render request that is shared by several callers (coalescing)
+ * is only cancelled when the last of them gives up
+ */
+static void testWaiters(){
+    TestMessage *msg=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    msg->AddWaiter();
+    msg->AddWaiter();
+    CHECK(! msg->GiveUp());
+    CHECK(! msg->IsCancelled());
+    CHECK(msg->GiveUp());
+    CHECK(msg->IsCancelled());
+    //a new follower revives the request
+    msg->AddWaiter();
+    CHECK(! msg->IsCancelled());
+    //a finished request is never cancelled
+    msg->Process();
+    CHECK(! msg->GiveUp());
+    CHECK(! msg->IsCancelled());
+    msg->Unref();
+}
+
+static void testPromote(){
+    MainQueue queue;
+    TestMessage *msg=new TestMessage(MainMessage::PRIO_PREFILL);
+    CHECK(queue.Enqueue(msg,0));
+    CHECK(queue.NumQueued(MainMessage::PRIO_PREFILL) == 1);
+    queue.Promote(msg,MainMessage::PRIO_INTERACTIVE);
+    CHECK(msg->GetPriority() == MainMessage::PRIO_INTERACTIVE);
+    CHECK(queue.NumQueued(MainMessage::PRIO_PREFILL) == 0);
+    CHECK(queue.NumQueued(MainMessage::PRIO_INTERACTIVE) == 1);
+    //never lowers the priority
+    queue.Promote(msg,MainMessage::PRIO_HINT);
+    CHECK(msg->GetPriority() == MainMessage::PRIO_INTERACTIVE);
+    CHECK(queue.NumQueued(MainMessage::PRIO_INTERACTIVE) == 1);
+    msg->Unref();
+}
+
+static void testPromoteNotQueued(){
+    MainQueue queue;
+    //already taken by the main loop or a worker
+    TestMessage *msg=new TestMessage(MainMessage::PRIO_PREFILL);
+    queue.Promote(msg,MainMessage::PRIO_INTERACTIVE);
+    CHECK(msg->GetPriority() == MainMessage::PRIO_PREFILL);
+    CHECK(queue.NumQueued(MainMessage::PRIO_INTERACTIVE) == 0);
+    msg->Unref();
+}
+
+static void testPromoteDeadline(){
+    MainQueue queue;
+    TestMessage *msg=new TestMessage(MainMessage::PRIO_HINT);
+    msg->SetDeadline(50);
+    CHECK(queue.Enqueue(msg,0));
+    queue.Promote(msg,MainMessage::PRIO_INTERACTIVE,10000);
+    wxMilliSleep(100);
+    CHECK(! msg->IsExpired());
+    TestMessage *other=new TestMessage(MainMessage::PRIO_HINT);
+    other->SetDeadline(50);
+    wxMilliSleep(100);
+    CHECK(other->IsExpired());
+    other->Unref();
+    msg->Unref();
+}
+
+static void testDemote(){
+    MainQueue queue;
+    //cancelled while being processed
+    TestMessage *msg=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    msg->AddWaiter();
+    CHECK(msg->GiveUp());
+    CHECK(! msg->IsDemoted());
+    CHECK(queue.Demote(msg,MainMessage::PRIO_PREFILL,1000));
+    CHECK(msg->IsDemoted());
+    CHECK(msg->GetPriority() == MainMessage::PRIO_PREFILL);
+    CHECK(queue.NumQueued(MainMessage::PRIO_PREFILL) == 1);
+    CHECK(! msg->IsExpired());
+    CHECK(queue.ToJson().Find(wxT("\"demoted\":1")) != wxNOT_FOUND);
+    //a client asks again: back to interactive
+    msg->AddWaiter();
+    CHECK(! msg->IsCancelled());
+    queue.Promote(msg,MainMessage::PRIO_INTERACTIVE,1000);
+    CHECK(queue.NumQueued(MainMessage::PRIO_INTERACTIVE) == 1);
+    CHECK(queue.NumQueued(MainMessage::PRIO_PREFILL) == 0);
+    queue.Stop();
+    TestMessage *late=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    CHECK(! queue.Demote(late,MainMessage::PRIO_PREFILL,1000));
+    late->Unref();
+    msg->Unref();
+}
+
+static void testEnqueueTimeout(){
+    MainQueue queue;
+    TestMessage *first=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    CHECK(queue.Enqueue(first,0));
+    TestMessage *prefill=new TestMessage(MainMessage::PRIO_PREFILL);
+    wxLongLong start=wxGetLocalTimeMillis();
+    CHECK(! queue.Enqueue(prefill,200,true));
+    wxLongLong waited=wxGetLocalTimeMillis()-start;
+    CHECK(waited >= 150);
+    CHECK(queue.NumQueued(MainMessage::PRIO_PREFILL) == 0);
+    //only higher priorities block
+    TestMessage *interactive=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    CHECK(! queue.Enqueue(interactive,100,true));
+    CHECK(queue.Enqueue(interactive,100,false));
+    interactive->Unref();
+    prefill->Unref();
+    first->Unref();
+}
+
+/**
+ * timeout 0 waits until there is room or the queue is stopped
+ */
+static void testEnqueueNoTimeout(){
+    MainQueue queue;
+    TestMessage *first=new TestMessage(MainMessage::PRIO_INTERACTIVE);
+    CHECK(queue.Enqueue(first,0));
+    TestMessage *prefill=new TestMessage(MainMessage::PRIO_PREFILL);
+    std::atomic<int> result(-1);
+    std::thread producer([&]{
+        result=queue.Enqueue(prefill,0,true)?1:0;
+    });
+    wxMilliSleep(300);
+    CHECK(result == -1);
+    queue.Stop();
+    producer.join();
+    CHECK(result == 0);
+    CHECK(! queue.Enqueue(prefill,0));
+    prefill->Unref();
+    first->Unref();
+}
+
+int main(int argc,char **argv){
+    wxInitializer initializer;
+    if (! initializer.IsOk()){
+        fprintf(stderr,"unable to initialize wx\n");
+        return 1;
+    }
+    wxString dir=testDir((argc > 1)?wxString(argv[1]):wxString(),wxT("MainQueueTest"));
+    Logger::CreateInstance(wxFileName(dir,wxT("test.log")).GetFullPath());
+    runTest("waiters",testWaiters);
+    runTest("promote",testPromote);
+    runTest("promoteNotQueued",testPromoteNotQueued);
+    runTest("promoteDeadline",testPromoteDeadline);
+    runTest("demote",testDemote);
+    runTest("enqueueTimeout",testEnqueueTimeout);
+    runTest("enqueueNoTimeout",testEnqueueNoTimeout);
+    return testResult();
+}
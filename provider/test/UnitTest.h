@@ -0,0 +1,78 @@
+/******************************************************************************
+ *
+ * Project:  AvNav ocharts-provider
+ * Purpose:  Unit test helpers
+ * Author:   Andreas Vogel
+ *
+ ***************************************************************************
+ *   Copyright (C) 2010 by Andreas Vogel   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,  USA.             *
+ ***************************************************************************
+ *
+ */
+#ifndef UNITTEST_H
+#define UNITTEST_H
+#include <wx/wx.h>
+#include <wx/init.h>
+#include <wx/dir.h>
+#include <wx/filename.h>
+#include <stdio.h>
+#include "Logger.h"
+
+static int testFailures=0;
+
+#define CHECK(cond) \
+    do{ \
+        if (!(cond)){ \
+            fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+            testFailures++; \
+        } \
+    }while(0)
+
+/**
+ * create an empty directory for a test
+ * @param base the directory given on the command line (may be empty)
+ * @param name
+ */
+static wxString testDir(wxString base,wxString name){
+    if (base == wxEmptyString) base=wxFileName::GetTempDir();
+    wxFileName dir(base,wxEmptyString);
+    dir.AppendDir(name);
+    wxString path=dir.GetPath();
+    if (wxDirExists(path)) wxFileName::Rmdir(path,wxPATH_RMDIR_RECURSIVE);
+    wxFileName::Mkdir(path,0755,wxPATH_MKDIR_FULL);
+    return path;
+}
+
+/**
+ * run a test function and print its result
+ */
+static void runTest(const char *name,void (*test)()){
+    int before=testFailures;
+    test();
+    fprintf(stderr,"%s %s\n",(testFailures == before)?"OK  ":"FAIL",name);
+}
+
+static int testResult(){
+    if (testFailures > 0){
+        fprintf(stderr,"%d checks failed\n",testFailures);
+        return 1;
+    }
+    return 0;
+}
+
+#endif /* UNITTEST_H */